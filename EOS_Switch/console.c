@@ -0,0 +1,279 @@
+//
+//  console.c
+//  EOS_Switch
+//
+//  Copyright © 2017 Samuel Dewan. All rights reserved.
+//
+
+#include "console.h"
+
+#include "serial.h"
+
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <string.h>
+
+#include "./libethernet/libethernet.h"
+
+// MARK: Constants
+#define CONSOLE_UDP_TIMEOUT 100                     // ms a datagram waits for the MAC address of its host
+
+enum {CONSOLE_SERIAL, CONSOLE_UDP};
+
+// MARK: Variables
+// Lines from either stream are read into console_line. A datagram is copied in as a whole by the packet callback and
+// split into lines in place as they are read.
+static char console_line[CONSOLE_LINE_LENGTH];
+static uint8_t console_line_busy;                   // A line has been handed out and is in use until console_flush
+static uint8_t console_stream;
+static uint8_t console_held;
+
+static UDPSocket console_socket;
+static uint8_t console_udp_pending;                 // console_line holds a datagram which has not been read entirely
+static uint8_t console_udp_p;                       // Offset of the next line, past the end once all lines are read
+static uint8_t console_udp_end;
+static uint32_t console_udp_last_time;
+
+// The reply which is being collected, in the ethernet packet buffer
+static uint8_t *console_tx_buffer;
+static size_t console_tx_size;
+static size_t console_tx_length;
+
+// MARK: UDP
+/**
+ *  Checks if a host is in the allow-list
+ *  @param ip The address of the host
+ *  @return 1 if the host may use the console
+ */
+static uint8_t console_allowed (uint32_t ip)
+{
+    for (uint8_t i = 0; i < CONSOLE_ALLOW_COUNT; i++) {
+        uint32_t allowed = eeprom_read_dword((const uint32_t *)(SETTING_CONSOLE_ALLOW + (4 * i)));
+        if ((allowed != 0) && (allowed != 0xFFFFFFFF) && (allowed == ip)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void console_udp_open (UDPSocket socket, uint32_t ip)
+{
+    if (!console_allowed(ip) || console_held) {
+        // Closing the connection in the open callback makes the stack drop the packet
+        udp_disconnect(socket);
+        return;
+    }
+
+    // Only one host at a time, this also keeps the console from filling up the UDP table
+    if (console_socket != INVALID_UDP_SOCKET) {
+        udp_disconnect(console_socket);
+    }
+    console_socket = socket;
+}
+
+static void console_udp_close (UDPSocket socket)
+{
+    if (socket == console_socket) {
+        console_socket = INVALID_UDP_SOCKET;
+        console_tx_buffer = NULL;
+    }
+}
+
+static void console_udp_packet (UDPSocket socket, const uint8_t *buffer, size_t length)
+{
+    if ((socket != console_socket) || console_udp_pending || console_line_busy ||
+        (console_held && (console_stream != CONSOLE_UDP))) {
+        return;
+    }
+
+    if (length > (CONSOLE_LINE_LENGTH - 1)) {
+        length = CONSOLE_LINE_LENGTH - 1;
+    }
+    memcpy(console_line, buffer, length);
+    console_line[length] = '\0';
+
+    console_udp_end = length;
+    console_udp_p = 0;
+    console_udp_pending = 1;
+    console_udp_last_time = millis;
+}
+
+/**
+ *  Reads the next line of the datagram in console_line
+ *  @return The nul terminated line
+ */
+static char *console_udp_get_line (void)
+{
+    char *line = console_line + console_udp_p;
+    char *end = memchr(line, '\n', console_udp_end - console_udp_p);
+
+    if (end != NULL) {
+        console_udp_p = end - console_line + 1;
+        if ((end > line) && (*(end - 1) == '\r')) {
+            end--;
+        }
+        *end = '\0';
+    } else {
+        console_udp_p = console_udp_end;
+    }
+
+    // A trailing newline does not start another line
+    if (console_udp_p >= console_udp_end) {
+        console_udp_p = console_udp_end + 1;
+    }
+    return line;
+}
+
+/**
+ *  Checks if the datagram in console_line can be read. The reply is only built once the MAC address of the host is
+ *  known, so that sending it never waits for ARP. The datagram is dropped if the address is not found in time.
+ *  @return 1 if the datagram can be read
+ */
+static uint8_t console_udp_ready (void)
+{
+    if (!console_udp_pending) {
+        return 0;
+    }
+
+    const UDPTableEntry *udp_entry = udp_table_get_by_socket(console_socket);
+    if ((udp_entry != NULL) && ethernet_arp_lookup(udp_entry->RemoteIP)) {
+        return 1;
+    }
+    if ((udp_entry == NULL) || ((millis - console_udp_last_time) > CONSOLE_UDP_TIMEOUT)) {
+        console_udp_pending = 0;
+    }
+    return 0;
+}
+
+static void console_udp_put_byte (char c)
+{
+    if (console_tx_buffer == NULL) {
+        if ((console_socket == INVALID_UDP_SOCKET) ||
+            !udp_start_packet(console_socket, &console_tx_buffer, &console_tx_size)) {
+            console_tx_buffer = NULL;
+            return;
+        }
+        console_tx_length = 0;
+    }
+
+    console_tx_buffer[console_tx_length++] = c;
+    if (console_tx_length == console_tx_size) {
+        udp_send(console_tx_length);
+        console_tx_buffer = NULL;
+    }
+}
+
+// MARK: Functions
+void init_console (void)
+{
+    console_stream = CONSOLE_SERIAL;
+    console_socket = INVALID_UDP_SOCKET;
+    udp_open_port(CONSOLE_UDP_PORT, CONSOLE_UDP_TIMEOUT, console_udp_open, console_udp_close, console_udp_packet);
+}
+
+uint8_t console_select (void)
+{
+    if (console_udp_pending) {
+        // Serial lines wait meanwhile, they would be read over the datagram
+        if (console_udp_ready()) {
+            console_stream = CONSOLE_UDP;
+            return 1;
+        }
+        return 0;
+    } else if (serial_has_line()) {
+        console_stream = CONSOLE_SERIAL;
+        return 1;
+    }
+    return 0;
+}
+
+uint8_t console_has_line (void)
+{
+    if (console_stream == CONSOLE_UDP) {
+        return console_udp_ready() && (console_udp_p <= console_udp_end);
+    }
+    return serial_has_line();
+}
+
+char *console_get_line (void)
+{
+    console_line_busy = 1;
+
+    if (console_stream == CONSOLE_UDP) {
+        return console_udp_get_line();
+    }
+    serial_get_line(console_line, CONSOLE_LINE_LENGTH);
+    return console_line;
+}
+
+void console_hold (uint8_t hold)
+{
+    console_held = hold;
+}
+
+uint8_t console_expired (void)
+{
+    return (console_stream == CONSOLE_UDP) && !console_udp_pending &&
+           ((console_socket == INVALID_UDP_SOCKET) || ((millis - console_udp_last_time) > CONSOLE_SESSION_TIMEOUT));
+}
+
+void console_put_string (char *str)
+{
+    if (console_stream == CONSOLE_UDP) {
+        while (*str != '\0') {
+            console_udp_put_byte(*str++);
+        }
+    } else {
+        serial_put_string(str);
+    }
+}
+
+void console_put_string_P (const char *str)
+{
+    if (console_stream == CONSOLE_UDP) {
+        for (char c = pgm_read_byte(str); c != '\0'; c = pgm_read_byte(++str)) {
+            console_udp_put_byte(c);
+        }
+    } else {
+        serial_put_string_P(str);
+    }
+}
+
+void console_put_from_eeprom (uint16_t addr)
+{
+    if (console_stream == CONSOLE_UDP) {
+        for (char c = eeprom_read_byte((const uint8_t *)addr); c != '\0'; c = eeprom_read_byte((const uint8_t *)++addr)) {
+            console_udp_put_byte(c);
+        }
+    } else {
+        serial_put_from_eeprom(addr);
+    }
+}
+
+void console_put_byte (char c)
+{
+    if (console_stream == CONSOLE_UDP) {
+        console_udp_put_byte(c);
+    } else {
+        serial_put_byte(c);
+    }
+}
+
+uint8_t console_out_idle (void)
+{
+    // UDP output is sent by console_flush at the end of each iteration
+    return (console_stream == CONSOLE_UDP) || serial_out_idle();
+}
+
+void console_flush (void)
+{
+    if (console_tx_buffer != NULL) {
+        udp_send(console_tx_length);
+        console_tx_buffer = NULL;
+    }
+
+    if (console_udp_pending && (console_udp_p > console_udp_end)) {
+        console_udp_pending = 0;
+    }
+    console_line_busy = 0;
+}
@@ -0,0 +1,104 @@
+//
+//  console.h
+//  EOS_Switch
+//
+//  Copyright © 2017 Samuel Dewan. All rights reserved.
+//
+
+#ifndef console_h
+#define console_h
+
+#include "global.h"
+
+// Stream interface for the menu, so that the same commands can be served over the serial port and over UDP.
+//
+// Input is read line by line from the active stream. Output is written to the active stream: on the serial port it is
+// queued as usual, over UDP it is collected in the ethernet packet buffer and sent as one datagram per main loop
+// iteration (or once a datagram is full), see console_flush.
+//
+// UDP: the console listens on CONSOLE_UDP_PORT and only accepts datagrams from the hosts in the allow-list
+// (SETTING_CONSOLE_ALLOW, empty entries are 0.0.0.0 or 255.255.255.255, no entries means the UDP console is disabled).
+// A datagram may contain several lines, a trailing newline is optional. Datagrams which arrive while the previous one
+// is still being processed are dropped, so hosts should wait for the prompt before sending the next request. Only one
+// host is served at a time, a new host takes over once the previous one is not in the middle of a command.
+
+#define CONSOLE_UDP_PORT            2323
+#define CONSOLE_ALLOW_COUNT         4       // The number of addresses in the allow-list
+#define CONSOLE_LINE_LENGTH         128     // Longer payloads can only be set through the control protocol
+#define CONSOLE_SESSION_TIMEOUT     30000   // A UDP host that stops answering mid command is dropped after this many ms
+
+/**
+ *  Initilize the console, must be called after init_network
+ */
+extern void init_console (void);
+
+/**
+ *  Selects a stream on which a line is avaliable as the active stream
+ *  @note Only to be used while no command is waiting for further input, see console_hold
+ *  @return 1 if a line is avaliable, 0 otherwise
+ */
+extern uint8_t console_select (void);
+
+/**
+ *  Determin if there is a line avaliable from the active stream
+ *  @return 0 if there is no line avaliable, 1 if a line is avaliable
+ */
+extern uint8_t console_has_line (void);
+
+/**
+ *  Reads the next line from the active stream
+ *  @note The line stays valid until console_flush is called, it may be modified in place
+ *  @return The nul terminated line, without the newline
+ */
+extern char *console_get_line (void);
+
+/**
+ *  Keeps the active stream while a command waits for further input, lines from other streams are left waiting
+ *  @param hold 1 to keep the active stream, 0 to release it
+ */
+extern void console_hold (uint8_t hold);
+
+/**
+ *  Determin if the host on the active stream has gone away while the stream is held
+ *  @return 1 if the command that is waiting for input should be abandoned
+ */
+extern uint8_t console_expired (void);
+
+/**
+ *  Writes a string to the active stream
+ *  @param str A nul terminated string
+ */
+extern void console_put_string (char *str);
+
+/**
+ *  Writes a string from program memory to the active stream
+ *  @param str A pointer to the string in program memory
+ */
+extern void console_put_string_P (const char *str);
+
+/**
+ *  Writes a nul terminated string from EEPROM to the active stream
+ *  @param addr The addres of the string in EEPROM
+ */
+extern void console_put_from_eeprom (uint16_t addr);
+
+/**
+ *  Write a character to the active stream
+ *  @param c The character to be written
+ */
+extern void console_put_byte (char c);
+
+/**
+ *  Determin if the output of the active stream has been sent
+ *  @return 1 if all output has been sent, 0 otherwise
+ */
+extern uint8_t console_out_idle (void);
+
+/**
+ *  Sends the output collected for UDP and releases the line buffer, to be called once per main loop iteration
+ *  @note As the output is collected in the ethernet packet buffer, no other packets may be sent or recieved between
+ *        writing to the console and calling this function
+ */
+extern void console_flush (void);
+
+#endif /* console_h */
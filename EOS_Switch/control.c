@@ -0,0 +1,416 @@
+//
+//  control.c
+//  EOS_Switch
+//
+//  Copyright © 2017 Samuel Dewan. All rights reserved.
+//
+
+#include "control.h"
+
+#include "network.h"
+#include "pindefinitions.h"
+#include "serial.h"
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
+// MARK: Constants
+#define CONTROL_FRAME_LENGTH    (CONTROL_MAX_PAYLOAD + 5)   // Sequence, command, status, payload and CRC
+#define CONTROL_ENCODED_LENGTH  (CONTROL_FRAME_LENGTH + 1)  // COBS adds one byte per 254 bytes
+#define CONTROL_RX_IDLE_TIMEOUT 50                          // ms without a byte after which a partial frame is dropped
+
+enum {CONTROL_RX_TEXT, CONTROL_RX_FRAME, CONTROL_RX_DISCARD};
+
+struct control_field {
+    uint16_t address;
+    uint8_t length;
+};
+
+static const struct control_field control_fields[] PROGMEM = {
+    {SETTING_MAC_ADDR, 6},
+    {SETTING_IP_ADDR, 4},
+    {SETTING_ROUTER_ADDR, 4},
+    {SETTING_NETMASK, 4},
+    {SETTING_DNS_ADDR, 4},
+    {SETTING_NTP_ADDR, 4},
+    {SETTING_GMT_OFFSET, 1},
+    {SETTING_DCHP, 1},
+    {SETTING_HOSTNAME, 32},
+    {SETTING_TARGET_IP, 4},
+    {SETTING_TARGET_PORT, 2},
+    {SETTING_T_ONE_RISE, 200},
+    {SETTING_T_ONE_FALL, 200},
+    {SETTING_T_TWO_RISE, 200},
+    {SETTING_T_TWO_FALL, 200},
+    {SETTING_T_ONE_RISE_LEN, 1},
+    {SETTING_T_ONE_FALL_LEN, 1},
+    {SETTING_T_TWO_RISE_LEN, 1},
+    {SETTING_T_TWO_FALL_LEN, 1},
+    {SETTING_CONSOLE_ALLOW, 16},
+    {SETTING_REPLAY_POLICY, 1},
+    {SETTING_REPLAY_MAX_AGE, 2},
+    {SETTING_TARGET_DSCP, 1},
+    {SETTING_VLAN_ID, 2},
+    {SETTING_VLAN_PCP, 1},
+    {SETTING_TARGET_PCP, 1},
+    {SETTING_TARGET_IPS, 12},
+    {SETTING_T_TARGETS, 4},
+    {SETTING_BACKUP_IP, 4},
+    {SETTING_PROBE_INTERVAL, 2},
+    {SETTING_PROBE_LIMIT, 1},
+    {SETTING_FAILBACK, 1},
+    {SETTING_RELIABLE, 1},
+    {SETTING_RELIABLE_RETRIES, 1},
+    {SETTING_BURST_COUNT, 1},
+    {SETTING_BURST_GAP, 2}
+};
+
+#define CONTROL_NUM_FIELDS (sizeof(control_fields) / sizeof(control_fields[0]))
+
+// MARK: Variables
+// The RX ISR fills the recieve buffer, once a frame is complete it belongs to control_service until it clears
+// control_rx_ready. Frames that arrive in the mean time are discarded.
+static volatile uint8_t control_rx_buffer[CONTROL_ENCODED_LENGTH];
+static volatile uint8_t control_rx_length;
+static volatile uint8_t control_rx_state;
+static volatile uint8_t control_rx_ready;
+static uint16_t control_rx_time;                    // The low bits of millis when the last byte of a frame arrived
+
+// The last response, kept so that it can be resent if the host retries the request
+static uint8_t control_tx_buffer[CONTROL_FRAME_LENGTH];
+static uint8_t control_tx_length;
+static uint8_t control_tx_pending;
+static uint8_t control_last_seq;
+static uint8_t control_last_valid;
+
+// EEPROM writes of a set request are done one byte per main loop iteration so that triggers are never held up
+static uint8_t control_write_pending;
+static uint8_t control_write_p;                     // Offset of the next byte in the request
+static uint8_t control_write_end;
+static uint16_t control_write_address;
+static uint8_t control_write_remaining;             // Bytes left in the current field
+static uint8_t control_payload_changed;             // A payload has been written and has to be compiled again
+
+// MARK: Helpers
+static inline void control_set_cts (uint8_t ready)
+{
+#ifdef CONTROL_CTS_PORT
+    if (ready) {
+        CONTROL_CTS_PORT &= ~(1<<CONTROL_CTS_NUM);
+    } else {
+        CONTROL_CTS_PORT |= (1<<CONTROL_CTS_NUM);
+    }
+#else
+    (void)ready;
+#endif
+}
+
+static uint16_t control_crc (const uint8_t *data, uint8_t length)
+{
+    uint16_t crc = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        crc = _crc_xmodem_update(crc, data[i]);
+    }
+    return crc;
+}
+
+/**
+ *  Decodes a COBS encoded frame in place
+ *  @return The length of the decoded frame, 0 if the encoding is invalid
+ */
+static uint8_t control_cobs_decode (uint8_t *buffer, uint8_t length)
+{
+    uint8_t read = 0;
+    uint8_t write = 0;
+
+    while (read < length) {
+        uint8_t code = buffer[read++];
+        if (((uint16_t)read + code - 1) > length) {
+            return 0;
+        }
+        for (uint8_t i = 1; i < code; i++) {
+            buffer[write++] = buffer[read++];
+        }
+        if ((code != 0xFF) && (read < length)) {
+            buffer[write++] = 0;
+        }
+    }
+    return write;
+}
+
+/**
+ *  COBS encodes a frame straight into the serial output
+ */
+static void control_send_frame (const uint8_t *frame, uint8_t length)
+{
+    uint8_t delimiter = 0;
+    uint8_t start = 0;
+
+    serial_put_raw(&delimiter, 1);
+    for (;;) {
+        uint8_t end = start;
+        while ((end < length) && (frame[end] != 0) && ((end - start) < 254)) {
+            end++;
+        }
+
+        uint8_t code = end - start + 1;
+        serial_put_raw(&code, 1);
+        serial_put_raw(frame + start, end - start);
+
+        if (end >= length) {
+            break;
+        }
+        start = (frame[end] == 0) ? end + 1 : end;
+    }
+    serial_put_raw(&delimiter, 1);
+}
+
+/**
+ *  Gets the EEPROM address of a part of a field
+ *  @return The address, 0 if the field does not exist or is shorter than offset + length
+ */
+static uint16_t control_field_address (uint8_t field, uint8_t offset, uint8_t length)
+{
+    if (field >= CONTROL_NUM_FIELDS) {
+        return 0;
+    }
+    if (((uint16_t)offset + length) > pgm_read_byte(&control_fields[field].length)) {
+        return 0;
+    }
+    return pgm_read_word(&control_fields[field].address) + offset;
+}
+
+// MARK: Requests
+/**
+ *  Builds the response to a get request in the transmit buffer
+ *  @return The status
+ */
+static uint8_t control_handle_get (const uint8_t *payload, uint8_t length)
+{
+    uint8_t *data = control_tx_buffer + 3;
+    uint8_t data_length = 0;
+
+    for (uint8_t i = 0; i < length; i += 3) {
+        if ((length - i) < 3) {
+            return CONTROL_STATUS_BAD_LENGTH;
+        }
+        uint16_t address = control_field_address(payload[i], payload[i + 1], payload[i + 2]);
+        if (address == 0) {
+            return CONTROL_STATUS_BAD_FIELD;
+        }
+        if ((data_length + payload[i + 2]) > CONTROL_MAX_PAYLOAD) {
+            return CONTROL_STATUS_BAD_LENGTH;
+        }
+        eeprom_read_block(data + data_length, (const void *)address, payload[i + 2]);
+        data_length += payload[i + 2];
+    }
+
+    control_tx_length += data_length;
+    return CONTROL_STATUS_OK;
+}
+
+/**
+ *  Validates a set request, the writes are started if it is valid
+ *  @param start The offset of the payload in the recieve buffer
+ *  @return The status
+ */
+static uint8_t control_handle_set (const uint8_t *frame, uint8_t start, uint8_t end)
+{
+    for (uint8_t i = start; i < end; i += 3 + frame[i + 2]) {
+        if (((end - i) < 3) || ((end - i - 3) < frame[i + 2])) {
+            return CONTROL_STATUS_BAD_LENGTH;
+        }
+        if (control_field_address(frame[i], frame[i + 1], frame[i + 2]) == 0) {
+            return CONTROL_STATUS_BAD_FIELD;
+        }
+    }
+
+    control_write_p = start;
+    control_write_end = end;
+    control_write_remaining = 0;
+    control_write_pending = 1;
+    return CONTROL_STATUS_OK;
+}
+
+/**
+ *  Continues the EEPROM writes of a set request
+ *  @return 1 once all writes are done
+ */
+static uint8_t control_continue_write (void)
+{
+    const uint8_t *frame = (const uint8_t *)control_rx_buffer;
+
+    while (eeprom_is_ready()) {
+        if (control_write_remaining == 0) {
+            if (control_write_p >= control_write_end) {
+                return 1;
+            }
+            control_write_address = control_field_address(frame[control_write_p], frame[control_write_p + 1],
+                                                          frame[control_write_p + 2]);
+            control_write_remaining = frame[control_write_p + 2];
+            if ((frame[control_write_p] >= CONTROL_FIELD_T_ONE_RISE) &&
+                (frame[control_write_p] <= CONTROL_FIELD_T_TWO_FALL_LEN)) {
+                control_payload_changed = 1;
+            }
+            control_write_p += 3;
+            continue;
+        }
+
+        // Only starts a write if the value differs, unchanged bytes are skipped without waiting
+        eeprom_update_byte((uint8_t *)control_write_address, frame[control_write_p]);
+        control_write_address++;
+        control_write_p++;
+        control_write_remaining--;
+    }
+    return 0;
+}
+
+static void control_finish_request (uint8_t status)
+{
+    control_tx_buffer[2] = status;
+    uint16_t crc = control_crc(control_tx_buffer, control_tx_length);
+    control_tx_buffer[control_tx_length++] = crc & 0xFF;
+    control_tx_buffer[control_tx_length++] = crc >> 8;
+    control_tx_pending = 1;
+
+    // Release the recieve buffer for the next request
+    control_rx_ready = 0;
+    control_set_cts(1);
+}
+
+static void control_handle_frame (void)
+{
+    uint8_t *frame = (uint8_t *)control_rx_buffer;
+    uint8_t length = control_cobs_decode(frame, control_rx_length);
+
+    if (length < 4) {                               // Not even a sequence number, nobody to answer to
+        control_rx_ready = 0;
+        control_set_cts(1);
+        return;
+    }
+
+    uint8_t seq = frame[0];
+    uint8_t command = frame[1];
+    uint16_t crc = frame[length - 2] | ((uint16_t)frame[length - 1] << 8);
+
+    if ((crc == control_crc(frame, length - 2)) && control_last_valid && (seq == control_last_seq)) {
+        // Retry of the previous request, resend the response which is still in the buffer
+        control_tx_pending = 1;
+        control_rx_ready = 0;
+        control_set_cts(1);
+        return;
+    }
+
+    control_tx_buffer[0] = seq;
+    control_tx_buffer[1] = command | CONTROL_RESPONSE;
+    control_tx_length = 3;
+
+    if (crc != control_crc(frame, length - 2)) {
+        control_last_valid = 0;
+        control_finish_request(CONTROL_STATUS_BAD_CRC);
+        return;
+    }
+    control_last_seq = seq;
+    control_last_valid = 1;
+
+    switch (command) {
+        case CONTROL_CMD_PING:
+            control_tx_buffer[3] = CONTROL_PROTOCOL_VERSION;
+            control_tx_buffer[4] = CONTROL_MAX_PAYLOAD;
+            control_tx_length += 2;
+            control_finish_request(CONTROL_STATUS_OK);
+            break;
+        case CONTROL_CMD_GET:
+            control_finish_request(control_handle_get(frame + 2, length - 4));
+            break;
+        case CONTROL_CMD_SET:
+        {
+            uint8_t status = control_handle_set(frame, 2, length - 2);
+            if (status != CONTROL_STATUS_OK) {
+                control_finish_request(status);
+            }                                       // Otherwise the response is sent once the writes are done
+            break;
+        }
+        default:
+            control_finish_request(CONTROL_STATUS_BAD_COMMAND);
+            break;
+    }
+}
+
+// MARK: Functions
+void init_control (void)
+{
+#ifdef CONTROL_CTS_PORT
+    CONTROL_CTS_DDR |= (1<<CONTROL_CTS_NUM);
+#endif
+    control_set_cts(1);
+}
+
+uint8_t control_receive_byte (uint8_t byte)
+{
+    // Frames are sent in one go, a gap means that the frame was cut off or that the 0x00 which started it was noise.
+    // Without this a stray 0x00 would swallow all further menu input.
+    uint16_t now = millis;
+    if ((control_rx_state != CONTROL_RX_TEXT) && ((uint16_t)(now - control_rx_time) > CONTROL_RX_IDLE_TIMEOUT)) {
+        control_rx_state = CONTROL_RX_TEXT;
+    }
+    control_rx_time = now;
+    
+    if (byte == 0x00) {
+        if (control_rx_state == CONTROL_RX_FRAME) {
+            if (control_rx_length != 0) {           // End of frame, otherwise repeated delimiters are ignored
+                control_rx_ready = 1;
+                control_rx_state = CONTROL_RX_TEXT;
+                control_set_cts(0);
+            }
+        } else if (control_rx_state == CONTROL_RX_DISCARD) {
+            control_rx_state = CONTROL_RX_TEXT;
+        } else {                                    // Start of frame
+            control_rx_length = 0;
+            control_rx_state = control_rx_ready ? CONTROL_RX_DISCARD : CONTROL_RX_FRAME;
+        }
+        return 1;
+    }
+
+    switch (control_rx_state) {
+        case CONTROL_RX_TEXT:
+            return 0;
+        case CONTROL_RX_FRAME:
+            if (control_rx_length < CONTROL_ENCODED_LENGTH) {
+                control_rx_buffer[control_rx_length++] = byte;
+            } else {
+                control_rx_state = CONTROL_RX_DISCARD;
+            }
+            break;
+        default:
+            break;
+    }
+    return 1;
+}
+
+void control_service (void)
+{
+    if (control_write_pending) {
+        if (control_continue_write()) {
+            control_write_pending = 0;
+            uint8_t status = CONTROL_STATUS_OK;
+            if (control_payload_changed) {
+                control_payload_changed = 0;
+                if (!network_compile_payloads()) {
+                    status = CONTROL_STATUS_BAD_PAYLOAD;
+                }
+            }
+            control_finish_request(status);
+        }
+    } else if (control_rx_ready && !control_tx_pending) {
+        control_handle_frame();
+    }
+
+    // The response is only queued as a whole, a partially sent frame would just be dropped by the host
+    if (control_tx_pending && (serial_out_free() >= (control_tx_length + 4))) {
+        control_send_frame(control_tx_buffer, control_tx_length);
+        control_tx_pending = 0;
+    }
+}
@@ -0,0 +1,110 @@
+//
+//  control.h
+//  EOS_Switch
+//
+//  Copyright © 2017 Samuel Dewan. All rights reserved.
+//
+
+#ifndef control_h
+#define control_h
+
+#include "global.h"
+
+// Binary control protocol, used for machine driven configuration on the same UART as the menu.
+//
+// Frames are COBS encoded and delimited by 0x00 on both ends. As menu text never contains 0x00, frames and text can
+// be told apart by both sides. A decoded frame is laid out as follows:
+//      [sequence] [command] [payload ...] [CRC low] [CRC high]
+// The CRC-16 (XMODEM, polynomial 0x1021, initial value 0) covers sequence, command and payload.
+//
+// Every request is answered with the same sequence number, the command or'ed with CONTROL_RESPONSE, a status byte and
+// the response data. A request which carries the sequence number of the previous one is not executed again, the
+// previous response is resent instead, so requests can safely be retried after a timeout.
+//
+// There is no flow control (neither RTS/CTS nor XON/XOFF): only one request may be outstanding, the host has to wait
+// for the response (or a timeout) before sending the next one. Frames which arrive while a request is still being
+// processed are dropped. If CONTROL_CTS_PORT is defined in pindefinitions.h (it is not by default), that pin is
+// driven low while a request can be accepted and can be wired to the CTS input of the host.
+//
+// The bytes of a frame have to follow each other without a gap of more than CONTROL_RX_IDLE_TIMEOUT ms (control.c),
+// otherwise the partial frame is dropped and the following bytes are menu input again. Bytes with a framing error
+// (such as a break) are ignored.
+
+#define CONTROL_PROTOCOL_VERSION    1
+#define CONTROL_MAX_PAYLOAD         32      // The maximum length of the payload of requests and responses
+
+// MARK: Commands
+#define CONTROL_CMD_PING            0x01    // Response: [version] [max payload]
+#define CONTROL_CMD_GET             0x02    // Request: ([field] [offset] [length])...   Response: the data, concatenated
+#define CONTROL_CMD_SET             0x03    // Request: ([field] [offset] [length] [data ...])...
+#define CONTROL_RESPONSE            0x80
+
+// MARK: Status codes
+#define CONTROL_STATUS_OK           0x00
+#define CONTROL_STATUS_BAD_CRC      0x01
+#define CONTROL_STATUS_BAD_COMMAND  0x02
+#define CONTROL_STATUS_BAD_FIELD    0x03    // Unknown field or offset and length beyond the end of the field
+#define CONTROL_STATUS_BAD_LENGTH   0x04    // Truncated request or response too long
+#define CONTROL_STATUS_BAD_PAYLOAD  0x05    // Written, but a payload has placeholders that can't be filled in (network.h)
+
+// MARK: Fields
+// Fields are read and written as their raw EEPROM contents, see the settings in global.h for their layout. Payloads
+// longer than CONTROL_MAX_PAYLOAD are uploaded in several parts using the offset, followed by their length field. A SET
+// that changes a payload is answered with CONTROL_STATUS_BAD_PAYLOAD if the placeholders of a payload can't be filled
+// in, the answer to writing the length field is the one that counts.
+#define CONTROL_FIELD_MAC           0       // 6 bytes
+#define CONTROL_FIELD_IP            1       // 4 bytes
+#define CONTROL_FIELD_ROUTER        2       // 4 bytes
+#define CONTROL_FIELD_NETMASK       3       // 4 bytes
+#define CONTROL_FIELD_DNS           4       // 4 bytes
+#define CONTROL_FIELD_NTP           5       // 4 bytes
+#define CONTROL_FIELD_GMT_OFFSET    6       // 1 byte
+#define CONTROL_FIELD_DHCP          7       // 1 byte
+#define CONTROL_FIELD_HOSTNAME      8       // 32 bytes
+#define CONTROL_FIELD_TARGET_IP     9       // 4 bytes
+#define CONTROL_FIELD_TARGET_PORT   10      // 2 bytes
+#define CONTROL_FIELD_T_ONE_RISE    11      // 200 bytes
+#define CONTROL_FIELD_T_ONE_FALL    12      // 200 bytes
+#define CONTROL_FIELD_T_TWO_RISE    13      // 200 bytes
+#define CONTROL_FIELD_T_TWO_FALL    14      // 200 bytes
+#define CONTROL_FIELD_T_ONE_RISE_LEN 15     // 1 byte
+#define CONTROL_FIELD_T_ONE_FALL_LEN 16     // 1 byte
+#define CONTROL_FIELD_T_TWO_RISE_LEN 17     // 1 byte
+#define CONTROL_FIELD_T_TWO_FALL_LEN 18     // 1 byte
+#define CONTROL_FIELD_CONSOLE_ALLOW 19      // 16 bytes
+#define CONTROL_FIELD_REPLAY_POLICY 20      // 1 byte
+#define CONTROL_FIELD_REPLAY_MAX_AGE 21     // 2 bytes
+#define CONTROL_FIELD_TARGET_DSCP   22      // 1 byte
+#define CONTROL_FIELD_VLAN_ID       23      // 2 bytes
+#define CONTROL_FIELD_VLAN_PCP      24      // 1 byte
+#define CONTROL_FIELD_TARGET_PCP    25      // 1 byte
+#define CONTROL_FIELD_TARGET_IPS    26      // 12 bytes
+#define CONTROL_FIELD_T_TARGETS     27      // 4 bytes
+#define CONTROL_FIELD_BACKUP_IP     28      // 4 bytes
+#define CONTROL_FIELD_PROBE_INTERVAL 29     // 2 bytes
+#define CONTROL_FIELD_PROBE_LIMIT   30      // 1 byte
+#define CONTROL_FIELD_FAILBACK      31      // 1 byte
+#define CONTROL_FIELD_RELIABLE      32      // 1 byte
+#define CONTROL_FIELD_RELIABLE_RETRIES 33   // 1 byte
+#define CONTROL_FIELD_BURST_COUNT   34      // 1 byte
+#define CONTROL_FIELD_BURST_GAP     35      // 2 bytes
+
+/**
+ *  Initilize the control protocol
+ */
+extern void init_control (void);
+
+/**
+ *  Passes a recieved byte to the control protocol
+ *  @note Called from the USART RX ISR
+ *  @param byte The recieved byte
+ *  @return 1 if the byte is part of a control frame, 0 if it is menu input
+ */
+extern uint8_t control_receive_byte (uint8_t byte);
+
+/**
+ *  Service to be run in each iteration of the main loop, never blocks
+ */
+extern void control_service (void);
+
+#endif /* control_h */
@@ -36,6 +36,24 @@
 #define SETTING_T_TWO_RISE_LEN  102     // 1 byte
 #define SETTING_T_TWO_FALL_LEN  103     // 1 byte
 
+#define SETTING_CONSOLE_ALLOW   104     // 16 bytes, four IP addresses
+#define SETTING_REPLAY_POLICY   120     // 1 byte
+#define SETTING_REPLAY_MAX_AGE  121     // 2 bytes, milliseconds
+#define SETTING_TARGET_DSCP     123     // 1 byte, values above 63 select NETWORK_DEFAULT_DSCP
+#define SETTING_VLAN_ID         124     // 2 bytes, 4095 and above for untagged frames
+#define SETTING_VLAN_PCP        126     // 1 byte, values above 7 select NETWORK_DEFAULT_PCP
+#define SETTING_TARGET_PCP      127     // 1 byte, values above 7 select NETWORK_DEFAULT_TARGET_PCP
+#define SETTING_TARGET_IPS      128     // 12 bytes, targets 2 to 4, empty entries are 0.0.0.0 or 255.255.255.255
+#define SETTING_T_TARGETS       140     // 4 bytes, for each trigger event a mask of the targets it is sent to
+#define SETTING_BACKUP_IP       144     // 4 bytes, 0.0.0.0 or 255.255.255.255 disables failover
+#define SETTING_PROBE_INTERVAL  148     // 2 bytes, milliseconds, 0 and 65535 select NETWORK_DEFAULT_PROBE_INTERVAL
+#define SETTING_PROBE_LIMIT     150     // 1 byte, 0 and 255 select NETWORK_DEFAULT_PROBE_LIMIT
+#define SETTING_FAILBACK        151     // 1 byte, 1 to return to the primary target once it answers again
+#define SETTING_RELIABLE        152     // 1 byte, 1 to have payloads acknowledged and retransmitted
+#define SETTING_RELIABLE_RETRIES 153    // 1 byte, 255 selects NETWORK_DEFAULT_RETRIES
+#define SETTING_BURST_COUNT     154     // 1 byte, copies of each payload, 0 and 255 for a single one
+#define SETTING_BURST_GAP       155     // 2 bytes, ms between copies, 65535 selects NETWORK_DEFAULT_BURST_GAP
+
 #define SETTING_T_ONE_RISE      224     // 200 bytes
 #define SETTING_T_ONE_FALL      424     // 200 bytes
 #define SETTING_T_TWO_RISE      624     // 200 bytes
@@ -62,7 +62,9 @@ void arp_table_add(const uint8_t* MAC,uint32_t IP)
 	const ARPTableEntry* entry = arp_table_get(IP);
 	
 	if(entry){
-		// If we already have data about that IP, simply refresh it
+		// If we already have data about that IP, simply refresh it. The host may have been replaced meanwhile.
+		for(uint8_t idx = 0; idx < sizeof(entry->MAC); ++idx)
+			((ARPTableEntry*)entry)->MAC[idx] = MAC[idx];
 		((ARPTableEntry*)entry)->TimeLeft = ARP_TABLE_TIMEOUT;
 	}else{
 		// Insert a new entry
@@ -32,36 +32,67 @@
  * If defined, interrupts will be used to detect incoming packets and link status changes
  * If not defined, the ENC28J60 will continuously be polled for those events
  */
-//#define USE_INTERRUPTS
+#define USE_INTERRUPTS
 
 /**
  * If defined, link status changes will be detected via an interrupt and can be handled in a callback
  * @remark This feature takes about 100 bytes in program memory
  */
-//#define HANDLE_LINK_STATUS_CHANGES
+#define HANDLE_LINK_STATUS_CHANGES
 
 /// The maximum transmission unit size in bytes (maximum size of a data packet - including headers - that can be sent/received)
 #define MTU_SIZE 400
 
+/**
+ * If defined, frames can be tagged with an IEEE 802.1Q VLAN tag and tagged frames are accepted (see enc28j60_set_vlan)
+ * @remark The tag is inserted and stripped by the ENC28J60 driver, the rest of the stack only sees untagged frames
+ */
+#define IMPLEMENT_VLAN
+
+/**
+ * If defined, a frame can be kept in the controller and sent again without copying it over SPI again (see udp_send_repeatable)
+ * @remark The frame is kept in a 512 byte slot which is taken from the receive buffer
+ */
+#define IMPLEMENT_REPEAT
+
 /// Size of the ARP table
 #define ARP_TABLE_SIZE 5
 
 /// Time (in seconds) until ARP table entries expire
 #define ARP_TABLE_TIMEOUT 30
 
+/// Time (in seconds) before an ARP table entry expires from which ethernet_arp_lookup asks for it again
+#define ARP_TABLE_REFRESH_TIME 5
+
+/**
+ * The maximum number of packets a single call of ethernet_update will receive
+ * @remark Packets beyond this stay queued in the controller and are handled on the next call, so the main loop keeps running during broadcast storms
+ */
+#define ETHERNET_RX_BUDGET_PACKETS 4
+
+/// The maximum time (in milliseconds) a single call of ethernet_update will spend receiving packets, 0 for no time limit
+#define ETHERNET_RX_BUDGET_TIME 2
+
 /**
  * If defined, ICMP will be implemented (recommended!)
  * @remark This feature takes about 250 bytes in program memory
  */
 #define IMPLEMENT_ICMP
 
+/// If defined, IGMP (version 2) will be implemented so that multicast groups can be joined
+#define IMPLEMENT_IGMP
+#ifdef IMPLEMENT_IGMP
+/// The maximum number of multicast groups that can be joined at the same time
+#	define IGMP_GROUP_TABLE_SIZE 2
+#endif
+
 /// If defined, UDP will be implemented
 #define IMPLEMENT_UDP
 #ifdef IMPLEMENT_UDP
 /// The size of the UDP application table (= how many ports can be listened on at the same time)
-#	define UDP_APPLICATION_TABLE_SIZE 1
+#	define UDP_APPLICATION_TABLE_SIZE 3
 /// The size of the UDP table (= how many UDP connections can be held at the same time)
-#	define UDP_TABLE_SIZE 1
+#	define UDP_TABLE_SIZE 3
 #endif
 
 /// If defined, TCP will be implemented
@@ -36,6 +36,11 @@
 #	endif
 #endif
 
+// Check if the receive budget allows any packet to be received at all
+#if ETHERNET_RX_BUDGET_PACKETS < 1
+#	error "ETHERNET_RX_BUDGET_PACKETS must be at least 1!"
+#endif
+
 // Check if UDP is implemented when DNS is enabled
 #ifdef IMPLEMENT_DNS
 #	ifndef IMPLEMENT_UDP
@@ -26,12 +26,12 @@
 \* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include "global.h"
+#include "../global.h"
 #include "utils.h"
 #include "enc28j60.h"
 #include "ethernet.h"
 #include "dhcp.h"
 
-#include <util/delay.h>
 #include <string.h>
 
 #ifdef IMPLEMENT_DHCP
@@ -264,7 +264,7 @@ void _dhcp_send_discover(UDPSocket Socket, uint32_t PreferredIP, const char* Hos
  * @param Socket The socket to send the packet to
  * @param IP The IP address we want to use.
  * @param Hostname Our module's Hostname. Can be NULL for no hostname
- * @param ServerIP The IP address of the DHCP server that offered the configuration to us
+ * @param ServerIP The IP address of the DHCP server that offered the configuration to us, 0 to verify a previous configuration with any server
  */
 void _dhcp_send_request(UDPSocket Socket, uint32_t IP, const char* Hostname, uint32_t ServerIP)
 {
@@ -293,14 +293,16 @@ void _dhcp_send_request(UDPSocket Socket, uint32_t IP, const char* Hostname, uin
 	SET_UINT32(Buffer,Offset,IP);
 	Offset += sizeof(uint32_t);
 
-	// Server IP
-	SET_UINT8(Buffer,Offset,54);
-	Offset += sizeof(uint8_t);
-	SET_UINT8(Buffer,Offset,sizeof(uint32_t));
-	Offset += sizeof(uint8_t);
+	// Server IP (must not be sent when verifying a previous configuration)
+	if(ServerIP){
+		SET_UINT8(Buffer,Offset,54);
+		Offset += sizeof(uint8_t);
+		SET_UINT8(Buffer,Offset,sizeof(uint32_t));
+		Offset += sizeof(uint8_t);
 
-	SET_UINT32(Buffer,Offset,ServerIP);
-	Offset += sizeof(uint32_t);
+		SET_UINT32(Buffer,Offset,ServerIP);
+		Offset += sizeof(uint32_t);
+	}
 
 	// Hostname
 	if(Hostname){
@@ -544,22 +546,13 @@ void _dhcp_renew(void)
 // -----------------------------------------------------------------------------------------------
 bool dhcp_request(const char* Hostname, uint16_t Timeout, uint32_t* IP, uint32_t* NetMask, uint32_t* RouterIP, uint32_t* DNSServerIP, uint32_t* NTPServerIP)
 {
-	if(!dhcp_DataValid){
-		dhcp_CurrentHostname = Hostname;
-		_dhcp_invalidate();
-	}
+	DHCPRequest Request;
+	dhcp_request_start(&Request,Hostname,Timeout);
 
-	// Start requesting
-	uint16_t Timer = 0;
-	dhcp_CurrentSocket = udp_connect_ex(MAKE_IP(255,255,255,255),DHCP_REMOTE_PORT,Timeout,&_dhcp_handle_packet,DHCP_LOCAL_PORT);
-	_dhcp_send_discover(dhcp_CurrentSocket,dhcp_CurrentIP,dhcp_CurrentHostname);
-	while(dhcp_is_requesting() && (Timeout == 0 || (Timer < Timeout))){
+	while(PT_SCHEDULE(dhcp_request_thread(&Request)))
 		ethernet_update();
-		++Timer;
-		_delay_ms(1);
-	}
 
-	if(Timeout == 0 || (Timer < Timeout)){
+	if(dhcp_DataValid){
 		// Return the requested data
 		if(IP)
 			*IP = dhcp_CurrentIP;
@@ -571,10 +564,57 @@ bool dhcp_request(const char* Hostname, uint16_t Timeout, uint32_t* IP, uint32_t
 			*DNSServerIP = dhcp_DNSServerIP;
 		if(NTPServerIP)
 			*NTPServerIP = dhcp_NTPServerIP;
+	}
+	return dhcp_DataValid;
+}
+
+void dhcp_request_start(DHCPRequest* Request, const char* Hostname, uint16_t Timeout)
+{
+	PT_INIT(&Request->PT);
+	Request->Timeout = Timeout;
+
+	// Close the socket of a request that has been abandoned, so the DHCP port can be bound again
+	if(dhcp_is_requesting()){
+		udp_disconnect(dhcp_CurrentSocket);
+		dhcp_CurrentSocket = INVALID_UDP_SOCKET;
+	}
+
+	if(!dhcp_DataValid){
+		dhcp_CurrentHostname = Hostname;
+		_dhcp_invalidate();
+	}
+}
+
+PT_THREAD(dhcp_request_thread(DHCPRequest* Request))
+{
+	PT_BEGIN(&Request->PT);
+
+	// Start requesting
+	Request->StartTime = millis;
+	dhcp_CurrentSocket = udp_connect_ex(MAKE_IP(255,255,255,255),DHCP_REMOTE_PORT,Request->Timeout,&_dhcp_handle_packet,DHCP_LOCAL_PORT);
+	if(!udp_table_is_valid_socket(dhcp_CurrentSocket)){
+		dhcp_DataValid = false;
+		PT_EXIT(&Request->PT);
+	}
+	if(dhcp_DataValid){
+		// We still hold a lease (e.g. after the link was lost), ask any server to confirm it instead of starting over (INIT-REBOOT, RFC 2131 3.2)
+		_dhcp_send_request(dhcp_CurrentSocket,dhcp_CurrentIP,dhcp_CurrentHostname,0);
 	}else{
+		_dhcp_send_discover(dhcp_CurrentSocket,dhcp_CurrentIP,dhcp_CurrentHostname);
+	}
+
+	// The packet handler walks through OFFER/REQUEST/ACK and closes the socket once we're done
+	PT_WAIT_UNTIL(&Request->PT,!dhcp_is_requesting() || (Request->Timeout != 0 && (millis - Request->StartTime) >= Request->Timeout));
+
+	if(dhcp_is_requesting()){
+		// Timed out: stop listening so the next attempt can bind the DHCP port again
+		udp_disconnect(dhcp_CurrentSocket);
+		dhcp_CurrentSocket = INVALID_UDP_SOCKET;
 		dhcp_DataValid = false;
+		PT_EXIT(&Request->PT);
 	}
-	return dhcp_DataValid;
+
+	PT_END(&Request->PT);
 }
 
 bool dhcp_is_requesting(void)
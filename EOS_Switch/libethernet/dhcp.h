@@ -34,6 +34,22 @@ extern "C"
 #endif //__cplusplus
 
 #ifdef IMPLEMENT_DHCP
+
+#include "pt.h"
+
+/// The state of a non-blocking DHCP request (see dhcp_request_start)
+typedef struct _DHCPRequest
+{
+	/// The protothread state
+	Protothread PT;
+
+	/// The timeout (in milliseconds) until the request is aborted, 0 for none
+	uint16_t Timeout;
+
+	/// The time (in milliseconds) at which the request was started
+	uint32_t StartTime;
+} DHCPRequest;
+
 /**
  * Performs a DHCP request and waits until a valid configuration has been received or the request timed out
  * @remark The given pointers will only be modified if true was returned!
@@ -48,6 +64,24 @@ extern "C"
  */
 bool dhcp_request(const char* Hostname, uint16_t Timeout, uint32_t* IP, uint32_t* NetMask, uint32_t* RouterIP, uint32_t* DNSServerIP, uint32_t* NTPServerIP);
 
+/**
+ * Starts a DHCP request without blocking
+ * @remark Run dhcp_request_thread until it has finished. ethernet_update must still be called meanwhile!
+ * @param Request The state of the request. Must stay valid until the request has finished
+ * @param Hostname Our hostname. Can be NULL for no hostname. Must stay valid as long as the configuration is used (renewals send it again)
+ * @param Timeout The timeout (in milliseconds) until the request is aborted. Can be 0 so the request will never time out
+ * @remark If a valid configuration is still held, it is verified with a DHCPREQUEST instead of going through DISCOVER and OFFER again. A NAK falls back to a new discovery, on a timeout the configuration is dropped
+ */
+void dhcp_request_start(DHCPRequest* Request, const char* Hostname, uint16_t Timeout);
+
+/**
+ * Advances a DHCP request started by dhcp_request_start
+ * @remark Check dhcp_has_valid_configuration once the protothread has finished
+ * @param Request The state of the request
+ * @return The protothread state (PT_WAITING/PT_YIELDED while running, PT_EXITED/PT_ENDED once finished)
+ */
+PT_THREAD(dhcp_request_thread(DHCPRequest* Request));
+
 /**
  * Checks if we are currently requesting a DHCP configuration
  * @return True if we are, False otherwise
@@ -25,10 +25,10 @@
  * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                                         *
 \* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <util/delay.h>
 #include <string.h>
 
 #include "global.h"
+#include "../global.h"
 #include "ethernet.h"
 #include "dns.h"
 
@@ -52,6 +52,9 @@
 
 #define DNS_PORT 53
 
+/// The interval (in milliseconds) in which queries are repeated (in case the previous one got lost)
+#define DNS_QUERY_INTERVAL 500
+
 #define DNS_HEADER_RETURN_CODE_MASK (1 << 0 | 1 << 1 | 1 << 2 | 1 << 3)
 #define DNS_HEADER_FLAG_RECURSION_AVAILABLE (1 << 7)
 #define DNS_HEADER_FLAG_RECURSION_DESIRED (1 << 8)
@@ -92,8 +95,8 @@ typedef struct _DNSResourceField
 // -------------------------------------- Global Variables ---------------------------------------
 // -----------------------------------------------------------------------------------------------
 static uint32_t dns_NameserverIP = 0;
-static const char* dns_CurrentHostname = NULL;
-static uint32_t dns_CurrentIP = 0;
+/// The running queries, indexed by the socket of their connection to the nameserver
+static DNSQuery* dns_Queries[UDP_TABLE_SIZE];
 
 // -----------------------------------------------------------------------------------------------
 // ----------------------------- Internal Function Implementations -------------------------------
@@ -221,10 +224,11 @@ DNSResourceField _dns_read_resource_field(uint8_t* Buffer, size_t* Position)
 /**
  * Handles a received DNS packet
  * @remark only for internal use!
+ * @param Query The query the packet was received for
  * @param Buffer The packet buffer
  * @param Length The packet buffer's length in bytes
  */
-void _dns_handle_packet_impl(const uint8_t* Buffer,size_t Length)
+void _dns_handle_packet_impl(DNSQuery* Query,const uint8_t* Buffer,size_t Length)
 {
 	// Read the header
 	DNSHeader* dns_hdr = (DNSHeader*)(&Buffer[DNS_HEADER_OFFSET]);
@@ -246,7 +250,7 @@ void _dns_handle_packet_impl(const uint8_t* Buffer,size_t Length)
 		DNSResourceField field = _dns_read_resource_field((uint8_t*)Buffer,&pos);
 
 		// TODO: implement aliases and so on
-		if(strcmp(field.Name,dns_CurrentHostname) == 0){
+		if(strcmp(field.Name,Query->Hostname) == 0){
 			IsCorrectHostname = true;
 			break;
 		}
@@ -262,7 +266,7 @@ void _dns_handle_packet_impl(const uint8_t* Buffer,size_t Length)
 		DNSResourceField field = _dns_read_resource_field((uint8_t*)Buffer,&pos);
 
 		if(field.Type == DNS_QUESTION_TYPE_HOST && field.DataLength == sizeof(uint32_t)){
-			dns_CurrentIP = *((uint32_t*)field.Data);
+			Query->IP = *((uint32_t*)field.Data);
 			break;
 		}
 	}
@@ -300,7 +304,8 @@ size_t _dns_prepare_query_packet(const char* Hostname,uint8_t* Buffer,size_t Buf
 #ifdef IMPLEMENT_UDP
 void _dns_udp_handle_packet(UDPSocket Socket,const uint8_t* Buffer,size_t Length)
 {
-	_dns_handle_packet_impl(Buffer,Length);
+	if(udp_table_is_valid_socket(Socket) && dns_Queries[Socket])
+		_dns_handle_packet_impl(dns_Queries[Socket],Buffer,Length);
 }
 
 void _dns_udp_send_query_packet(UDPSocket Socket,const char* Hostname)
@@ -323,30 +328,59 @@ void dns_initialise(uint32_t NameserverIP)
 
 uint32_t dns_query_hostname(const char* Hostname, uint16_t Timeout)
 {
-	UDPSocket sck = udp_connect(dns_NameserverIP,DNS_PORT,Timeout,&_dns_udp_handle_packet);
-
-	uint16_t Timer = 0;
-	dns_CurrentIP = 0;
-	dns_CurrentHostname = Hostname;
-	while(Timer <= Timeout){
-		// Send a new request every 500ms (in case the previous one got lost)
-		if((Timer % 500) == 0)
-			_dns_udp_send_query_packet(sck,Hostname);
+	DNSQuery Query;
+	dns_query_start(&Query,Hostname,Timeout);
 
-		// Update
+	while(PT_SCHEDULE(dns_query_thread(&Query)))
 		ethernet_update();
 
-		// Check if we have received an answer
-		if(dns_CurrentIP != 0)
-			break;
+	return Query.IP;
+}
+
+void dns_query_start(DNSQuery* Query, const char* Hostname, uint16_t Timeout)
+{
+	PT_INIT(&Query->PT);
+	Query->Hostname = Hostname;
+	Query->Timeout = Timeout;
+	Query->Socket = INVALID_UDP_SOCKET;
+	Query->IP = 0;
+	ethernet_arp_resolve_start(&Query->ARP,dns_NameserverIP,Timeout);
+}
 
-		// Wait 1ms and continue
-		_delay_ms(1);
-		++Timer;
+PT_THREAD(dns_query_thread(DNSQuery* Query))
+{
+	PT_BEGIN(&Query->PT);
+
+	// Resolve the nameserver first, so udp_connect won't block on it
+	PT_WAIT_THREAD(&Query->PT,ethernet_arp_resolve_thread(&Query->ARP));
+	if(!Query->ARP.Resolved)
+		PT_EXIT(&Query->PT);
+
+	Query->Socket = udp_connect(dns_NameserverIP,DNS_PORT,Query->Timeout,&_dns_udp_handle_packet);
+	if(!udp_table_is_valid_socket(Query->Socket))
+		PT_EXIT(&Query->PT);
+	dns_Queries[Query->Socket] = Query;
+
+	Query->StartTime = millis;
+	Query->LastQueryTime = Query->StartTime - DNS_QUERY_INTERVAL;
+	while(Query->IP == 0 && (millis - Query->StartTime) <= Query->Timeout){
+		// Send a new request every DNS_QUERY_INTERVAL (in case the previous one got lost)
+		if((millis - Query->LastQueryTime) >= DNS_QUERY_INTERVAL){
+			Query->LastQueryTime = millis;
+			_dns_udp_send_query_packet(Query->Socket,Query->Hostname);
+		}
+
+		PT_YIELD(&Query->PT);
 	}
-	
-	udp_disconnect(sck);
-	return dns_CurrentIP;
+
+	dns_Queries[Query->Socket] = NULL;
+	udp_disconnect(Query->Socket);
+	Query->Socket = INVALID_UDP_SOCKET;
+
+	if(Query->IP == 0)
+		PT_EXIT(&Query->PT);
+
+	PT_END(&Query->PT);
 }
 
 #endif //IMPLEMENT_DNS
\ No newline at end of file
@@ -35,6 +35,35 @@ extern "C"
 
 #ifdef IMPLEMENT_DNS
 
+#include "ethernet.h"
+
+/// The state of a non-blocking DNS query (see dns_query_start)
+typedef struct _DNSQuery
+{
+	/// The protothread state
+	Protothread PT;
+
+	/// The ARP resolution of the nameserver
+	ARPResolve ARP;
+
+	/// The hostname to resolve
+	const char* Hostname;
+
+	/// The timeout (in milliseconds) until the query is aborted
+	uint16_t Timeout;
+
+	/// The time (in milliseconds) at which the first query packet was sent
+	uint32_t StartTime;
+
+	/// The time (in milliseconds) at which the last query packet was sent
+	uint32_t LastQueryTime;
+
+	/// The socket of the connection to the nameserver
+	UDPSocket Socket;
+
+	/// The resolved IP address, 0 until an answer has been received
+	uint32_t IP;
+} DNSQuery;
 
 /**
  * Initialises the DNS module
@@ -51,6 +80,23 @@ void dns_initialise(uint32_t NameserverIP);
  */
 uint32_t dns_query_hostname(const char* Hostname, uint16_t Timeout);
 
+/**
+ * Starts resolving a given hostname without blocking
+ * @remark Run dns_query_thread until it has finished. ethernet_update must still be called meanwhile!
+ * @param Query The state of the query. Must stay valid until the query has finished
+ * @param Hostname The hostname. Must stay valid until the query has finished
+ * @param Timeout Timeout in milliseconds until the operation will be aborted
+ */
+void dns_query_start(DNSQuery* Query, const char* Hostname, uint16_t Timeout);
+
+/**
+ * Advances a DNS query started by dns_query_start
+ * @remark Check Query->IP once the protothread has finished (0 on a timeout)
+ * @param Query The state of the query
+ * @return The protothread state (PT_WAITING/PT_YIELDED while running, PT_EXITED/PT_ENDED once finished)
+ */
+PT_THREAD(dns_query_thread(DNSQuery* Query));
+
 
 #endif //IMPLEMENT_DNS
 
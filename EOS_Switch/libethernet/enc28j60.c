@@ -26,6 +26,7 @@
 \* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <util/delay.h>
+#include <string.h>
 
 #include "global.h"
 #include "spi.h"
@@ -43,10 +44,59 @@
 // ------------------------------------------ Constants ------------------------------------------
 // -----------------------------------------------------------------------------------------------
 #define ENC28J60_RX_BUFFER_START 0x0000
-#define ENC28J60_RX_BUFFER_END 0x19FF
+#ifdef IMPLEMENT_REPEAT
+#	define ENC28J60_RX_BUFFER_END 0x17FF
+#	define ENC28J60_REPEAT_SLOT_START 0x1800
+#else
+#	define ENC28J60_RX_BUFFER_END 0x19FF
+#endif //IMPLEMENT_REPEAT
 #define ENC28J60_TX_BUFFER_START 0x1A00
 #define ENC28J60_TX_BUFFER_END 0x1FFF
-#define ENC28J60_MAX_FRAMELENGTH 1518
+
+// IEEE 802.1Q tag, inserted behind the MAC addresses
+#define ENC28J60_VLAN_TAG_OFFSET 12
+#define ENC28J60_VLAN_TAG_LENGTH 4
+#define ENC28J60_VLAN_TPID 0x8100
+#define ENC28J60_VLAN_VID_MASK 0x0FFF
+
+// The transmit buffer is split into slots which each hold one frame, its control byte and its transmit status vector.
+// The first slot is reserved for priority frames, the others form a queue for all other frames. The repeat slot (in
+// front of the transmit buffer) keeps its frame after it has been sent, it is sent with priority as well.
+#define ENC28J60_TX_SLOT_SIZE 0x200
+#define ENC28J60_TX_SLOTS ((ENC28J60_TX_BUFFER_END - ENC28J60_TX_BUFFER_START + 1) / ENC28J60_TX_SLOT_SIZE)
+#define ENC28J60_TX_SLOT_PRIORITY 0
+#define ENC28J60_TX_QUEUE_LENGTH (ENC28J60_TX_SLOTS - 1)
+#ifdef IMPLEMENT_REPEAT
+#	define ENC28J60_TX_SLOT_REPEAT ENC28J60_TX_SLOTS
+#	define ENC28J60_TX_SLOT_START(Slot) (((Slot) == ENC28J60_TX_SLOT_REPEAT) ? ENC28J60_REPEAT_SLOT_START : (ENC28J60_TX_BUFFER_START + (Slot) * ENC28J60_TX_SLOT_SIZE))
+#	define ENC28J60_TX_SLOT_COUNT (ENC28J60_TX_SLOTS + 1)
+#else
+#	define ENC28J60_TX_SLOT_START(Slot) (ENC28J60_TX_BUFFER_START + (Slot) * ENC28J60_TX_SLOT_SIZE)
+#	define ENC28J60_TX_SLOT_COUNT ENC28J60_TX_SLOTS
+#endif //IMPLEMENT_REPEAT
+
+#if (MTU_SIZE + ENC28J60_VLAN_TAG_LENGTH + 1 + 7) > ENC28J60_TX_SLOT_SIZE
+#	error "MTU_SIZE does not fit into a transmit slot of the ENC28J60!"
+#endif
+
+// Receive status vector bits
+#define ENC28J60_RSV_RECEIVED_OK 0x0080
+#define ENC28J60_RSV_ZERO 0x8000
+
+/// Length of the frame check sequence at the end of each received frame
+#define ENC28J60_FCS_LENGTH 4
+/// Maximum frame length including a VLAN tag
+#define ENC28J60_MAX_FRAMELENGTH 1522
+
+// Transmit status vector bits (in the third and fourth byte of the vector)
+#define ENC28J60_TSV2_DONE 0x80
+#define ENC28J60_TSV3_UNDERRUN 0x80
+#define ENC28J60_TSV3_LATE_COLLISION 0x20
+#define ENC28J60_TSV3_EXCESSIVE_COLLISION 0x10
+#define ENC28J60_TSV3_EXCESSIVE_DEFER 0x08
+
+/// The time (in steps of 10us) to wait for a transmission to finish
+#define ENC28J60_TX_TIMEOUT 10000
 
 // Register masks
 #define ENC28J60_ADDR_MASK 0x1F
@@ -204,6 +254,16 @@
 #define ENC28J60_ECON1_BSEL1 0x02
 #define ENC28J60_ECON1_BSEL0 0x01
 
+// ERXFCON bits
+#define ENC28J60_ERXFCON_UCEN 0x80
+#define ENC28J60_ERXFCON_ANDOR 0x40
+#define ENC28J60_ERXFCON_CRCEN 0x20
+#define ENC28J60_ERXFCON_PMEN 0x10
+#define ENC28J60_ERXFCON_MPEN 0x08
+#define ENC28J60_ERXFCON_HTEN 0x04
+#define ENC28J60_ERXFCON_MCEN 0x02
+#define ENC28J60_ERXFCON_BCEN 0x01
+
 // MACON1 bits
 #define ENC28J60_MACON1_LOOPBK 0x10
 #define ENC28J60_MACON1_TXPAUS 0x08
@@ -295,6 +355,30 @@ static uint8_t enc28j60_RevisionID;
 static bool enc28j60_FullDuplex;
 static uint8_t enc28j60_CurrentBank;
 static uint16_t enc28j60_NextPacketPtr;
+static ENC28J60Statistics enc28j60_Statistics;
+/// Set while a transmission has been started whose result hasn't been booked yet
+static bool enc28j60_TxPending;
+/// The address of the last byte of the frame currently being transmitted
+static uint16_t enc28j60_TxEnd;
+/// The slot of the frame currently being transmitted
+static uint8_t enc28j60_TxActiveSlot;
+/// The length of the frame in each transmit slot, 0 if the slot is free (a slot is in use until its frame has been sent)
+static uint16_t enc28j60_TxLength[ENC28J60_TX_SLOT_COUNT];
+/// Set while the priority slot holds a frame that hasn't been started yet
+static bool enc28j60_TxPriorityWaiting;
+/// The oldest queued frame that hasn't been started yet (index into the queue, not a slot) and the number of such frames
+static uint8_t enc28j60_TxQueueHead;
+static uint8_t enc28j60_TxQueueCount;
+#ifdef IMPLEMENT_REPEAT
+/// The length of the frame kept in the repeat slot (0 if there is none) and whether it is waiting to be sent again
+static uint16_t enc28j60_RepeatLength;
+static bool enc28j60_TxRepeatWaiting;
+#endif //IMPLEMENT_REPEAT
+#ifdef IMPLEMENT_VLAN
+/// The VLAN identifier outgoing frames are tagged with and the priority code points of normal and priority frames
+static uint16_t enc28j60_VlanID = ENC28J60_VLAN_NONE;
+static uint8_t enc28j60_VlanPCP[2];
+#endif //IMPLEMENT_VLAN
 
 
 // -----------------------------------------------------------------------------------------------
@@ -483,6 +567,61 @@ void _enc28j60_write_buf(const uint8_t* Buffer,size_t Length)
 	spi_select(false);
 }
 
+/**
+ * Sets up the receive buffer pointers
+ * @remark Only for internal use! Reception must be disabled.
+ */
+void _enc28j60_initialise_rx_buffer(void)
+{
+	enc28j60_NextPacketPtr = ENC28J60_RX_BUFFER_START;
+
+	// Writing ERXST also moves the hardware write pointer (ERXWRPT) to the start
+	_enc28j60_write_reg(ENC28J60_ERXSTL,LO(ENC28J60_RX_BUFFER_START));
+	_enc28j60_write_reg(ENC28J60_ERXSTH,HI(ENC28J60_RX_BUFFER_START));
+	_enc28j60_write_reg(ENC28J60_ERXNDL,LO(ENC28J60_RX_BUFFER_END));
+	_enc28j60_write_reg(ENC28J60_ERXNDH,HI(ENC28J60_RX_BUFFER_END));
+
+	// The whole buffer is free (ERXRDPT must be odd, see below)
+	_enc28j60_write_reg(ENC28J60_ERXRDPTL,LO(ENC28J60_RX_BUFFER_END));
+	_enc28j60_write_reg(ENC28J60_ERXRDPTH,HI(ENC28J60_RX_BUFFER_END));
+}
+
+/**
+ * Resets only the receive logic and empties the receive buffer
+ * @remark Only for internal use! Much cheaper than _enc28j60_initialise as the MAC, PHY and transmit logic stay untouched.
+ */
+void _enc28j60_reset_rx(void)
+{
+	_enc28j60_clr_bits(ENC28J60_ECON1,ENC28J60_ECON1_RXEN);
+	_enc28j60_set_bits(ENC28J60_ECON1,ENC28J60_ECON1_RXRST);
+	_enc28j60_clr_bits(ENC28J60_ECON1,ENC28J60_ECON1_RXRST);
+
+	_enc28j60_initialise_rx_buffer();
+
+	// Forget all packets that were in the buffer
+	while(_enc28j60_read_reg(ENC28J60_EPKTCNT) != 0)
+		_enc28j60_set_bits(ENC28J60_ECON2,ENC28J60_ECON2_PKTDEC);
+	_enc28j60_clr_bits(ENC28J60_EIR,ENC28J60_EIR_RXERIF);
+
+	_enc28j60_set_bits(ENC28J60_ECON1,ENC28J60_ECON1_RXEN);
+	++enc28j60_Statistics.RxResets;
+}
+
+/**
+ * Frees the current frame in the receive buffer (everything up to enc28j60_NextPacketPtr)
+ * @remark Only for internal use!
+ */
+void _enc28j60_free_rx_frame(void)
+{
+	// Errata: ERXRDPT must always be written with an odd address, so free up to the byte before the next frame
+	uint16_t ReadPtr = (enc28j60_NextPacketPtr == ENC28J60_RX_BUFFER_START) ? ENC28J60_RX_BUFFER_END : enc28j60_NextPacketPtr - 1;
+	_enc28j60_write_reg(ENC28J60_ERXRDPTL,LO(ReadPtr));
+	_enc28j60_write_reg(ENC28J60_ERXRDPTH,HI(ReadPtr));
+
+	// Decrement the rx packet counter (will clear PKTIF if EPKTCNT reaches 0)
+	_enc28j60_set_bits(ENC28J60_ECON2,ENC28J60_ECON2_PKTDEC);
+}
+
 /**
  * Initialises the ENC28J60
  * @remark Only for internal use!
@@ -504,11 +643,7 @@ void _enc28j60_initialise(void)
 	enc28j60_RevisionID = _enc28j60_read_reg(ENC28J60_EREVID);
 
 	// Initialise the receive buffer
-	enc28j60_NextPacketPtr = ENC28J60_RX_BUFFER_START;
-	_enc28j60_write_reg(ENC28J60_ERXSTL,LO(ENC28J60_RX_BUFFER_START));
-	_enc28j60_write_reg(ENC28J60_ERXSTH,HI(ENC28J60_RX_BUFFER_START));
-	_enc28j60_write_reg(ENC28J60_ERXNDL,LO(ENC28J60_RX_BUFFER_END));
-	_enc28j60_write_reg(ENC28J60_ERXNDH,HI(ENC28J60_RX_BUFFER_END));
+	_enc28j60_initialise_rx_buffer();
 
 	// Initialise the transmit buffer
 	_enc28j60_write_reg(ENC28J60_ETXSTL,LO(ENC28J60_TX_BUFFER_START));
@@ -567,13 +702,164 @@ void _enc28j60_initialise(void)
 #endif //HANDLE_LINK_STATUS_CHANGES
 #endif //USE_INTERRUPTS
 
-	// Disable all filters
-	_enc28j60_write_reg(ENC28J60_ERXFCON,0x00);
+	// Only accept frames with a valid CRC which are sent to us, to broadcast or to a multicast address in the hash table
+	// (empty until enc28j60_add_multicast_filter is called)
+	_enc28j60_write_reg(ENC28J60_ERXFCON,ENC28J60_ERXFCON_UCEN|ENC28J60_ERXFCON_CRCEN|ENC28J60_ERXFCON_HTEN|ENC28J60_ERXFCON_BCEN);
 
 	// Enable packet reception
 	_enc28j60_set_bits(ENC28J60_ECON1,ENC28J60_ECON1_RXEN);
 }
 
+/**
+ * Waits for the previous transmission to finish and books its result
+ * @remark Only for internal use!
+ * @return True if the transmission has finished without error, False if it timed out or failed (transmit logic needs a reset)
+ */
+bool _enc28j60_finish_tx(void)
+{
+	if(!enc28j60_TxPending)
+		return true;
+
+	// Wait up to 100ms for the previous transmission to finish
+	for(uint16_t i = 0; _enc28j60_read_reg(ENC28J60_ECON1) & ENC28J60_ECON1_TXRTS; ++i){
+		if(i >= ENC28J60_TX_TIMEOUT){
+			++enc28j60_Statistics.TxErrors;
+			enc28j60_TxPending = false;
+			enc28j60_TxLength[enc28j60_TxActiveSlot] = 0;
+			return false;
+		}
+		_delay_us(10);
+	}
+	enc28j60_TxPending = false;
+	enc28j60_TxLength[enc28j60_TxActiveSlot] = 0;
+
+	// The controller writes the transmit status vector right behind the frame
+	uint8_t tsv[4];
+	_enc28j60_write_reg(ENC28J60_ERDPTL,LO(enc28j60_TxEnd+1));
+	_enc28j60_write_reg(ENC28J60_ERDPTH,HI(enc28j60_TxEnd+1));
+	_enc28j60_read_buf(tsv,sizeof(tsv));
+
+	if(tsv[3] & ENC28J60_TSV3_LATE_COLLISION)
+		++enc28j60_Statistics.TxLateCollisions;
+	if(tsv[3] & (ENC28J60_TSV3_EXCESSIVE_COLLISION|ENC28J60_TSV3_EXCESSIVE_DEFER|ENC28J60_TSV3_UNDERRUN))
+		++enc28j60_Statistics.TxAborts;
+
+	if((_enc28j60_read_reg(ENC28J60_EIR) & ENC28J60_EIR_TXERIF) || !(tsv[2] & ENC28J60_TSV2_DONE)){
+		++enc28j60_Statistics.TxErrors;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Starts the transmission of the next waiting frame, the priority slot goes first
+ * @remark Only for internal use!
+ * @remark The previous transmission must have been finished by _enc28j60_finish_tx
+ * @param PrevTxFinished The result of _enc28j60_finish_tx
+ */
+void _enc28j60_start_next_tx(bool PrevTxFinished)
+{
+	uint8_t Slot;
+	if(enc28j60_TxPriorityWaiting){
+		Slot = ENC28J60_TX_SLOT_PRIORITY;
+		enc28j60_TxPriorityWaiting = false;
+#ifdef IMPLEMENT_REPEAT
+	}else if(enc28j60_TxRepeatWaiting){
+		Slot = ENC28J60_TX_SLOT_REPEAT;
+		enc28j60_TxRepeatWaiting = false;
+#endif //IMPLEMENT_REPEAT
+	}else if(enc28j60_TxQueueCount){
+		Slot = 1 + enc28j60_TxQueueHead;
+		enc28j60_TxQueueHead = (enc28j60_TxQueueHead + 1) % ENC28J60_TX_QUEUE_LENGTH;
+		--enc28j60_TxQueueCount;
+	}else{
+		return;
+	}
+
+	// Full Duplex: reset tx logic if the previous transmission failed or TXRTS is still active
+	// Half Duplex: reset tx logic
+	if(!enc28j60_FullDuplex || !PrevTxFinished){
+		_enc28j60_set_bits(ENC28J60_ECON1,ENC28J60_ECON1_TXRST);
+		_enc28j60_clr_bits(ENC28J60_ECON1,ENC28J60_ECON1_TXRST);
+	}
+
+	// Point the transmit logic at the slot (the control byte comes first)
+	uint16_t Start = ENC28J60_TX_SLOT_START(Slot);
+	uint16_t End = Start + enc28j60_TxLength[Slot];
+	_enc28j60_write_reg(ENC28J60_ETXSTL,LO(Start));
+	_enc28j60_write_reg(ENC28J60_ETXSTH,HI(Start));
+	_enc28j60_write_reg(ENC28J60_ETXNDL,LO(End));
+	_enc28j60_write_reg(ENC28J60_ETXNDH,HI(End));
+
+	// Clear TXIF and TXERIF flags
+	_enc28j60_clr_bits(ENC28J60_EIR,ENC28J60_EIR_TXIF|ENC28J60_EIR_TXERIF);
+
+	// Start transmission, its result is checked before the next one
+	_enc28j60_set_bits(ENC28J60_ECON1,ENC28J60_ECON1_TXRTS);
+	enc28j60_TxPending = true;
+	enc28j60_TxEnd = End;
+	enc28j60_TxActiveSlot = Slot;
+}
+
+/**
+ * Waits until a transmit slot is free, by getting the frames ahead of it out of the way
+ * @remark Only for internal use!
+ * @param Slot The slot
+ */
+void _enc28j60_wait_for_slot(uint8_t Slot)
+{
+	while(enc28j60_TxLength[Slot] != 0){
+		++enc28j60_Statistics.TxSlotWaits;
+		_enc28j60_start_next_tx(_enc28j60_finish_tx());
+	}
+}
+
+/**
+ * Copies a frame into a transmit slot, inserting the VLAN tag if one is configured
+ * @remark Only for internal use!
+ * @param Slot The slot, it must be free
+ * @param Buffer The frame
+ * @param Length The length of the frame
+ * @param Priority Selects the priority code point of the VLAN tag
+ * @return The length of the frame in the slot
+ */
+uint16_t _enc28j60_write_frame(uint8_t Slot, const uint8_t* Buffer, size_t Length, bool Priority)
+{
+	// Copy the frame into the slot, this can be done while another slot is being transmitted
+	_enc28j60_write_reg(ENC28J60_EWRPTL,LO(ENC28J60_TX_SLOT_START(Slot)));
+	_enc28j60_write_reg(ENC28J60_EWRPTH,HI(ENC28J60_TX_SLOT_START(Slot)));
+
+	// Write 1 control byte
+	uint8_t ctrl = 0;
+	_enc28j60_write_buf(&ctrl,1);
+
+	// Write the data
+	size_t Offset = 0;
+	size_t FrameLength = Length;
+#ifdef IMPLEMENT_VLAN
+	if(enc28j60_VlanID != ENC28J60_VLAN_NONE && Length >= ENC28J60_VLAN_TAG_OFFSET){
+		uint16_t TCI = ((uint16_t)enc28j60_VlanPCP[Priority] << 13) | enc28j60_VlanID;
+		uint8_t tag[ENC28J60_VLAN_TAG_LENGTH] = {HI(ENC28J60_VLAN_TPID),LO(ENC28J60_VLAN_TPID),HI(TCI),LO(TCI)};
+		_enc28j60_write_buf(Buffer,ENC28J60_VLAN_TAG_OFFSET);
+		_enc28j60_write_buf(tag,sizeof(tag));
+		Offset = ENC28J60_VLAN_TAG_OFFSET;
+		FrameLength += ENC28J60_VLAN_TAG_LENGTH;
+	}
+#endif //IMPLEMENT_VLAN
+	_enc28j60_write_buf(Buffer + Offset,Length - Offset);
+	return FrameLength;
+}
+
+/**
+ * Checks if the transmit logic is still busy with a frame
+ * @remark Only for internal use!
+ * @return True while a transmission is in progress
+ */
+bool _enc28j60_is_transmitting(void)
+{
+	return enc28j60_TxPending && (_enc28j60_read_reg(ENC28J60_ECON1) & ENC28J60_ECON1_TXRTS);
+}
+
 // -----------------------------------------------------------------------------------------------
 // ----------------------------- External Function Implementations -------------------------------
 // -----------------------------------------------------------------------------------------------
@@ -585,6 +871,16 @@ void enc28j60_initialise(const uint8_t* MACAddr, bool FullDuplex)
 
 	enc28j60_FullDuplex = FullDuplex;
 	enc28j60_CurrentBank = 0;
+	enc28j60_TxPending = false;
+	enc28j60_TxPriorityWaiting = false;
+	enc28j60_TxQueueHead = 0;
+	enc28j60_TxQueueCount = 0;
+	for(uint8_t i = 0; i < ENC28J60_TX_SLOT_COUNT; ++i)
+		enc28j60_TxLength[i] = 0;
+#ifdef IMPLEMENT_REPEAT
+	enc28j60_RepeatLength = 0;
+	enc28j60_TxRepeatWaiting = false;
+#endif //IMPLEMENT_REPEAT
 
 	// Initialise the ENC28J60
 	_enc28j60_initialise();
@@ -636,103 +932,207 @@ void enc28j60_disable_interrupts(void)
 
 bool enc28j60_has_packet_interrupt(void)
 {
-	return (_enc28j60_read_reg(ENC28J60_EIR) & ENC28J60_EIR_PKTIF) == ENC28J60_EIR_PKTIF;
+	return _enc28j60_read_reg(ENC28J60_EPKTCNT) != 0;
 }
 
 #ifdef HANDLE_LINK_STATUS_CHANGES
 bool enc28j60_has_link_status_interrupt(void)
 {
+	// LINKIF mirrors the PHY interrupt flag, so only go through the (slow) MII interface if it is set. Reading PHIR clears it.
+	if(!(_enc28j60_read_reg(ENC28J60_EIR) & ENC28J60_EIR_LINKIF))
+		return false;
 	return (_enc28j60_read_phy(ENC28J60_PHIR) & ENC28J60_PHIR_PLNKIF) == ENC28J60_PHIR_PLNKIF;
 }
 #endif
 
 void enc28j60_send(const uint8_t* Buffer, size_t Length)
 {
-	bool PrevTxFinished = false;
+	enc28j60_send_ex(Buffer,Length,false);
+}
 
-	// Wait up to 100ms for the previous transmission to finish
-	for(uint8_t i = 0; i < 500; ++i){
-		if(!(_enc28j60_read_reg(ENC28J60_ECON1) & ENC28J60_ECON1_TXRST)){
-			PrevTxFinished = true;
-			break;
-		}
-		_delay_ms(1);
+void enc28j60_send_ex(const uint8_t* Buffer, size_t Length, bool Priority)
+{
+	// Find the slot for the frame, if it is still taken, get the frames ahead of it out of the way
+	uint8_t Slot = Priority ? ENC28J60_TX_SLOT_PRIORITY : 1 + ((enc28j60_TxQueueHead + enc28j60_TxQueueCount) % ENC28J60_TX_QUEUE_LENGTH);
+	_enc28j60_wait_for_slot(Slot);
+
+	enc28j60_TxLength[Slot] = _enc28j60_write_frame(Slot,Buffer,Length,Priority);
+
+	++enc28j60_Statistics.TxFrames;
+	enc28j60_Statistics.TxBytes += Length;
+
+	if(Priority){
+		// Goes out as soon as the frame on the wire (if any) is done, nothing that is queued can get ahead of it
+		enc28j60_TxPriorityWaiting = true;
+		++enc28j60_Statistics.TxPriorityFrames;
+		_enc28j60_start_next_tx(_enc28j60_finish_tx());
+	}else{
+		++enc28j60_TxQueueCount;
+		enc28j60_service();
 	}
+}
 
-	// Full Duplex: reset tx logic if TXRTS is still active
-	// Half Duplex: reset tx logic
-	if(!enc28j60_FullDuplex || !PrevTxFinished){
-		_enc28j60_set_bits(ENC28J60_ECON1,ENC28J60_ECON1_TXRST);
-		_enc28j60_clr_bits(ENC28J60_ECON1,ENC28J60_ECON1_TXRST);
-	}
+#ifdef IMPLEMENT_REPEAT
+void enc28j60_send_repeatable(const uint8_t* Buffer, size_t Length)
+{
+	_enc28j60_wait_for_slot(ENC28J60_TX_SLOT_REPEAT);
+	enc28j60_RepeatLength = _enc28j60_write_frame(ENC28J60_TX_SLOT_REPEAT,Buffer,Length,true);
 
-	// Set start write ptr
-	_enc28j60_write_reg(ENC28J60_EWRPTL,LO(ENC28J60_TX_BUFFER_START));
-	_enc28j60_write_reg(ENC28J60_EWRPTH,HI(ENC28J60_TX_BUFFER_START));
+	++enc28j60_Statistics.TxFrames;
+	enc28j60_Statistics.TxBytes += Length;
+	++enc28j60_Statistics.TxPriorityFrames;
 
-	// Set end write ptr
-	_enc28j60_write_reg(ENC28J60_ETXNDL,LO(ENC28J60_TX_BUFFER_START+Length));
-	_enc28j60_write_reg(ENC28J60_ETXNDH,HI(ENC28J60_TX_BUFFER_START+Length));
+	enc28j60_TxLength[ENC28J60_TX_SLOT_REPEAT] = enc28j60_RepeatLength;
+	enc28j60_TxRepeatWaiting = true;
+	_enc28j60_start_next_tx(_enc28j60_finish_tx());
+}
 
-	// Write 1 control byte
-	uint8_t ctrl = 0;
-	_enc28j60_write_buf(&ctrl,1);
+void enc28j60_repeat(const uint8_t* Header, size_t HeaderLength)
+{
+	if(enc28j60_RepeatLength == 0)
+		return;
 
-	// Write the data
-	_enc28j60_write_buf(Buffer,Length);
+	_enc28j60_wait_for_slot(ENC28J60_TX_SLOT_REPEAT);
+	if(HeaderLength)
+		_enc28j60_write_frame(ENC28J60_TX_SLOT_REPEAT,Header,HeaderLength,true);
 
-	// Clear TXIF flag
-	_enc28j60_clr_bits(ENC28J60_EIR,ENC28J60_EIR_TXIF);
+	++enc28j60_Statistics.TxFrames;
+	++enc28j60_Statistics.TxRepeatedFrames;
+	++enc28j60_Statistics.TxPriorityFrames;
 
-	// Start transmission and wait for it to start
-	_enc28j60_set_bits(ENC28J60_ECON1,ENC28J60_ECON1_TXRTS);
-	_delay_ms(1);
+	enc28j60_TxLength[ENC28J60_TX_SLOT_REPEAT] = enc28j60_RepeatLength;
+	enc28j60_TxRepeatWaiting = true;
+	_enc28j60_start_next_tx(_enc28j60_finish_tx());
+}
+#endif //IMPLEMENT_REPEAT
+
+void enc28j60_service(void)
+{
+	if(!_enc28j60_is_transmitting())
+		_enc28j60_start_next_tx(_enc28j60_finish_tx());
 }
 
 size_t enc28j60_receive(uint8_t* Buffer, size_t BufferSize)
 {
-	// Check rx packet count
+	// A receive buffer overflow only means that the controller has dropped new frames, the queued ones are still fine
+	if(_enc28j60_read_reg(ENC28J60_EIR) & ENC28J60_EIR_RXERIF){
+		_enc28j60_clr_bits(ENC28J60_EIR,ENC28J60_EIR_RXERIF);
+		++enc28j60_Statistics.RxOverflows;
+	}
+
 	uint8_t PacketCount = _enc28j60_read_reg(ENC28J60_EPKTCNT);
-	if(PacketCount == 0)
-		return 0;
-
-	// Set read ptr
-	_enc28j60_write_reg(ENC28J60_ERDPTL,LO(enc28j60_NextPacketPtr));
-	_enc28j60_write_reg(ENC28J60_ERDPTH,HI(enc28j60_NextPacketPtr));
-
-	// Read header
-	uint8_t rx_header[6];
-	_enc28j60_read_buf(rx_header,sizeof(rx_header));
-	enc28j60_NextPacketPtr = MAKE_WORD(rx_header[1],rx_header[0]);
-	size_t Length = MAKE_WORD(rx_header[3],rx_header[2]);
-	size_t Status = MAKE_WORD(rx_header[5],rx_header[4]);
-
-	// Reset the ENC28J60 if anything went wrong
-	if(!(Status & 0x0080) || (Status & 0x8000) || (Length > BufferSize))
-		_enc28j60_initialise();
-
-	// Skip the checksum (4 bytes) at the end
-	Length -= 4;
-
-	// Simply truncate the data if Buffer is too short
-	if(Length > BufferSize)
-		Length = BufferSize;
-
-	// Read packet data
-	_enc28j60_read_buf(Buffer,Length);
-
-	// Adjust the ERXRDPT pointer (free the packet in the rx buffer)
-	if(enc28j60_NextPacketPtr-1 > ENC28J60_RX_BUFFER_END || enc28j60_NextPacketPtr-1 < ENC28J60_RX_BUFFER_START){
-		_enc28j60_write_reg(ENC28J60_ERXRDPTL,LO(ENC28J60_RX_BUFFER_END));
-		_enc28j60_write_reg(ENC28J60_ERXRDPTH,HI(ENC28J60_RX_BUFFER_END));
-	} else {
-		_enc28j60_write_reg(ENC28J60_ERXRDPTL,LO(enc28j60_NextPacketPtr-1));
-		_enc28j60_write_reg(ENC28J60_ERXRDPTH,HI(enc28j60_NextPacketPtr-1));
+	if(PacketCount > enc28j60_Statistics.RxPendingHighWater)
+		enc28j60_Statistics.RxPendingHighWater = PacketCount;
+
+	for(; PacketCount != 0; --PacketCount){
+		// Set read ptr
+		_enc28j60_write_reg(ENC28J60_ERDPTL,LO(enc28j60_NextPacketPtr));
+		_enc28j60_write_reg(ENC28J60_ERDPTH,HI(enc28j60_NextPacketPtr));
+
+		// Read header
+		uint8_t rx_header[6];
+		_enc28j60_read_buf(rx_header,sizeof(rx_header));
+		uint16_t NextPacketPtr = MAKE_WORD(rx_header[1],rx_header[0]);
+		size_t Length = MAKE_WORD(rx_header[3],rx_header[2]);
+		size_t Status = MAKE_WORD(rx_header[5],rx_header[4]);
+
+		// If the header is garbage, we can't find the following frames anymore: start over with an empty buffer
+		if(NextPacketPtr > ENC28J60_RX_BUFFER_END || (NextPacketPtr & 1) || Length > ENC28J60_MAX_FRAMELENGTH || (Status & ENC28J60_RSV_ZERO)){
+			_enc28j60_reset_rx();
+			return 0;
+		}
+		enc28j60_NextPacketPtr = NextPacketPtr;
+
+		// Skip frames that are broken or too large for Buffer
+		if(!(Status & ENC28J60_RSV_RECEIVED_OK) || Length < ENC28J60_FCS_LENGTH){
+			++enc28j60_Statistics.RxFramesErrored;
+			_enc28j60_free_rx_frame();
+			continue;
+		}
+
+		// Skip the checksum (4 bytes) at the end
+		Length -= ENC28J60_FCS_LENGTH;
+		size_t Offset = 0;
+
+#ifdef IMPLEMENT_VLAN
+		// Read the MAC addresses and what might be a tag first, a tag is stripped by reading the rest of the frame over it
+		if(Length >= ENC28J60_VLAN_TAG_OFFSET + ENC28J60_VLAN_TAG_LENGTH && BufferSize >= ENC28J60_VLAN_TAG_OFFSET + ENC28J60_VLAN_TAG_LENGTH){
+			_enc28j60_read_buf(Buffer,ENC28J60_VLAN_TAG_OFFSET + ENC28J60_VLAN_TAG_LENGTH);
+			Offset = ENC28J60_VLAN_TAG_OFFSET + ENC28J60_VLAN_TAG_LENGTH;
+
+			if(MAKE_WORD(Buffer[ENC28J60_VLAN_TAG_OFFSET],Buffer[ENC28J60_VLAN_TAG_OFFSET+1]) == ENC28J60_VLAN_TPID){
+				// Priority tagged frames (VID 0) belong to the untagged network
+				uint16_t VID = MAKE_WORD(Buffer[ENC28J60_VLAN_TAG_OFFSET+2],Buffer[ENC28J60_VLAN_TAG_OFFSET+3]) & ENC28J60_VLAN_VID_MASK;
+				if(VID != 0 && VID != enc28j60_VlanID){
+					++enc28j60_Statistics.RxFramesForeignVlan;
+					_enc28j60_free_rx_frame();
+					continue;
+				}
+				Offset = ENC28J60_VLAN_TAG_OFFSET;
+				Length -= ENC28J60_VLAN_TAG_LENGTH;
+			}
+		}
+#endif //IMPLEMENT_VLAN
+
+		if(Length > BufferSize){
+			++enc28j60_Statistics.RxFramesOversized;
+			_enc28j60_free_rx_frame();
+			continue;
+		}
+
+		// Read packet data
+		_enc28j60_read_buf(Buffer + Offset,Length - Offset);
+		_enc28j60_free_rx_frame();
+
+		++enc28j60_Statistics.RxFrames;
+		enc28j60_Statistics.RxBytes += Length;
+		return Length;
 	}
 
-	// Decrement the rx packet counter (will clear PKTIF if EPKTCNT reaches 0)
-	_enc28j60_set_bits(ENC28J60_ECON2,ENC28J60_ECON2_PKTDEC);
-	_delay_ms(1);
+	return 0;
+}
+
+#ifdef IMPLEMENT_VLAN
+void enc28j60_set_vlan(uint16_t VID, uint8_t PCP, uint8_t PriorityPCP)
+{
+	enc28j60_VlanID = (VID < ENC28J60_VLAN_VID_MASK) ? VID : ENC28J60_VLAN_NONE;
+	enc28j60_VlanPCP[false] = PCP & 0x07;
+	enc28j60_VlanPCP[true] = PriorityPCP & 0x07;
+}
+#endif //IMPLEMENT_VLAN
 
-	return Length;
+void enc28j60_clear_multicast_filter(void)
+{
+	for(uint8_t i = 0; i < 8; ++i)
+		_enc28j60_write_reg(ENC28J60_EHT0 + i,0x00);
+}
+
+void enc28j60_add_multicast_filter(const uint8_t* MACAddr)
+{
+	// The hash is formed by bits 28:23 of the frame check sequence (CRC-32) of the destination address
+	uint32_t CRC = 0xFFFFFFFF;
+	for(uint8_t i = 0; i < 6; ++i){
+		uint8_t Data = MACAddr[i];
+		for(uint8_t j = 0; j < 8; ++j){
+			if(((uint8_t)(CRC >> 31) ^ Data) & 0x01)
+				CRC = (CRC << 1) ^ 0x04C11DB7;
+			else
+				CRC <<= 1;
+			Data >>= 1;
+		}
+	}
+	uint8_t Hash = (CRC >> 23) & 0x3F;
+
+	uint8_t Address = ENC28J60_EHT0 + (Hash >> 3);
+	_enc28j60_write_reg(Address,_enc28j60_read_reg(Address) | (1 << (Hash & 0x07)));
+}
+
+const ENC28J60Statistics* enc28j60_get_statistics(void)
+{
+	return &enc28j60_Statistics;
+}
+
+void enc28j60_reset_statistics(void)
+{
+	memset(&enc28j60_Statistics,0,sizeof(enc28j60_Statistics));
 }
@@ -33,6 +33,60 @@ extern "C"
 {
 #endif //__cplusplus
 
+/// Counters maintained by the ENC28J60 driver
+typedef struct _ENC28J60Statistics
+{
+	/// Frames received and handed to the caller
+	uint32_t RxFrames;
+
+	/// Bytes received and handed to the caller (without the frame check sequence)
+	uint32_t RxBytes;
+
+	/// Frames dropped because the controller flagged them as broken (CRC error, runt, ...)
+	uint16_t RxFramesErrored;
+
+	/// Frames dropped because they didn't fit into the receive buffer
+	uint16_t RxFramesOversized;
+
+	/// Frames dropped because they were tagged with a VLAN other than ours
+	uint16_t RxFramesForeignVlan;
+
+	/// Receive buffer overflows (RXERIF), the controller has dropped frames
+	uint16_t RxOverflows;
+
+	/// Resets of the receive logic because the receive buffer was corrupted
+	uint16_t RxResets;
+
+	/// The highest number of frames that were waiting in the receive buffer at once (EPKTCNT)
+	uint8_t RxPendingHighWater;
+
+	/// Frames handed to the controller for transmission
+	uint32_t TxFrames;
+
+	/// Bytes handed to the controller for transmission
+	uint32_t TxBytes;
+
+	/// Transmissions that failed (TXERIF or not flagged as done in the transmit status vector)
+	uint16_t TxErrors;
+
+	/// Transmissions that suffered a late collision
+	uint16_t TxLateCollisions;
+
+	/// Transmissions aborted due to excessive collisions, excessive deferral or a buffer underrun
+	uint16_t TxAborts;
+
+	/// Frames sent through the priority slot
+	uint32_t TxPriorityFrames;
+
+	/// Times a frame had to wait for its transmit slot to become free
+	uint16_t TxSlotWaits;
+
+	/// Frames sent again from the repeat slot (see enc28j60_repeat)
+	uint32_t TxRepeatedFrames;
+} ENC28J60Statistics;
+
+/// VLAN identifier for sending frames untagged (see enc28j60_set_vlan)
+#define ENC28J60_VLAN_NONE 0xFFFF
 
 /**
  * Initialises the ENC28J60
@@ -82,8 +136,9 @@ void enc28j60_enable_interrupts(void);
 void enc28j60_disable_interrupts(void);
 
 /**
- * Checks the controller's interrupt register for the PKTIF flag
- * @return True if PKTIF is set
+ * Checks if the controller has received packets that are waiting to be read
+ * @remark Uses EPKTCNT instead of PKTIF, which is unreliable (silicon errata)
+ * @return True if there is at least one packet pending
  */
 bool enc28j60_has_packet_interrupt(void);
 
@@ -97,21 +152,90 @@ bool enc28j60_has_link_status_interrupt(void);
 #endif
 
 /**
- * Sends data from a buffer
- * @remark Waits up to 100ms for the previous transmission to finish. If it does not finish within that time frame, it will be terminated!
+ * Queues data from a buffer for transmission
+ * @remark Same as enc28j60_send_ex without priority
  * @param Buffer The data to be sent
  * @param Length The length of Buffer
  */
 void enc28j60_send(const uint8_t* Buffer, size_t Length);
 
+/**
+ * Sends data from a buffer
+ * @remark The frame is copied into a transmit slot of the controller. Normal frames are queued and sent in order, a priority frame is sent as soon as the frame currently on the wire is done, ahead of all queued frames.
+ * @remark Only waits if the slot is still taken, for up to 100ms per frame ahead of it. If a transmission does not finish within that time frame, it will be terminated!
+ * @param Buffer The data to be sent
+ * @param Length The length of Buffer
+ * @param Priority True to send the frame ahead of all queued frames
+ */
+void enc28j60_send_ex(const uint8_t* Buffer, size_t Length, bool Priority);
+
+#ifdef IMPLEMENT_REPEAT
+/**
+ * Sends an ethernet frame with priority and keeps it in the controller, so that it can be sent again by enc28j60_repeat
+ * @remark The frame replaces the one kept before. Waits until that one has been sent, if it is still waiting.
+ * @param Buffer The buffer containing the frame
+ * @param Length The length of the frame
+ */
+void enc28j60_send_repeatable(const uint8_t* Buffer, size_t Length);
+
+/**
+ * Sends the frame kept by enc28j60_send_repeatable again, with priority
+ * @remark Only the header is copied to the controller, the rest of the frame is sent as it is kept
+ * @param Header The new header of the frame, it replaces the start of the kept frame. NULL to send the frame as it is.
+ * @param HeaderLength The length of the header
+ */
+void enc28j60_repeat(const uint8_t* Header, size_t HeaderLength);
+#endif //IMPLEMENT_REPEAT
+
+#ifdef IMPLEMENT_VLAN
+/**
+ * Configures IEEE 802.1Q tagging of outgoing frames
+ * @remark Frames are received untagged, priority tagged (VID 0) or tagged with VID. The tag is stripped before they are handed on, frames tagged with any other VID are dropped.
+ * @param VID The VLAN identifier (1 - 4094) frames are tagged with, 0 to tag them with their priority only, ENC28J60_VLAN_NONE to send them untagged
+ * @param PCP The priority code point (0 - 7) of normal frames
+ * @param PriorityPCP The priority code point (0 - 7) of frames sent with priority (see enc28j60_send_ex)
+ */
+void enc28j60_set_vlan(uint16_t VID, uint8_t PCP, uint8_t PriorityPCP);
+#endif //IMPLEMENT_VLAN
+
+/**
+ * Stops receiving frames sent to multicast addresses
+ */
+void enc28j60_clear_multicast_filter(void);
+
+/**
+ * Starts receiving frames sent to a multicast address
+ * @remark The controller filters multicast addresses through a hash table, frames for other multicast addresses which share the hash get through as well
+ * @param MACAddr Pointer to a six-byte-array containing the multicast MAC address
+ */
+void enc28j60_add_multicast_filter(const uint8_t* MACAddr);
+
+/**
+ * Starts the next queued transmission once the controller is done with the current one
+ * @remark Do not call this function, ethernet_update does it for you
+ */
+void enc28j60_service(void);
+
 /**
  * Tries to receive data to a buffer
+ * @remark Broken frames and frames longer than BufferSize are skipped. If the receive buffer is found to be corrupted, only the receive logic is reset.
  * @param Buffer The buffer that will take the data
  * @param BufferSize The length of Buffer
  * @return The number of bytes received and written into Buffer. 0 if no data was received.
  */
 size_t enc28j60_receive(uint8_t* Buffer, size_t BufferSize);
 
+/**
+ * Gets the driver's counters
+ * @return The counters
+ */
+const ENC28J60Statistics* enc28j60_get_statistics(void);
+
+/**
+ * Resets all of the driver's counters to 0
+ */
+void enc28j60_reset_statistics(void);
+
 
 #ifdef __cplusplus
 }
@@ -26,6 +26,7 @@
 \* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <util/delay.h>
+#include <string.h>
 
 #include "global.h"
 #include "../global.h"
@@ -42,6 +43,9 @@
 // -----------------------------------------------------------------------------------------------
 #define IP_ADDRESS_LENGTH 4
 
+/// The interval (in milliseconds) in which ARP requests are repeated (in case the previous one got lost)
+#define ARP_REQUEST_INTERVAL 500
+
 // Ethernet header
 #define ETHERNET_HEADER_OFFSET 0
 #define ETHERNET_HEADER_LENGTH 14
@@ -107,6 +111,9 @@ typedef struct _ARPHeader
 #ifdef IMPLEMENT_ICMP
 #	define IP_PROTOCOL_ICMP 0x01
 #endif //IMPLEMENT_ICMP
+#ifdef IMPLEMENT_IGMP
+#	define IP_PROTOCOL_IGMP 0x02
+#endif //IMPLEMENT_IGMP
 #ifdef IMPLEMENT_TCP
 #	define IP_PROTOCOL_TCP 0x06
 #endif //IMPLEMENT_TCP
@@ -172,6 +179,45 @@ typedef struct _ICMPHeader
 } ICMPHeader;
 
 
+// IGMP header (behind the router alert option of the IP header)
+#ifdef IMPLEMENT_IGMP
+#define IP_OPTION_ROUTER_ALERT_LENGTH 4
+#define IGMP_HEADER_OFFSET (IP_HEADER_OFFSET + IP_HEADER_LENGTH + IP_OPTION_ROUTER_ALERT_LENGTH)
+#define IGMP_HEADER_LENGTH 8
+
+#define IGMP_TYPE_MEMBERSHIP_QUERY 0x11
+#define IGMP_TYPE_MEMBERSHIP_REPORT 0x16
+#define IGMP_TYPE_LEAVE_GROUP 0x17
+
+/// The maximum delay (in seconds) of the repetition of an unsolicited membership report
+#define IGMP_UNSOLICITED_REPORT_INTERVAL 10
+
+typedef struct _IGMPHeader
+{
+	/// Message type
+	uint8_t Type;
+
+	/// Maximum response time of queries (in 1/10 seconds)
+	uint8_t MaxRespTime;
+
+	/// Checksum
+	uint16_t Cksum;
+
+	/// Group address
+	uint32_t GroupAddr;
+} IGMPHeader;
+
+typedef struct _IGMPGroup
+{
+	/// The IP address of the group, 0 if the entry is unused
+	uint32_t GroupIP;
+
+	/// Seconds until a membership report is sent, 0 if none is pending
+	uint8_t ReportDelay;
+} IGMPGroup;
+#endif //IMPLEMENT_IGMP
+
+
 // UDP header
 #ifdef IMPLEMENT_UDP
 #define UDP_HEADER_OFFSET (IP_HEADER_OFFSET + IP_HEADER_LENGTH)
@@ -240,6 +286,8 @@ static uint8_t ethernet_PacketBuffer[MTU_SIZE+1];
 static uint16_t ethernet_IP_IDCounter;
 /// Indicates that one second has elapsed
 volatile bool ethernet_SecondElapsed;
+/// The stack's counters
+static EthernetStatistics ethernet_Statistics;
 
 #ifdef USE_INTERRUPTS
 /// If set, indicates that an interrupt came from the controller
@@ -250,9 +298,26 @@ static ethernet_callback_link_status_change ethernet_link_status_change;
 #	endif //HANDLE_LINK_STATUS_CHANGES
 #endif //USE_INTERRUPTS
 
+#ifdef IMPLEMENT_ICMP
+static ethernet_callback_icmp_echo_reply ethernet_icmp_echo_reply;
+#endif //IMPLEMENT_ICMP
+
+#ifdef IMPLEMENT_IGMP
+/// The multicast groups we have joined
+static IGMPGroup ethernet_IGMPGroups[IGMP_GROUP_TABLE_SIZE];
+#endif //IMPLEMENT_IGMP
+
 #ifdef IMPLEMENT_UDP
 /// The socket to which the current UDP packet will be sent
 static UDPSocket ethernet_CurrentPacketUDPSocket;
+
+#	ifdef IMPLEMENT_REPEAT
+/// The headers of the packet kept by udp_send_repeatable as they were built, and the hosts they are addressed to
+static uint8_t ethernet_RepeatHeader[UDP_DATA_OFFSET];
+static uint32_t ethernet_RepeatHeaderIP;
+/// The host the packet kept in the controller is currently addressed to
+static uint32_t ethernet_RepeatCurrentIP;
+#	endif //IMPLEMENT_REPEAT
 #endif //IMPLEMENT_UDP
 
 #ifdef IMPLEMENT_TCP
@@ -295,6 +360,22 @@ uint16_t _ethernet_calculate_checksum(const uint8_t* Buffer,uint16_t BufferSize,
 	return ~(StartValue & 0x0000FFFF);
 }
 
+/**
+ * Updates a checksum after a 16 bit word of the data it covers has changed (RFC 1624, eqn. 3)
+ * @remark Only for internal use! All values may be in either byte order, as long as it is the same for all of them
+ * @param Checksum The checksum as stored in the header
+ * @param Old The previous value of the word
+ * @param New The new value of the word
+ * @return The updated checksum
+ */
+uint16_t _ethernet_adjust_checksum(uint16_t Checksum, uint16_t Old, uint16_t New)
+{
+	uint32_t Sum = (uint16_t)~Checksum + (uint16_t)~Old + New;
+	Sum = (Sum & 0x0000FFFF) + (Sum >> 16);
+	Sum = (Sum & 0x0000FFFF) + (Sum >> 16);
+	return ~Sum;
+}
+
 /**
  * Gets the IP to look up (taking care of routing) in the ARP table for any given IP address
  * @remark Only for internal use!
@@ -303,12 +384,28 @@ uint16_t _ethernet_calculate_checksum(const uint8_t* Buffer,uint16_t BufferSize,
  */
 uint32_t _ethernet_get_arp_table_ip(uint32_t IP)
 {
-	// If the target IP is not within our subnet, we need to send the packet to our router
-	if((IP & ethernet_NetMask) != (ethernet_IPAddress & ethernet_NetMask))
+	// If the target IP is not within our subnet, we need to send the packet to our router (multicast packets are sent to the group directly)
+	if((IP & ethernet_NetMask) != (ethernet_IPAddress & ethernet_NetMask) && !IS_MULTICAST_IP(IP))
 		return ethernet_RouterIP;
 	return IP;
 }
 
+/**
+ * Gets the MAC address a multicast IP address is mapped to (01:00:5E followed by the lower 23 bits of the IP address)
+ * @remark Only for internal use!
+ * @param IP The multicast IP address
+ * @param MAC Will store the six-byte MAC address
+ */
+void _ethernet_get_multicast_mac(uint32_t IP, uint8_t* MAC)
+{
+	MAC[0] = 0x01;
+	MAC[1] = 0x00;
+	MAC[2] = 0x5E;
+	MAC[3] = (IP >> 8) & 0x7F;
+	MAC[4] = (IP >> 16) & 0xFF;
+	MAC[5] = (IP >> 24) & 0xFF;
+}
+
 /**
  * Prepares the Ethernet Header of a packet to be sent
  * @remark Only for internal use!
@@ -324,12 +421,16 @@ void _ethernet_prepare_ethernet_header(uint32_t DestIP)
 		eth_hdr->Src[i] = mac_addr[i];
 	
 	// Destination MAC address
-	if(DestIP != MAKE_IP(255,255,255,255)){
+	if(IS_MULTICAST_IP(DestIP)){
+		_ethernet_get_multicast_mac(DestIP,eth_hdr->Dest);
+	}else if(DestIP != MAKE_IP(255,255,255,255)){
 		const ARPTableEntry* arp_entry = arp_table_get(_ethernet_get_arp_table_ip(DestIP));
 		if(arp_entry){
+			++ethernet_Statistics.ARPHits;
 			for(uint8_t i = 0; i < MAC_ADDRESS_LENGTH; ++i)
 				eth_hdr->Dest[i] = arp_entry->MAC[i];
 		}else{
+			++ethernet_Statistics.ARPMisses;
 			for(uint8_t i = 0; i < MAC_ADDRESS_LENGTH; ++i)
 				eth_hdr->Dest[i] = 0xFF;
 		}
@@ -343,8 +444,9 @@ void _ethernet_prepare_ethernet_header(uint32_t DestIP)
  * Prepares the IP Header of a packet to be sent
  * @remark Only for internal use!
  * @param DestIP The destination IP of the packet
+ * @param TOS The type of service byte (DSCP in the upper six bits)
  */
-void _ethernet_prepare_ip_header(uint32_t DestIP)
+void _ethernet_prepare_ip_header(uint32_t DestIP, uint8_t TOS)
 {
 	EthernetHeader* eth_hdr = (EthernetHeader*)(&ethernet_PacketBuffer[ETHERNET_HEADER_OFFSET]);
 	IPHeader* ip_hdr = (IPHeader*)(&ethernet_PacketBuffer[IP_HEADER_OFFSET]);
@@ -359,7 +461,7 @@ void _ethernet_prepare_ip_header(uint32_t DestIP)
 	ip_hdr->ID = HTONS(ethernet_IP_IDCounter);
 	++ethernet_IP_IDCounter;
 	ip_hdr->VersLen = 0x45;
-	ip_hdr->TOS = 0;
+	ip_hdr->TOS = TOS;
 	ip_hdr->DestAddr = DestIP;
 	ip_hdr->SrcAddr = ethernet_IPAddress;
 	ip_hdr->HdrCksum = 0;
@@ -395,7 +497,7 @@ void _ethernet_send_icmp_packet(uint32_t DestIP,uint8_t ICMP_Type,uint8_t ICMP_C
 	ip_hdr->PktLen = HTONS(len);
 	ip_hdr->Proto = IP_PROTOCOL_ICMP;
 	
-	_ethernet_prepare_ip_header(DestIP);
+	_ethernet_prepare_ip_header(DestIP,0);
 
 	uint16_t Checksum = _ethernet_calculate_checksum((const uint8_t*)icmp_hdr,len - ((ip_hdr->VersLen & 0x0F) << 2),0);
 	icmp_hdr->Cksum = HTONS(Checksum);
@@ -414,17 +516,170 @@ void _ethernet_handle_packet_icmp(size_t PacketLength)
 	ICMPHeader* icmp_hdr = (ICMPHeader*)(&ethernet_PacketBuffer[ICMP_HEADER_OFFSET]);
 
 	switch(icmp_hdr->Type){
-		// Ping reply (ignored as we don't send pings)
+		// Ping reply
 		case 0x00:
+			if(ethernet_icmp_echo_reply)
+				ethernet_icmp_echo_reply(ip_hdr->SrcAddr,NTOHS(icmp_hdr->ID),NTOHS(icmp_hdr->SeqNum));
 			break;
 		// Ping request
 		case 0x08:
+			++ethernet_Statistics.ICMPEchoes;
 			_ethernet_send_icmp_packet(ip_hdr->SrcAddr,0x00,0x00,NTOHS(icmp_hdr->SeqNum),NTOHS(icmp_hdr->ID),NTOHS(ip_hdr->PktLen) - IP_HEADER_LENGTH - ICMP_HEADER_LENGTH);
 			break;
 	}
 }
+
+void icmp_send_echo_request(uint32_t IP, uint16_t ID, uint16_t SeqNum)
+{
+	_ethernet_send_icmp_packet(IP,0x08,0x00,SeqNum,ID,0);
+}
+
+void icmp_set_echo_reply_callback(ethernet_callback_icmp_echo_reply NewCallback)
+{
+	ethernet_icmp_echo_reply = NewCallback;
+}
 #endif //IMPLEMENT_ICMP
 
+#ifdef IMPLEMENT_IGMP
+/**
+ * Sends an IGMP packet
+ * @remark Only for internal use!
+ * @param DestIP The destination IP of the packet
+ * @param Type The IGMP message type
+ * @param GroupIP The group the message is about
+ */
+void _ethernet_send_igmp_packet(uint32_t DestIP, uint8_t Type, uint32_t GroupIP)
+{
+	IPHeader* ip_hdr = (IPHeader*)(&ethernet_PacketBuffer[IP_HEADER_OFFSET]);
+	IGMPHeader* igmp_hdr = (IGMPHeader*)(&ethernet_PacketBuffer[IGMP_HEADER_OFFSET]);
+
+	igmp_hdr->Type = Type;
+	igmp_hdr->MaxRespTime = 0;
+	igmp_hdr->GroupAddr = GroupIP;
+	igmp_hdr->Cksum = 0;
+	igmp_hdr->Cksum = HTONS(_ethernet_calculate_checksum((const uint8_t*)igmp_hdr,IGMP_HEADER_LENGTH,0));
+	ip_hdr->PktLen = HTONS(IP_HEADER_LENGTH + IP_OPTION_ROUTER_ALERT_LENGTH + IGMP_HEADER_LENGTH);
+	ip_hdr->Proto = IP_PROTOCOL_IGMP;
+
+	_ethernet_prepare_ip_header(DestIP,0);
+
+	// IGMP messages must not leave our network and carry the router alert option (RFC 2236), redo the header checksum
+	uint8_t* option = &ethernet_PacketBuffer[IP_HEADER_OFFSET + IP_HEADER_LENGTH];
+	option[0] = 0x94;
+	option[1] = IP_OPTION_ROUTER_ALERT_LENGTH;
+	option[2] = 0x00;
+	option[3] = 0x00;
+	ip_hdr->VersLen = 0x40 | ((IP_HEADER_LENGTH + IP_OPTION_ROUTER_ALERT_LENGTH) >> 2);
+	ip_hdr->TTL = 1;
+	ip_hdr->HdrCksum = 0;
+	ip_hdr->HdrCksum = HTONS(_ethernet_calculate_checksum((const uint8_t*)ip_hdr,IP_HEADER_LENGTH + IP_OPTION_ROUTER_ALERT_LENGTH,0));
+
+	enc28j60_send(ethernet_PacketBuffer,IGMP_HEADER_OFFSET + IGMP_HEADER_LENGTH);
+}
+
+/**
+ * Gets the entry of a joined multicast group
+ * @remark Only for internal use!
+ * @param GroupIP The IP address of the group
+ * @return The entry, NULL if the group hasn't been joined
+ */
+IGMPGroup* _igmp_get_group(uint32_t GroupIP)
+{
+	for(uint8_t i = 0; i < IGMP_GROUP_TABLE_SIZE; ++i){
+		if(ethernet_IGMPGroups[i].GroupIP == GroupIP)
+			return &ethernet_IGMPGroups[i];
+	}
+	return NULL;
+}
+
+/**
+ * Checks if we receive packets sent to a multicast address
+ * @remark Only for internal use!
+ * @param GroupIP The multicast IP address
+ * @return True for all-systems (224.0.0.1) and joined groups
+ */
+bool _igmp_is_member(uint32_t GroupIP)
+{
+	return GroupIP == MAKE_IP(224,0,0,1) || _igmp_get_group(GroupIP);
+}
+
+/**
+ * Programs the controller's multicast filter with all-systems and the joined groups
+ * @remark Only for internal use!
+ */
+void _igmp_update_filter(void)
+{
+	uint8_t mac[MAC_ADDRESS_LENGTH];
+
+	enc28j60_clear_multicast_filter();
+	_ethernet_get_multicast_mac(MAKE_IP(224,0,0,1),mac);
+	enc28j60_add_multicast_filter(mac);
+	for(uint8_t i = 0; i < IGMP_GROUP_TABLE_SIZE; ++i){
+		if(ethernet_IGMPGroups[i].GroupIP){
+			_ethernet_get_multicast_mac(ethernet_IGMPGroups[i].GroupIP,mac);
+			enc28j60_add_multicast_filter(mac);
+		}
+	}
+}
+
+/**
+ * Sends the membership reports whose delay has elapsed
+ * @remark Only for internal use!
+ */
+void _igmp_second_tick(void)
+{
+	for(uint8_t i = 0; i < IGMP_GROUP_TABLE_SIZE; ++i){
+		IGMPGroup* group = &ethernet_IGMPGroups[i];
+		if(group->GroupIP && group->ReportDelay && --group->ReportDelay == 0)
+			_ethernet_send_igmp_packet(group->GroupIP,IGMP_TYPE_MEMBERSHIP_REPORT,group->GroupIP);
+	}
+}
+
+/**
+ * Handles a received IGMP packet
+ * @remark Only for internal use!
+ * @param PacketLength The length of the packet in bytes
+ */
+void _ethernet_handle_packet_igmp(size_t PacketLength)
+{
+	IPHeader* ip_hdr = (IPHeader*)(&ethernet_PacketBuffer[IP_HEADER_OFFSET]);
+
+	// Queries usually carry the router alert option, so the IGMP header doesn't have a fixed offset
+	size_t Offset = IP_HEADER_OFFSET + ((ip_hdr->VersLen & 0x0F) << 2);
+	if(Offset + IGMP_HEADER_LENGTH > PacketLength)
+		return;
+	IGMPHeader* igmp_hdr = (IGMPHeader*)(&ethernet_PacketBuffer[Offset]);
+
+	switch(igmp_hdr->Type){
+		// Membership query: report the queried groups (all of them for a general query) after a random delay
+		case IGMP_TYPE_MEMBERSHIP_QUERY:
+		{
+			// IGMPv1 queriers don't send a maximum response time, they use 10 seconds
+			uint8_t MaxDelay = igmp_hdr->MaxRespTime ? igmp_hdr->MaxRespTime / 10 : 10;
+			if(MaxDelay == 0)
+				MaxDelay = 1;
+
+			for(uint8_t i = 0; i < IGMP_GROUP_TABLE_SIZE; ++i){
+				IGMPGroup* group = &ethernet_IGMPGroups[i];
+				if(!group->GroupIP || (igmp_hdr->GroupAddr && igmp_hdr->GroupAddr != group->GroupIP))
+					continue;
+				if(group->ReportDelay == 0 || group->ReportDelay > MaxDelay)
+					group->ReportDelay = 1 + rand() % MaxDelay;
+			}
+			break;
+		}
+		// Another member has reported the group, ours would be redundant
+		case IGMP_TYPE_MEMBERSHIP_REPORT:
+		{
+			IGMPGroup* group = _igmp_get_group(igmp_hdr->GroupAddr);
+			if(group)
+				group->ReportDelay = 0;
+			break;
+		}
+	}
+}
+#endif //IMPLEMENT_IGMP
+
 #ifdef IMPLEMENT_UDP
 /**
  * Prepares the UDP header of a packet
@@ -443,7 +698,7 @@ bool _ethernet_prepare_udp_header(UDPSocket Socket, size_t Length)
 	IPHeader* ip_hdr = (IPHeader*)(&ethernet_PacketBuffer[IP_HEADER_OFFSET]);
 	ip_hdr->PktLen = HTONS(Length + IP_HEADER_LENGTH + UDP_HEADER_LENGTH);
 	ip_hdr->Proto = IP_PROTOCOL_UDP;
-	_ethernet_prepare_ip_header(udp_entry->RemoteIP);
+	_ethernet_prepare_ip_header(udp_entry->RemoteIP,udp_entry->DSCP << 2);
 
 	// Prepare the packet's UDP header
 	UDPHeader* udp_hdr = (UDPHeader*)(&ethernet_PacketBuffer[UDP_HEADER_OFFSET]);
@@ -455,6 +710,40 @@ bool _ethernet_prepare_udp_header(UDPSocket Socket, size_t Length)
 	return true;
 }
 
+/**
+ * Readdresses the UDP packet in the packet buffer to another host
+ * @remark Only for internal use! Instead of building the headers again, only the destination addresses and IP ID are replaced and the checksums updated accordingly
+ * @param DestIP The IP address of the new destination (the destination port is kept)
+ */
+void _ethernet_redirect_udp_packet(uint32_t DestIP)
+{
+	IPHeader* ip_hdr = (IPHeader*)(&ethernet_PacketBuffer[IP_HEADER_OFFSET]);
+	UDPHeader* udp_hdr = (UDPHeader*)(&ethernet_PacketBuffer[UDP_HEADER_OFFSET]);
+
+	_ethernet_prepare_ethernet_header(DestIP);
+
+	uint32_t OldIP = ip_hdr->DestAddr;
+	uint16_t NewID = HTONS(ethernet_IP_IDCounter);
+	++ethernet_IP_IDCounter;
+
+	// Both halves of the IP addresses are taken as they are stored, just like the checksum
+	uint16_t Checksum = ip_hdr->HdrCksum;
+	Checksum = _ethernet_adjust_checksum(Checksum,ip_hdr->ID,NewID);
+	Checksum = _ethernet_adjust_checksum(Checksum,(uint16_t)OldIP,(uint16_t)DestIP);
+	Checksum = _ethernet_adjust_checksum(Checksum,(uint16_t)(OldIP >> 16),(uint16_t)(DestIP >> 16));
+	ip_hdr->HdrCksum = Checksum;
+
+	// The UDP checksum covers the destination IP through the pseudo header (0 means there is no checksum)
+	if(udp_hdr->Checksum){
+		Checksum = _ethernet_adjust_checksum(udp_hdr->Checksum,(uint16_t)OldIP,(uint16_t)DestIP);
+		Checksum = _ethernet_adjust_checksum(Checksum,(uint16_t)(OldIP >> 16),(uint16_t)(DestIP >> 16));
+		udp_hdr->Checksum = Checksum ? Checksum : 0xFFFF;
+	}
+
+	ip_hdr->ID = NewID;
+	ip_hdr->DestAddr = DestIP;
+}
+
 /**
  * Handles a received UDP packet
  * @remark Only for internal use!
@@ -516,7 +805,7 @@ bool _ethernet_prepare_and_send_tcp_packet(size_t Length, uint16_t Flags, uint8_
 	IPHeader* ip_hdr = (IPHeader*)(&ethernet_PacketBuffer[IP_HEADER_OFFSET]);
 	ip_hdr->PktLen = HTONS(Length + AdditionalHeaderDWORDs * sizeof(uint32_t) + IP_HEADER_LENGTH + TCP_HEADER_LENGTH);
 	ip_hdr->Proto = IP_PROTOCOL_TCP;
-	_ethernet_prepare_ip_header(tcp_entry->RemoteIP);
+	_ethernet_prepare_ip_header(tcp_entry->RemoteIP,0);
 
 	// Prepare the packet's TCP header
 	if(!tcp_entry->HasAcknowledgedLastPacket){
@@ -573,6 +862,20 @@ void _ethernet_remove_tcp_connection(TCPSocket Socket)
 	}
 }
 
+/**
+ * Gets the state of a TCP connection
+ * @remark Only for internal use!
+ * @param Socket The socket of the connection
+ * @return The connection's state, TCP_CONNECTION_STATE_INVALID if the connection doesn't exist (anymore)
+ */
+TCPConnectionState _ethernet_get_tcp_connection_state(TCPSocket Socket)
+{
+	const TCPTableEntry* tcp_entry = tcp_table_get_by_socket(Socket);
+	if(!tcp_entry)
+		return TCP_CONNECTION_STATE_INVALID;
+	return tcp_entry->ConnectionState;
+}
+
 /**
  * Handles a received TCP packet
  * @remark Only for internal use!
@@ -779,12 +1082,23 @@ void _ethernet_handle_packet_ip(size_t PacketLength)
 
 		// Check if the protocol allows broadcasting
 		switch(ip_hdr->Proto){
+#ifdef IMPLEMENT_IGMP
+			case IP_PROTOCOL_IGMP:
+				isForUs = IS_MULTICAST_IP(ip_hdr->DestAddr);
+				break;
+#endif //IMPLEMENT_IGMP
 #ifdef IMPLEMENT_UDP
 			case IP_PROTOCOL_UDP:
 				isForUs = true;
 				break;
 #endif //IMPLEMENT_UDP
 		}
+
+#ifdef IMPLEMENT_IGMP
+		// The controller's hash filter lets packets for some other multicast groups through as well
+		if(IS_MULTICAST_IP(ip_hdr->DestAddr) && !_igmp_is_member(ip_hdr->DestAddr))
+			isForUs = false;
+#endif //IMPLEMENT_IGMP
 	}
 
 	// If it's for us, handle it
@@ -794,22 +1108,38 @@ void _ethernet_handle_packet_ip(size_t PacketLength)
 		switch(ip_hdr->Proto){
 #ifdef IMPLEMENT_ICMP
 			case IP_PROTOCOL_ICMP:
+				++ethernet_Statistics.PacketsICMP;
 				_ethernet_handle_packet_icmp(PacketLength);
 				break;
 #endif //IMPLEMENT_ICMP
 
+#ifdef IMPLEMENT_IGMP
+			case IP_PROTOCOL_IGMP:
+				++ethernet_Statistics.PacketsIGMP;
+				_ethernet_handle_packet_igmp(PacketLength);
+				break;
+#endif //IMPLEMENT_IGMP
+
 #ifdef IMPLEMENT_TCP
 			case IP_PROTOCOL_TCP:
+				++ethernet_Statistics.PacketsTCP;
 				_ethernet_handle_packet_tcp(PacketLength);
 				break;
 #endif //IMPLEMENT_TCP
 
 #ifdef IMPLEMENT_UDP
 			case IP_PROTOCOL_UDP:
+				++ethernet_Statistics.PacketsUDP;
 				_ethernet_handle_packet_udp(PacketLength);
 				break;
 #endif //IMPLEMENT_UDP
+
+			default:
+				++ethernet_Statistics.PacketsOther;
+				break;
 		}
+	}else{
+		++ethernet_Statistics.PacketsFiltered;
 	}
 }
 
@@ -844,38 +1174,20 @@ void _ethernet_send_arp_request(uint32_t IP)
 
 /**
  * Ensures a given IP address is stored in the ARP table
- * @remark Only for internal use!
+ * @remark Only for internal use! Blocks until the resolution has finished, use ethernet_arp_resolve_thread where this hurts.
  * @param IP The IP address
  * @param Timeout The timeout (in milliseconds) until the operation will be aborted)
  * @return True if everything went fine and the IP address is now stored in the ARP table, false otherwise
  */
 bool _ethernet_ensure_arp_entry_exists(uint32_t IP, uint16_t Timeout)
 {
-	IP = _ethernet_get_arp_table_ip(IP);
-
-	// Check if there is any slot left in the ARP table
-	if(arp_table_is_full() && !arp_table_get(IP))
-		return false;
+	ARPResolve Resolve;
+	ethernet_arp_resolve_start(&Resolve,IP,Timeout);
 
-	uint16_t Timer = 0;
-	while(Timer <= Timeout){
-		// Check if the entry is there
-		if(arp_table_get(IP))
-			return true;
-
-		// Send a new ARP request every 500ms (in case the previous one got lost)
-		if((Timer % 500) == 0)
-			_ethernet_send_arp_request(IP);
-
-		// Update
+	while(PT_SCHEDULE(ethernet_arp_resolve_thread(&Resolve)))
 		ethernet_update();
 
-		// Wait 1ms and continue
-		_delay_ms(1);
-		++Timer;
-	}
-
-	return false;
+	return Resolve.Resolved;
 }
 
 /**
@@ -889,8 +1201,11 @@ void _ethernet_handle_packet_arp(size_t PacketLength)
 	ARPHeader* arp_hdr = (ARPHeader*)(&ethernet_PacketBuffer[ARP_HEADER_OFFSET]);
 
 	// Check if we're the target of the packet
-	if(arp_hdr->TIPAddr != ethernet_IPAddress)
+	if(arp_hdr->TIPAddr != ethernet_IPAddress){
+		++ethernet_Statistics.PacketsFiltered;
 		return;
+	}
+	++ethernet_Statistics.PacketsARP;
 
 	// Check if the ARP packet's
 	// -> Hardware Type is Ethernet
@@ -954,6 +1269,11 @@ void _ethernet_handle_packet(size_t PacketLength)
 			_ethernet_handle_packet_arp(PacketLength);
 			break;
 		}
+		default:
+		{
+			++ethernet_Statistics.PacketsOther;
+			break;
+		}
 	}
 }
 
@@ -968,6 +1288,7 @@ void _ethernet_initialise_impl(void)
 	ethernet_NetMask = 0;
 	ethernet_RouterIP = 0;
 	ethernet_SecondElapsed = false;
+	ethernet_reset_statistics();
 
 #ifdef USE_INTERRUPTS
 	ethernet_InterruptOccurred = false;
@@ -976,6 +1297,12 @@ void _ethernet_initialise_impl(void)
 	// Initialise ARP
 	arp_table_initialise();
 
+#ifdef IMPLEMENT_IGMP
+	// Initialise IGMP
+	memset(ethernet_IGMPGroups,0,sizeof(ethernet_IGMPGroups));
+	_igmp_update_filter();
+#endif //IMPLEMENT_IGMP
+
 #ifdef IMPLEMENT_UDP
 	// Initialise UDP
 	_udp_initialise();
@@ -1023,10 +1350,16 @@ void ethernet_second_tick(void)
 
 void ethernet_update(void)
 {
+	// Keep queued frames going out
+	enc28j60_service();
+
 	if(ethernet_SecondElapsed){
 		ethernet_SecondElapsed = false;
 
 		arp_table_second_tick();
+#ifdef IMPLEMENT_IGMP
+		_igmp_second_tick();
+#endif // IMPLEMENT_IGMP
 #ifdef IMPLEMENT_DHCP
 		dhcp_second_tick();
 #endif // IMPLEMENT_DHCP
@@ -1049,22 +1382,48 @@ void ethernet_update(void)
 #	endif //HANDLE_LINK_STATUS_CHANGES
 #endif //USE_INTERRUPTS
 
-		// Receive all queued packets
+		// Receive the queued packets, but no more than the budget allows
+		bool BudgetExhausted = false;
+		uint8_t PacketCount = 0;
+		uint32_t StartTime = millis;
 		while(enc28j60_has_packet_interrupt()){
+			if(PacketCount >= ETHERNET_RX_BUDGET_PACKETS || (ETHERNET_RX_BUDGET_TIME != 0 && (millis - StartTime) >= ETHERNET_RX_BUDGET_TIME)){
+				BudgetExhausted = true;
+				++ethernet_Statistics.RxBudgetExhausted;
+				break;
+			}
+
 			uint16_t PacketLength = enc28j60_receive(ethernet_PacketBuffer,MTU_SIZE);
 			if(PacketLength == 0)
 				break;
 			ethernet_PacketBuffer[PacketLength] = 0x00;
 			_ethernet_handle_packet(PacketLength);
+			++PacketCount;
 		}
 
 #ifdef USE_INTERRUPTS
-		ethernet_InterruptOccurred = false;
-		enc28j60_enable_interrupts();
+		// While packets are left in the controller, stay in polling mode (the interrupt flag remains set and
+		// controller interrupts remain disabled) and only switch back to interrupts once the backlog is gone
+		if(!BudgetExhausted){
+			ethernet_InterruptOccurred = false;
+			enc28j60_enable_interrupts();
+		}
 	}
+#else
+	(void)BudgetExhausted;
 #endif //USE_INTERRUPTS
 }
 
+const EthernetStatistics* ethernet_get_statistics(void)
+{
+	return &ethernet_Statistics;
+}
+
+void ethernet_reset_statistics(void)
+{
+	memset(&ethernet_Statistics,0,sizeof(ethernet_Statistics));
+}
+
 #ifdef USE_INTERRUPTS
 void ethernet_data_interrupt(void)
 {
@@ -1104,6 +1463,71 @@ void _ethernet_set_ip_netmask_router(uint32_t IP, uint32_t NetMask, uint32_t Rou
 	ethernet_RouterIP = RouterIP;
 }
 
+void ethernet_arp_resolve_start(ARPResolve* Resolve, uint32_t IP, uint16_t Timeout)
+{
+	PT_INIT(&Resolve->PT);
+	Resolve->IP = _ethernet_get_arp_table_ip(IP);
+	Resolve->Timeout = Timeout;
+	Resolve->StartTime = millis;
+	Resolve->LastRequestTime = Resolve->StartTime - ARP_REQUEST_INTERVAL;
+	Resolve->Resolved = false;
+}
+
+PT_THREAD(ethernet_arp_resolve_thread(ARPResolve* Resolve))
+{
+	PT_BEGIN(&Resolve->PT);
+
+	// Multicast and broadcast addresses are mapped to MAC addresses directly
+	if(IS_MULTICAST_IP(Resolve->IP) || Resolve->IP == MAKE_IP(255,255,255,255)){
+		Resolve->Resolved = true;
+		PT_EXIT(&Resolve->PT);
+	}
+
+	// Check if there is any slot left in the ARP table
+	if(arp_table_is_full() && !arp_table_get(Resolve->IP))
+		PT_EXIT(&Resolve->PT);
+
+	while(!arp_table_get(Resolve->IP)){
+		if((millis - Resolve->StartTime) > Resolve->Timeout)
+			PT_EXIT(&Resolve->PT);
+
+		// Send a new ARP request every ARP_REQUEST_INTERVAL (in case the previous one got lost)
+		if((millis - Resolve->LastRequestTime) >= ARP_REQUEST_INTERVAL){
+			Resolve->LastRequestTime = millis;
+			_ethernet_send_arp_request(Resolve->IP);
+		}
+
+		// Let the main loop (and with it ethernet_update) run until the reply has arrived
+		PT_YIELD(&Resolve->PT);
+	}
+
+	Resolve->Resolved = true;
+	PT_END(&Resolve->PT);
+}
+
+bool ethernet_arp_lookup(uint32_t IP)
+{
+	static uint32_t LastRequestIP = 0;
+	static uint32_t LastRequestTime = 0;
+
+	// Multicast and broadcast addresses are mapped to MAC addresses directly
+	if(IS_MULTICAST_IP(IP) || IP == MAKE_IP(255,255,255,255))
+		return true;
+
+	IP = _ethernet_get_arp_table_ip(IP);
+	const ARPTableEntry* arp_entry = arp_table_get(IP);
+	if(arp_entry && arp_entry->TimeLeft > ARP_TABLE_REFRESH_TIME)
+		return true;
+
+	// Ask for the MAC address again before the entry expires, the reply refreshes it. A full table has no room for a new one.
+	if((arp_entry || !arp_table_is_full()) && (IP != LastRequestIP || (millis - LastRequestTime) >= ARP_REQUEST_INTERVAL)){
+		LastRequestIP = IP;
+		LastRequestTime = millis;
+		_ethernet_send_arp_request(IP);
+	}
+	return arp_entry != NULL;
+}
+
 #ifdef IMPLEMENT_DHCP
 bool _ethernet_configure_via_dhcp(const char* Hostname, uint16_t Timeout)
 {
@@ -1148,6 +1572,48 @@ uint32_t ethernet_get_router_ip(void)
 	return ethernet_RouterIP;
 }
 
+#ifdef IMPLEMENT_IGMP
+bool igmp_join_group(uint32_t GroupIP)
+{
+	if(!IS_MULTICAST_IP(GroupIP))
+		return false;
+	if(_igmp_get_group(GroupIP))
+		return true;
+
+	IGMPGroup* group = _igmp_get_group(0);
+	if(!group)
+		return false;
+	group->GroupIP = GroupIP;
+	_igmp_update_filter();
+
+	// Report the membership right away and once more a little later in case the first report got lost
+	group->ReportDelay = 1 + rand() % IGMP_UNSOLICITED_REPORT_INTERVAL;
+	_ethernet_send_igmp_packet(GroupIP,IGMP_TYPE_MEMBERSHIP_REPORT,GroupIP);
+	return true;
+}
+
+void igmp_leave_group(uint32_t GroupIP)
+{
+	IGMPGroup* group = _igmp_get_group(GroupIP);
+	if(!group || !GroupIP)
+		return;
+	group->GroupIP = 0;
+	group->ReportDelay = 0;
+	_igmp_update_filter();
+
+	// Tell the routers (all-routers group), so they can stop forwarding the group sooner
+	_ethernet_send_igmp_packet(MAKE_IP(224,0,0,2),IGMP_TYPE_LEAVE_GROUP,GroupIP);
+}
+
+void igmp_report_groups(void)
+{
+	for(uint8_t i = 0; i < IGMP_GROUP_TABLE_SIZE; ++i){
+		if(ethernet_IGMPGroups[i].GroupIP)
+			ethernet_IGMPGroups[i].ReportDelay = 1;
+	}
+}
+#endif //IMPLEMENT_IGMP
+
 #ifdef IMPLEMENT_UDP
 UDPSocket udp_connect(uint32_t IP, uint16_t Port, uint16_t Timeout, UDPCallbackHandlePacket HandlePacketCallback)
 {
@@ -1222,14 +1688,10 @@ bool udp_start_packet(UDPSocket Socket, uint8_t** BufferPtr, size_t* BufferSize)
 	if(!udp_entry)
 		return false;
 
-	// Refresh its ARP entry
-	if(udp_entry->RemoteIP != MAKE_IP(255,255,255,255)){
-		if(!_ethernet_ensure_arp_entry_exists(udp_entry->RemoteIP,udp_entry->TimeoutValue)){
-			// If the refresh failed, we assume the connection to have timed out and the remote host to be no longer available
-			udp_disconnect(ethernet_CurrentPacketUDPSocket);
-			ethernet_CurrentPacketUDPSocket = INVALID_UDP_SOCKET;
-			return false;
-		}
+	// The MAC address of the remote host must be known, waiting for ARP would hold up the main loop
+	if(!ethernet_arp_lookup(udp_entry->RemoteIP)){
+		ethernet_CurrentPacketUDPSocket = INVALID_UDP_SOCKET;
+		return false;
 	}
 
 	*BufferPtr = &(ethernet_PacketBuffer[UDP_DATA_OFFSET]);
@@ -1248,13 +1710,87 @@ void udp_send(size_t Length)
 		return;
 
 	// Send the packet
-	enc28j60_send(ethernet_PacketBuffer,Length + UDP_HEADER_LENGTH + IP_HEADER_LENGTH + ETHERNET_HEADER_LENGTH);
+	const UDPTableEntry* udp_entry = udp_table_get_by_socket(ethernet_CurrentPacketUDPSocket);
+	enc28j60_send_ex(ethernet_PacketBuffer,Length + UDP_HEADER_LENGTH + IP_HEADER_LENGTH + ETHERNET_HEADER_LENGTH,udp_entry->Priority);
 }
+
+void udp_send_multiple(size_t Length, const uint32_t* IPs, uint8_t Count)
+{
+	if(!udp_table_is_valid_socket(ethernet_CurrentPacketUDPSocket))
+		return;
+
+	// Prepare the header once, every further host only costs rewriting the addresses
+	if(!_ethernet_prepare_udp_header(ethernet_CurrentPacketUDPSocket,Length))
+		return;
+
+	const UDPTableEntry* udp_entry = udp_table_get_by_socket(ethernet_CurrentPacketUDPSocket);
+	for(uint8_t i = 0; i < Count; ++i){
+		// The headers were built for the connection's remote IP
+		if(i != 0 || IPs[i] != udp_entry->RemoteIP)
+			_ethernet_redirect_udp_packet(IPs[i]);
+		enc28j60_send_ex(ethernet_PacketBuffer,Length + UDP_HEADER_LENGTH + IP_HEADER_LENGTH + ETHERNET_HEADER_LENGTH,udp_entry->Priority);
+	}
+}
+
+#ifdef IMPLEMENT_REPEAT
+void udp_send_repeatable(size_t Length, const uint32_t* IPs, uint8_t Count)
+{
+	if(!udp_table_is_valid_socket(ethernet_CurrentPacketUDPSocket) || Count == 0)
+		return;
+
+	if(!_ethernet_prepare_udp_header(ethernet_CurrentPacketUDPSocket,Length))
+		return;
+
+	// Keep the headers, the packet buffer will have been used for other packets by the time the packet is repeated
+	memcpy(ethernet_RepeatHeader,ethernet_PacketBuffer,UDP_DATA_OFFSET);
+	ethernet_RepeatHeaderIP = udp_table_get_by_socket(ethernet_CurrentPacketUDPSocket)->RemoteIP;
+
+	if(IPs[0] != ethernet_RepeatHeaderIP)
+		_ethernet_redirect_udp_packet(IPs[0]);
+	enc28j60_send_repeatable(ethernet_PacketBuffer,Length + UDP_HEADER_LENGTH + IP_HEADER_LENGTH + ETHERNET_HEADER_LENGTH);
+	ethernet_RepeatCurrentIP = IPs[0];
+
+	udp_repeat(IPs + 1,Count - 1);
+}
+
+void udp_repeat(const uint32_t* IPs, uint8_t Count)
+{
+	for(uint8_t i = 0; i < Count; ++i){
+		// Only the headers are written to the controller, and only if the packet is not already addressed to the host
+		if(IPs[i] == ethernet_RepeatCurrentIP){
+			enc28j60_repeat(NULL,0);
+			continue;
+		}
+
+		memcpy(ethernet_PacketBuffer,ethernet_RepeatHeader,UDP_DATA_OFFSET);
+		if(IPs[i] != ethernet_RepeatHeaderIP)
+			_ethernet_redirect_udp_packet(IPs[i]);
+		enc28j60_repeat(ethernet_PacketBuffer,UDP_DATA_OFFSET);
+		ethernet_RepeatCurrentIP = IPs[i];
+	}
+}
+#endif //IMPLEMENT_REPEAT
 #endif //IMPLEMENT_UDP
 
 #ifdef IMPLEMENT_TCP
 TCPSocket tcp_connect(uint32_t IP, uint16_t Port, uint16_t Timeout, TCPCallbackHandlePacket HandlePacketCallback)
 {
+	TCPConnect Connect;
+	if(!tcp_connect_start(&Connect,IP,Port,Timeout,HandlePacketCallback))
+		return INVALID_TCP_SOCKET;
+
+	while(PT_SCHEDULE(tcp_connect_thread(&Connect)))
+		ethernet_update();
+
+	return Connect.Socket;
+}
+
+bool tcp_connect_start(TCPConnect* Connect, uint32_t IP, uint16_t Port, uint16_t Timeout, TCPCallbackHandlePacket HandlePacketCallback)
+{
+	PT_INIT(&Connect->PT);
+	Connect->Socket = INVALID_TCP_SOCKET;
+	Connect->Timeout = Timeout;
+
 	// Find an unused local port for packet reception
 	uint16_t LocalPort = 0;
 
@@ -1264,25 +1800,35 @@ TCPSocket tcp_connect(uint32_t IP, uint16_t Port, uint16_t Timeout, TCPCallbackH
 
 	// Start listening on that port
 	if(!tcp_open_port(LocalPort,Timeout,NULL,NULL,HandlePacketCallback))
-		return INVALID_TCP_SOCKET;
+		return false;
 
 	// Add the connection
-	TCPSocket sock = _tcp_table_add(IP,LocalPort,Port,Timeout,true);
+	Connect->Socket = _tcp_table_add(IP,LocalPort,Port,Timeout,true);
 
 	// If the socket isn't valid, stop listening instantly
-	if(LocalPort != 0 && sock == INVALID_TCP_SOCKET){
+	if(Connect->Socket == INVALID_TCP_SOCKET){
 		tcp_close_port(LocalPort);
-		return INVALID_TCP_SOCKET;
+		return false;
 	}
 
+	ethernet_arp_resolve_start(&Connect->ARP,IP,Timeout);
+	return true;
+}
+
+PT_THREAD(tcp_connect_thread(TCPConnect* Connect))
+{
+	PT_BEGIN(&Connect->PT);
+
 	// Ensure we have the remote IP in our ARP table
-	if(!_ethernet_ensure_arp_entry_exists(IP,Timeout)){
-		_ethernet_remove_tcp_connection(sock);
-		return INVALID_TCP_SOCKET;
+	PT_WAIT_THREAD(&Connect->PT,ethernet_arp_resolve_thread(&Connect->ARP));
+	if(!Connect->ARP.Resolved || !tcp_table_is_valid_socket(Connect->Socket)){
+		_ethernet_remove_tcp_connection(Connect->Socket);
+		Connect->Socket = INVALID_TCP_SOCKET;
+		PT_EXIT(&Connect->PT);
 	}
 
 	// Start the handshake including the MSS option
-	TCPTableEntry* tcp_entry = tcp_table_get_by_socket(sock);
+	TCPTableEntry* tcp_entry = tcp_table_get_by_socket(Connect->Socket);
 	tcp_entry->ConnectionState = TCP_CONNECTION_STATE_HANDSHAKE_OUTGOING;
 	tcp_entry->HasAcknowledgedLastPacket = true;
 	tcp_entry->LastSequenceNumber = rand32();
@@ -1298,27 +1844,17 @@ TCPSocket tcp_connect(uint32_t IP, uint16_t Port, uint16_t Timeout, TCPCallbackH
 	++tcp_entry->LastSequenceNumber;
 
 	// Wait for the handshake to finish
-	uint16_t Timer = 0;
-	while(Timer <= Timeout){
-		// Update
-		ethernet_update();
-
-		// Check if we have received an answer
-		if(tcp_entry->ConnectionState != TCP_CONNECTION_STATE_HANDSHAKE_OUTGOING)
-			break;
-
-		// Wait 1ms and continue
-		_delay_ms(1);
-		++Timer;
-	}
+	Connect->StartTime = millis;
+	PT_WAIT_UNTIL(&Connect->PT,_ethernet_get_tcp_connection_state(Connect->Socket) != TCP_CONNECTION_STATE_HANDSHAKE_OUTGOING || (millis - Connect->StartTime) > Connect->Timeout);
 
 	// If the connection failed, remove it
-	if(tcp_entry->ConnectionState != TCP_CONNECTION_STATE_CONNECTED){
-		_ethernet_remove_tcp_connection(sock);
-		return INVALID_TCP_SOCKET;
+	if(_ethernet_get_tcp_connection_state(Connect->Socket) != TCP_CONNECTION_STATE_CONNECTED){
+		_ethernet_remove_tcp_connection(Connect->Socket);
+		Connect->Socket = INVALID_TCP_SOCKET;
+		PT_EXIT(&Connect->PT);
 	}
 
-	return sock;
+	PT_END(&Connect->PT);
 }
 
 void tcp_disconnect(TCPSocket Socket)
@@ -1358,25 +1894,13 @@ bool tcp_start_packet(TCPSocket Socket, uint8_t** BufferPtr, size_t* BufferSize)
 	if(!tcp_entry)
 		return false;
 
-	// Refresh its ARP entry
-	if(!_ethernet_ensure_arp_entry_exists(tcp_entry->RemoteIP,tcp_entry->TimeoutValue)){
-		// If the refresh failed, we assume the connection to have timed out and the remote host to be no longer available
-		// Inform the TCP application of the connection termination if required
-		const TCPApplication* tcp_app = tcp_get_port_application(tcp_entry->LocalPort);
-		if(tcp_app){
-			if(tcp_app->CloseConnectionCallback)
-				tcp_app->CloseConnectionCallback(Socket);
-		}
-
-		// Forcefully remove the connection (we cannot even send the teardown anymore...)
-		_ethernet_remove_tcp_connection(ethernet_CurrentPacketTCPSocket);
-		ethernet_CurrentPacketTCPSocket = INVALID_TCP_SOCKET;
-		return false;
-	}
-
 	*BufferPtr = &(ethernet_PacketBuffer[TCP_HEADER_OFFSET + TCP_HEADER_LENGTH]);
 	*BufferSize = MTU_SIZE - TCP_HEADER_OFFSET - TCP_HEADER_LENGTH;
 
+	// The MAC address of our partner must be known, waiting for ARP would hold up the main loop. Segments answering our partner are built regardless, its packet has just refreshed the entry.
+	if(!ethernet_arp_lookup(tcp_entry->RemoteIP))
+		return false;
+
 	return true;
 }
 
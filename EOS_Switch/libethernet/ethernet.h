@@ -33,6 +33,8 @@ extern "C"
 {
 #endif //__cplusplus
 
+#include "pt.h"
+
 #ifdef IMPLEMENT_UDP
 #	include "udp.h"
 #endif
@@ -47,6 +49,92 @@ typedef void (*ethernet_callback_link_status_change)(bool CurrentStatus);
 #endif //HANDLE_LINK_STATUS_CHANGES
 #endif //USE_INTERRUPTS
 
+#ifdef IMPLEMENT_ICMP
+/// The prototype of the callback that will be invoked when an ICMP echo reply has been received
+typedef void (*ethernet_callback_icmp_echo_reply)(uint32_t IP, uint16_t ID, uint16_t SeqNum);
+#endif //IMPLEMENT_ICMP
+
+/// Counters maintained by the ethernet stack
+typedef struct _EthernetStatistics
+{
+	/// Outgoing packets whose destination MAC address was found in the ARP table
+	uint32_t ARPHits;
+
+	/// Outgoing packets whose destination MAC address was not found in the ARP table (sent to broadcast instead)
+	uint32_t ARPMisses;
+
+	/// Answered ICMP echo requests
+	uint32_t ICMPEchoes;
+
+	/// Received ARP packets addressed to us
+	uint32_t PacketsARP;
+
+	/// Received ICMP packets addressed to us
+	uint32_t PacketsICMP;
+
+	/// Received IGMP packets addressed to us
+	uint32_t PacketsIGMP;
+
+	/// Received UDP packets addressed to us
+	uint32_t PacketsUDP;
+
+	/// Received TCP packets addressed to us
+	uint32_t PacketsTCP;
+
+	/// Received packets of an unknown or unsupported protocol
+	uint32_t PacketsOther;
+
+	/// Received packets that were dropped because they weren't addressed to us
+	uint32_t PacketsFiltered;
+
+	/// The number of times ethernet_update stopped receiving because the receive budget was exhausted
+	/// @remark A steadily increasing value means the network delivers more packets than we can handle
+	uint32_t RxBudgetExhausted;
+} EthernetStatistics;
+
+/// The state of a non-blocking ARP resolution (see ethernet_arp_resolve_start)
+typedef struct _ARPResolve
+{
+	/// The protothread state
+	Protothread PT;
+
+	/// The IP address to look up in the ARP table (the router's IP for hosts outside our subnet)
+	uint32_t IP;
+
+	/// The timeout (in milliseconds) until the resolution is aborted
+	uint16_t Timeout;
+
+	/// The time (in milliseconds) at which the resolution was started
+	uint32_t StartTime;
+
+	/// The time (in milliseconds) at which the last ARP request was sent
+	uint32_t LastRequestTime;
+
+	/// Set once the IP address has been stored in the ARP table
+	bool Resolved;
+} ARPResolve;
+
+#ifdef IMPLEMENT_TCP
+/// The state of a non-blocking TCP connection attempt (see tcp_connect_start)
+typedef struct _TCPConnect
+{
+	/// The protothread state
+	Protothread PT;
+
+	/// The ARP resolution of the remote host
+	ARPResolve ARP;
+
+	/// The connection's socket. INVALID_TCP_SOCKET if the connection failed
+	TCPSocket Socket;
+
+	/// The timeout (in milliseconds) of the handshake
+	uint16_t Timeout;
+
+	/// The time (in milliseconds) at which the handshake was started
+	uint32_t StartTime;
+} TCPConnect;
+#endif //IMPLEMENT_TCP
+
 /// The hardware type identifier for ethernet used in multiple protocols such as ARP and DHCP
 #define HARDWARE_TYPE_ETHERNET 0x0001
 
@@ -60,6 +148,13 @@ typedef void (*ethernet_callback_link_status_change)(bool CurrentStatus);
  */
 #define MAKE_IP(a,b,c,d) (((unsigned long)(d)<<24)+((unsigned long)(c)<<16)+((unsigned long)(b)<<8)+a)
 
+/**
+ * Checks if an IP address is a multicast address (224.0.0.0 - 239.255.255.255)
+ * @param IP The IP DWORD
+ * @return True for a multicast address
+ */
+#define IS_MULTICAST_IP(IP) (((IP) & 0xF0) == 0xE0)
+
 /**
  * Converts a two-byte integer from host endianess to network endianess
  * @param x The integer in host endianess
@@ -125,6 +220,18 @@ void ethernet_second_tick(void);
  */
 void ethernet_update(void);
 
+/**
+ * Gets the counters maintained by the ethernet stack
+ * @remark The driver's counters are available via enc28j60_get_statistics
+ * @return The stack's statistics
+ */
+const EthernetStatistics* ethernet_get_statistics(void);
+
+/**
+ * Resets all of the stack's counters to 0
+ */
+void ethernet_reset_statistics(void);
+
 #ifdef USE_INTERRUPTS
 /**
  * Informs the ethernet stack of a data interrupt
@@ -163,6 +270,31 @@ void ethernet_set_link_status_change_callback(ethernet_callback_link_status_chan
  */
 void _ethernet_set_ip_netmask_router(uint32_t IP, uint32_t NetMask, uint32_t RouterIP);
 
+/**
+ * Starts resolving the MAC address of a given IP address without blocking
+ * @remark Run ethernet_arp_resolve_thread until it has finished. ethernet_update must still be called meanwhile!
+ * @param Resolve The state of the resolution. Must stay valid until the resolution has finished
+ * @param IP The IP address
+ * @param Timeout The timeout (in milliseconds) until the resolution is aborted
+ */
+void ethernet_arp_resolve_start(ARPResolve* Resolve, uint32_t IP, uint16_t Timeout);
+
+/**
+ * Advances an ARP resolution started by ethernet_arp_resolve_start
+ * @remark Check Resolve->Resolved once the protothread has finished
+ * @param Resolve The state of the resolution
+ * @return The protothread state (PT_WAITING/PT_YIELDED while running, PT_EXITED/PT_ENDED once finished)
+ */
+PT_THREAD(ethernet_arp_resolve_thread(ARPResolve* Resolve));
+
+/**
+ * Looks up the MAC address of a given IP address without blocking
+ * @remark If the address is missing from the ARP table or its entry expires within ARP_TABLE_REFRESH_TIME, an ARP request is sent (at most twice a second for the same address). Call this regularly for hosts which must stay resolved.
+ * @param IP The IP address
+ * @return True if the MAC address is known and packets to the address can be sent right away
+ */
+bool ethernet_arp_lookup(uint32_t IP);
+
 #ifdef IMPLEMENT_DHCP
 /**
  * Tries to retrieve a valid DHCP configuration
@@ -193,6 +325,46 @@ uint32_t ethernet_get_netmask(void);
 uint32_t ethernet_get_router_ip(void);
 
 
+#ifdef IMPLEMENT_ICMP
+/**
+ * Sends an ICMP echo request (ping) without data
+ * @remark The IP address should have been resolved with ethernet_arp_resolve_thread, the request is sent to the broadcast MAC address otherwise
+ * @param IP The IP address of the host
+ * @param ID The ID, to tell the replies to different senders apart
+ * @param SeqNum The sequence number, to tell the replies to different requests apart
+ */
+void icmp_send_echo_request(uint32_t IP, uint16_t ID, uint16_t SeqNum);
+
+/**
+ * Sets the function to handle received ICMP echo replies
+ * @remark The callback is invoked while the reply is being handled, it must not send any packets
+ * @param NewCallback The callback handler, NULL for no callback
+ */
+void icmp_set_echo_reply_callback(ethernet_callback_icmp_echo_reply NewCallback);
+#endif //IMPLEMENT_ICMP
+
+#ifdef IMPLEMENT_IGMP
+/**
+ * Joins a multicast group so that packets sent to it are received
+ * @remark Sending to a multicast group does not require joining it, packets are sent to multicast addresses without ARP
+ * @param GroupIP The IP address of the group
+ * @return True if the group has been joined, false if GroupIP is no multicast address or the group table is full
+ */
+bool igmp_join_group(uint32_t GroupIP);
+
+/**
+ * Leaves a multicast group
+ * @param GroupIP The IP address of the group
+ */
+void igmp_leave_group(uint32_t GroupIP);
+
+/**
+ * Reports all joined groups again, for example once the link is back up
+ * @remark The reports are sent with the next second tick
+ */
+void igmp_report_groups(void);
+#endif //IMPLEMENT_IGMP
+
 #ifdef IMPLEMENT_UDP
 /**
  * Establishes an UDP connection to the given IP at the given Port
@@ -228,7 +400,7 @@ void udp_disconnect(UDPSocket Socket);
  * @param Socket The socket this packet will be sent to when calling udp_send()
  * @param BufferPtr Will store a pointer to the first byte you may write to
  * @param BufferSize Will store the maximum size (in bytes) that you may write
- * @return True if everything succeeded. If False is returned, the connection has timed out and Socket IS NO LONGER VALID!
+ * @return True if everything succeeded. If False is returned, either Socket is not valid or the MAC address of the remote host is not known yet (see ethernet_arp_lookup). Try again later in the latter case.
  */
 bool udp_start_packet(UDPSocket Socket, uint8_t** BufferPtr, size_t* BufferSize);
 
@@ -239,6 +411,36 @@ bool udp_start_packet(UDPSocket Socket, uint8_t** BufferPtr, size_t* BufferSize)
  * @param Length The number (in bytes) of data to send
  */
 void udp_send(size_t Length);
+
+/**
+ * Sends a packet via UDP to several hosts
+ * @remark Sends the last packet started via udp_start_packet to the remote port of its connection on each of the hosts. The headers are built once, for each further host only the addresses, IP ID and checksums are rewritten.
+ * @remark The hosts should be in the ARP table (see ethernet_arp_resolve_start), otherwise the packet is broadcast to them
+ * @param Length The number (in bytes) of data to send
+ * @param IPs The IP addresses of the hosts (the connection's remote IP does not have to be among them)
+ * @param Count The number of hosts
+ */
+void udp_send_multiple(size_t Length, const uint32_t* IPs, uint8_t Count);
+
+#ifdef IMPLEMENT_REPEAT
+/**
+ * Sends a packet via UDP to several hosts, like udp_send_multiple, and keeps it in the controller so that it can be sent again with udp_repeat
+ * @remark The packet is always sent with priority. It replaces the packet that was kept before.
+ * @param Length The number (in bytes) of data to send
+ * @param IPs The IP addresses of the hosts
+ * @param Count The number of hosts
+ */
+void udp_send_repeatable(size_t Length, const uint32_t* IPs, uint8_t Count);
+
+/**
+ * Sends the packet kept by udp_send_repeatable again
+ * @remark The data is not copied to the controller again, for each host only the headers are rewritten (and only if the packet was last sent to another host)
+ * @remark Uses the packet buffer, so it must not be called while a packet is being built or handled
+ * @param IPs The IP addresses of the hosts
+ * @param Count The number of hosts
+ */
+void udp_repeat(const uint32_t* IPs, uint8_t Count);
+#endif //IMPLEMENT_REPEAT
 #endif //IMPLEMENT_UDP
 
 #ifdef IMPLEMENT_TCP
@@ -252,6 +454,26 @@ void udp_send(size_t Length);
  */
 TCPSocket tcp_connect(uint32_t IP, uint16_t Port, uint16_t Timeout, TCPCallbackHandlePacket HandlePacketCallback);
 
+/**
+ * Starts establishing a TCP connection to the given IP at the given Port without blocking
+ * @remark Run tcp_connect_thread until it has finished. ethernet_update must still be called meanwhile!
+ * @param Connect The state of the connection attempt. Must stay valid until the attempt has finished
+ * @param IP The IP address
+ * @param Port The port
+ * @param Timeout The maximum time the ARP resolution and the TCP handshake may take (in milliseconds) each
+ * @param HandlePacketCallback The callback that will be invoked when answers are received. Can be NULL (you cannot receive any answer then!).
+ * @return False if no local port or connection slot was available, True otherwise
+ */
+bool tcp_connect_start(TCPConnect* Connect, uint32_t IP, uint16_t Port, uint16_t Timeout, TCPCallbackHandlePacket HandlePacketCallback);
+
+/**
+ * Advances a TCP connection attempt started by tcp_connect_start
+ * @remark Check Connect->Socket once the protothread has finished
+ * @param Connect The state of the connection attempt
+ * @return The protothread state (PT_WAITING/PT_YIELDED while running, PT_EXITED/PT_ENDED once finished)
+ */
+PT_THREAD(tcp_connect_thread(TCPConnect* Connect));
+
 /**
  * Terminates a TCP connection
  * @remark Socket will no longer be valid after the connection was terminated!
@@ -265,7 +487,7 @@ void tcp_disconnect(TCPSocket Socket);
  * @param Socket The socket this packet will be sent to when calling tcp_send()
  * @param BufferPtr Will store a pointer to the first byte you may write to
  * @param BufferSize Will store the maximum size (in bytes) that you may write
- * @return True if everything succeeded. If False is returned, the connection has timed out and Socket IS NO LONGER VALID!
+ * @return True if everything succeeded. If False is returned, either Socket is not valid or the MAC address of our partner is not known yet (see ethernet_arp_lookup). Try again later in the latter case.
  */
 bool tcp_start_packet(TCPSocket Socket, uint8_t** BufferPtr, size_t* BufferSize);
 
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2004-2005, Swedish Institute of Computer Science.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file is part of the Contiki operating system.
+ *
+ * Author: Adam Dunkels <adam@sics.se>
+ *
+ * Adapted for avr-libethernet: the switch based local continuations are
+ * folded into this file and the state is kept in a Protothread struct.
+ */
+
+#ifndef LIBETHERNET_PT_H__
+#define LIBETHERNET_PT_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif //__cplusplus
+
+/*
+ * Stackless coroutines ("protothreads") used by the non-blocking variants of the network operations.
+ *
+ * A protothread is a function that returns whenever it has to wait for something and resumes at the
+ * same position the next time it is called. The position is stored in a Protothread struct, so each
+ * running operation only costs two bytes of state plus whatever its context struct holds.
+ *
+ * As the resume mechanism is based on a switch statement, local variables are NOT preserved across
+ * waits (keep everything in the context struct) and a protothread must not use switch statements itself.
+ */
+
+/// A protothread has blocked and waits for something to happen
+#define PT_WAITING 0
+/// A protothread has voluntarily yielded
+#define PT_YIELDED 1
+/// A protothread has exited prematurely (e.g. on an error or a timeout)
+#define PT_EXITED 2
+/// A protothread has reached its end
+#define PT_ENDED 3
+
+typedef struct _Protothread
+{
+	/// The source line at which the protothread will resume
+	uint16_t Continuation;
+} Protothread;
+
+/**
+ * Declares a protothread function
+ * @param name_args The name and the parameters of the function
+ */
+#define PT_THREAD(name_args) char name_args
+
+/**
+ * Initialises a protothread so it will start from its beginning on the next invocation
+ * @param pt Pointer to the Protothread struct
+ */
+#define PT_INIT(pt) ((pt)->Continuation = 0)
+
+/**
+ * Starts the body of a protothread
+ * @param pt Pointer to the Protothread struct
+ */
+#define PT_BEGIN(pt) { char PT_YIELD_FLAG = 1; (void)PT_YIELD_FLAG; switch((pt)->Continuation) { case 0:
+
+/**
+ * Ends the body of a protothread
+ * @param pt Pointer to the Protothread struct
+ */
+#define PT_END(pt) } PT_YIELD_FLAG = 0; PT_INIT(pt); return PT_ENDED; }
+
+/// Stores the current position so the protothread resumes here
+#define _PT_SET(pt) (pt)->Continuation = __LINE__; case __LINE__:
+
+/**
+ * Blocks until a condition is true
+ * @param pt Pointer to the Protothread struct
+ * @param condition The condition to wait for
+ */
+#define PT_WAIT_UNTIL(pt,condition) do { _PT_SET(pt) if(!(condition)) return PT_WAITING; } while(0)
+
+/**
+ * Blocks while a condition is true
+ * @param pt Pointer to the Protothread struct
+ * @param condition The condition to wait on
+ */
+#define PT_WAIT_WHILE(pt,condition) PT_WAIT_UNTIL((pt),!(condition))
+
+/**
+ * Blocks until a child protothread has finished
+ * @param pt Pointer to the Protothread struct
+ * @param thread The child protothread invocation, e.g. dhcp_request_thread(&Request)
+ */
+#define PT_WAIT_THREAD(pt,thread) PT_WAIT_WHILE((pt),PT_SCHEDULE(thread))
+
+/**
+ * Yields once, giving the main loop a chance to run
+ * @param pt Pointer to the Protothread struct
+ */
+#define PT_YIELD(pt) do { PT_YIELD_FLAG = 0; _PT_SET(pt) if(PT_YIELD_FLAG == 0) return PT_YIELDED; } while(0)
+
+/**
+ * Restarts a protothread from its beginning on the next invocation
+ * @param pt Pointer to the Protothread struct
+ */
+#define PT_RESTART(pt) do { PT_INIT(pt); return PT_WAITING; } while(0)
+
+/**
+ * Exits a protothread prematurely
+ * @param pt Pointer to the Protothread struct
+ */
+#define PT_EXIT(pt) do { PT_INIT(pt); return PT_EXITED; } while(0)
+
+/**
+ * Runs a protothread once
+ * @param thread The protothread invocation
+ * @return True if the protothread is still running, False if it has exited or ended
+ */
+#define PT_SCHEDULE(thread) ((thread) < PT_EXITED)
+
+#ifdef __cplusplus
+}
+#endif //__cplusplus
+
+#endif //LIBETHERNET_PT_H__
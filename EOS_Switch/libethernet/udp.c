@@ -55,6 +55,8 @@ UDPSocket _udp_table_add(uint32_t RemoteIP, uint16_t LocalPort, uint16_t RemoteP
 			udp_table[i].RemotePort = RemotePort;
 			udp_table[i].TimeoutValue = TimeoutValue;
 			udp_table[i].ClosePortOnTermination = ClosePortOnTermination;
+			udp_table[i].DSCP = 0;
+			udp_table[i].Priority = false;
 
 			return i;
 		}
@@ -91,6 +93,16 @@ bool udp_table_is_valid_socket(UDPSocket Socket)
 	return (Socket < UDP_TABLE_SIZE);
 }
 
+bool udp_set_qos(UDPSocket Socket, uint8_t DSCP, bool Priority)
+{
+	if(!udp_table_get_by_socket(Socket))
+		return false;
+
+	udp_table[Socket].DSCP = DSCP & 0x3F;
+	udp_table[Socket].Priority = Priority;
+	return true;
+}
+
 bool udp_open_port(uint16_t Port, uint16_t TimeoutValue, UDPCallbackOpenConnection OpenCallback, UDPCallbackCloseConnection CloseCallback, UDPCallbackHandlePacket HandlePacketCallback)
 {
 	// Check if any other application is already listening on the port
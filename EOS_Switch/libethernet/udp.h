@@ -65,6 +65,12 @@ typedef struct _UDPTableEntry
 
 	/// The timeout value used for all operations regarding this connection that can time out (in milliseconds)
 	uint16_t TimeoutValue;
+
+	/// The DSCP that outgoing packets are marked with
+	uint8_t DSCP;
+
+	/// Indicates if outgoing packets are sent ahead of all other queued packets
+	bool Priority;
 } UDPTableEntry;
 
 typedef struct _UDPApplication
@@ -134,6 +140,15 @@ const UDPTableEntry* udp_table_get(uint32_t RemoteIP, uint16_t LocalPort, uint16
  */
 bool udp_table_is_valid_socket(UDPSocket Socket);
 
+/**
+ * Sets how the packets of a connection are treated on their way out
+ * @param Socket The socket assigned to the connection
+ * @param DSCP The differentiated services code point the packets are marked with (e.g. 46 for expedited forwarding), 0 for best effort
+ * @param Priority True to send the packets ahead of all other queued packets (see enc28j60_send_ex)
+ * @return True if everything went fine, false if the socket is invalid
+ */
+bool udp_set_qos(UDPSocket Socket, uint8_t DSCP, bool Priority);
+
 /**
  * Starts listening on an UDP port using the specified callback handlers
  * @param Port The port to listen on
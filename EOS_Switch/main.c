@@ -7,7 +7,10 @@
 #include "global.h"
 #include "pindefinitions.h"
 #include "serial.h"
+#include "control.h"
+#include "console.h"
 #include "network.h"
+#include "osc.h"
 
 #include "libethernet/libethernet.h"
 
@@ -21,11 +24,24 @@ static void main_loop(void);
 
 static inline void print_prompt(void);
 static inline void handle_trigstat(uint8_t num);
-static inline void print_ipinfo(void);
-static inline void print_targetinfo(void);
-static inline void print_payloads(void);
+static uint8_t print_ipinfo(uint8_t page);
+static uint8_t print_targetinfo(uint8_t page);
+static uint8_t print_payloads(uint8_t page);
+static uint8_t print_netstat(uint8_t page);
 static inline void print_dhcp(void);
 static inline void process_set(char* property);
+static inline void process_set_value(void);
+
+static void menu_cmd_help(char *args);
+static void menu_cmd_clear(char *args);
+static void menu_cmd_ipinfo(char *args);
+static void menu_cmd_targetinfo(char *args);
+static void menu_cmd_dhcp(char *args);
+static void menu_cmd_payload(char *args);
+static void menu_cmd_set(char *args);
+static void menu_cmd_testnet(char *args);
+static void menu_cmd_trigstat(char *args);
+static void menu_cmd_netstat(char *args);
 
 // MARK: Variable Definitions
 volatile uint32_t millis;
@@ -41,9 +57,12 @@ struct trigger_data {
     uint32_t t_two_shift;
 } trigger_flags;
 
-enum {NONE, PAYLOAD, SET} menu_status;
+enum {NONE, PAGED, SET} menu_status;
 uint32_t menu_state;
-static char menu_buffer[200];
+
+// Output that does not fit into the serial output buffer at once is printed one page per main loop iteration
+typedef uint8_t (*menu_pager)(uint8_t page);        // Returns 1 once the last page has been printed
+static menu_pager menu_active_pager;
 
 
 // MARK: Strings
@@ -55,12 +74,15 @@ static const char help_string[] PROGMEM = "The following commands are avaliable:
                                           "\tTARGETINFO: Displays current target information.\n"   //50
                                           "\tDHCP: Display DCHP configutation.\n"     //35
                                           "\tPAYLOAD: Displays current payloads.\n"    //38
+                                          "\tNETSTAT: Displays network statistics. (\"netstat reset\" to clear)\n"    //68
                                           "\tSET: See \"set help\".\n";  //22
 static const char set_help_string[] PROGMEM = "Synopsis: set <class>.<key>\n"
                                               "Classes are as follows:\n"
                                               "\tIP: Network settings. (\"set help ip 1\" for more)\n"
                                               "\tTARGET: Address information for target. (\"set help target\" for more)\n"
-                                              "\tPAYLOAD: Payloads to be transmitted. (\"set help payload\" for more)\n";
+                                              "\tPAYLOAD: Payloads to be transmitted. (\"set help payload\" for more)\n"
+                                              "\tOSC: Payloads entered as OSC messages. (\"set help osc\" for more)\n"
+                                              "\tCONSOLE: Remote console access. (\"set help console\" for more)\n";
 static const char set_help_ip_1_string[] PROGMEM = "The following keys are under ip:\n"
                                                    "\tIP: IP address.\n"
                                                    "\tDHCP: Enable DHCP.\n"
@@ -73,25 +95,73 @@ static const char set_help_ip_2_string[] PROGMEM = "The following additional key
                                                    "\tNTP: NTP server address.\n"
                                                    "\tGMT: Offset from GMT.\n"
                                                    "\tHOSTNAME: Hostname.\n"
+                                                   "\tVLAN: 802.1Q VLAN ID (0 = priority tag only, 65535 = untagged).\n"
+                                                   "\tPCP: VLAN priority of frames other than payloads (0 - 7).\n"
                                                    "\t(Device must be restarted for IP changes to take effect).\n";
 static const char set_help_target_string[] PROGMEM = "The following keys are under target:\n"
-                                                     "\tIP: IP Address of target.\n"
+                                                     "\tIP: IP Address of target (or multicast group).\n"
                                                      "\tPORT: Port to which payloads should be sent.\n"
+                                                     "\tREPLAY: Triggers sent once back online (0 = all, 1 = latest, 2 = max age).\n"
+                                                     "\tREPLAYAGE: Max age of replayed triggers in ms.\n"
+                                                     "\tDSCP: DSCP of payloads (46 = EF, 40 = CS5, 0 = best effort).\n"
+                                                     "\tPCP: VLAN priority of payloads (0 - 7).\n"
+                                                     "\tIP2 - IP4: Further targets (0.0.0.0 if unused).\n"
+                                                     "\tONERISE, ONEFALL, TWORISE, TWOFALL: Targets of each trigger\n"
+                                                     "\t\t(bit mask, 1 = first target, 255 = all).\n"
+                                                     "\tBACKUP: Used if the first target stops answering (0.0.0.0 if unused).\n"
+                                                     "\tPROBE: Interval in ms at which both targets are pinged.\n"
+                                                     "\tMISSES: Missed pings until the backup is used.\n"
+                                                     "\tFAILBACK: Return to the first target once it answers (0 = no, 1 = yes).\n"
+                                                     "\tRELIABLE: Have payloads acknowledged by the target (0 = no, 1 = yes).\n"
+                                                     "\tRETRIES: Retransmissions of unacknowledged payloads.\n"
+                                                     "\tBURST: Copies of each payload (1 = no bursts).\n"
+                                                     "\tBURSTGAP: Time between the copies in ms.\n"
                                                      "\t(Device must be restarted for target changes to take effect).\n";
 static const char set_help_payload_string[] PROGMEM = "The following keys are under payload:\n"
                                                       "\tONERISE: Packet sent on trigger one rising edge.\n"
                                                       "\tONEFALL: Packet sent on trigger one falling edge.\n"
                                                       "\tTWORISE: Packet sent on trigger two rising edge.\n"
-                                                      "\tTWOFALL: Packet sent on trigger two falling edge.\n";
+                                                      "\tTWOFALL: Packet sent on trigger two falling edge.\n"
+                                                      "\tPlaceholders are filled in when sending: {seq}, {ms},\n"
+                                                      "\t{t1} and {t2}, with as many digits as they are long\n"
+                                                      "\t(pad with _, as in {ms______}). {#0} - {#3} for int32.\n";
+static const char set_help_osc_string[] PROGMEM = "The following keys are under osc:\n"
+                                                  "\tONERISE, ONEFALL, TWORISE, TWOFALL: Payload of each trigger as OSC.\n"
+                                                  "\tEnter the address followed by the arguments, eg. /eos/chan/1 50.\n"
+                                                  "\tWhole numbers are sent as int32, other numbers as float32, anything\n"
+                                                  "\telse (or anything in quotes) as a string. Several messages separated\n"
+                                                  "\tby ; are sent together in one bundle. Placeholders as for payloads,\n"
+                                                  "\t{seq:i} for an int32 argument.\n";
+static const char set_help_console_string[] PROGMEM = "The following keys are under console:\n"
+                                                      "\tALLOW1 - ALLOW4: Hosts which may use the console over UDP.\n"
+                                                      "\t(0.0.0.0 to remove a host, no hosts disables the UDP console).\n";
 
 static const char set_ip_prompt_string[] PROGMEM =      "Enter address (a.b.c.d): ";
 static const char set_mac_prompt_string[] PROGMEM =     "Enter address (a:b:c:d:e:f): ";
 static const char set_port_prompt_string[] PROGMEM =    "Enter port: ";
 static const char set_gmt_prompt_string[] PROGMEM =     "Enter gmt offset (eg. +2): ";
-static const char set_payload_prompt_string[] PROGMEM = "Enter payload (max 199 chars, # = enter): ";
+static const char set_payload_prompt_string[] PROGMEM = "Enter payload (max 127 chars, # = enter): ";
 static const char set_dhcp_prompt_string[] PROGMEM =    "Enable DHCP? (0 = no, 1 = yes): ";
+static const char set_hostname_prompt_string[] PROGMEM = "Enter hostname (max 31 chars): ";
+static const char set_replay_prompt_string[] PROGMEM =  "Enter replay policy (0 = all, 1 = latest, 2 = max age): ";
+static const char set_age_prompt_string[] PROGMEM =     "Enter max age (ms): ";
+static const char set_dscp_prompt_string[] PROGMEM =    "Enter DSCP (0 - 63): ";
+static const char set_vlan_prompt_string[] PROGMEM =    "Enter VLAN ID (1 - 4094, 0 = priority tag only, 65535 = untagged): ";
+static const char set_pcp_prompt_string[] PROGMEM =     "Enter priority (0 - 7): ";
+static const char set_targets_prompt_string[] PROGMEM = "Enter targets (bit mask, 255 = all): ";
+static const char set_probe_prompt_string[] PROGMEM =   "Enter probe interval (ms): ";
+static const char set_misses_prompt_string[] PROGMEM =  "Enter missed probes (1 - 254): ";
+static const char set_failback_prompt_string[] PROGMEM = "Enable failback? (0 = no, 1 = yes): ";
+static const char set_reliable_prompt_string[] PROGMEM = "Enable reliable delivery? (0 = no, 1 = yes): ";
+static const char set_retries_prompt_string[] PROGMEM = "Enter retries (0 - 254): ";
+static const char set_burst_prompt_string[] PROGMEM =   "Enter copies (1 - 254): ";
+static const char set_gap_prompt_string[] PROGMEM =     "Enter gap (ms): ";
+static const char set_osc_prompt_string[] PROGMEM =     "Enter OSC messages (; between messages): ";
+static const char set_osc_error_string[] PROGMEM =      "Invalid OSC message, too long, more than 4 placeholders or a\n"
+                                                        "number with an exponent or over 9 digits, payload not changed.\n";
+static const char set_payload_error_string[] PROGMEM =  "Invalid or more than 4 placeholders, payload not changed.\n";
 
-static const char set_unkown_property_string[] PROGMEM = "Unkown property:";
+static const char set_unkown_property_string[] PROGMEM = "Unkown property: ";
 static const char menu_unkown_cmd_prt1[] PROGMEM = "Unkown command: ";
 static const char menu_unkown_cmd_prt2[] PROGMEM = "Try \"help\" for a list of avaliable commands.\n";
 
@@ -113,9 +183,9 @@ void initIO(void)
 void init_timers(void)
 {
     // Timer 0 (clock)
-    TCCR0B |= (1<<WGM01);                           // Set the Timer Mode to CTC
+    TCCR0A |= (1<<WGM01);                           // Set the Timer Mode to CTC
     TIMSK0 |= (1<<OCIE0A);                          // Set the ISR COMPA vector (enables COMP interupt)
-    OCR0A = 125;                                    // 1000 Hz
+    OCR0A = 124;                                    // 1000 Hz at 8 MHz, the counter runs from 0 to OCR0A
     TCCR0B |= (1<<CS01)|(1<<CS00);                  // set prescaler to 64 and start timer 0
 }
 
@@ -141,6 +211,7 @@ int main(void)
 	initIO();
     init_timers();
     init_serial();
+    init_control();
     flags |= (1<<FLAG_SERIAL_LOOPBACK);             // Enable serial loopback
 
     sei();
@@ -148,9 +219,8 @@ int main(void)
     stat_one_period = 500;
     flags |= (1<<FLAG_STAT_ONE_ON);
     
-    if (!init_network()) {
-        flags |= (1<<FLAG_ONLINE);
-    }
+    init_network();
+    init_console();
     
 //    eeprom_update_block("EOS-Switch", SETTING_HOSTNAME, 11);
 //    uint8_t mac[] = {55, 2, 3, 4, 5, 6};
@@ -178,7 +248,7 @@ int main(void)
     trigger_flags.t_one_state = !!(TRIGGER_ONE_PIN & (1<<TRIGGER_ONE_NUM));
     trigger_flags.t_two_state = !!(TRIGGER_TWO_PIN & (1<<TRIGGER_TWO_NUM));
     
-    serial_put_string_P(welcome_string);
+    console_put_string_P(welcome_string);
     print_prompt();
 
     for (;;) {
@@ -187,16 +257,250 @@ int main(void)
 	return 0; // never reached
 }
 
-static const char menu_cmd_help[] PROGMEM =         "help";
-static const char menu_cmd_clear[] PROGMEM =        "clear";
-static const char menu_cmd_ipinfo[] PROGMEM =       "ipinfo";
-static const char menu_cmd_targetinfo[] PROGMEM =   "targetinfo";
-static const char menu_cmd_dhcp[] PROGMEM =         "dhcp";
-static const char menu_cmd_payoad[] PROGMEM =       "payload";
-static const char menu_cmd_set[] PROGMEM =          "set";
-static const char menu_cmd_testnet[] PROGMEM =      "testnet";
-static const char menu_cmd_trigstat[] PROGMEM =    "trigstat";
+// MARK: Command and setting table
+// Commands and the keys of the set command share one table in program memory. Names are looked up by a perfect hash:
+//      hash = MENU_HASH_SEED, then for each character: hash = (hash * MENU_HASH_MULTIPLIER) ^ (c | 0x20)
+//      slot = hash & (MENU_HASH_SLOTS - 1)
+// menu_slots maps each slot to an entry (index + 1, 0 = empty), so a lookup costs one hash and one string compare no
+// matter how many entries there are. menu_slots and the constants below are generated by tools/gen_menu_hash.py, run it
+// after adding or renaming an entry (--check only verifies them).
+#define MENU_HASH_SEED          75
+#define MENU_HASH_MULTIPLIER    5
+#define MENU_HASH_SLOTS         256
+
+typedef void (*menu_handler)(char *args);
+
+enum menu_parser {PARSE_NONE, PARSE_BYTE, PARSE_WORD, PARSE_IP, PARSE_MAC, PARSE_STRING, PARSE_PAYLOAD, PARSE_OSC};
 
+struct menu_entry {
+    const char *name;                               // In program memory
+    menu_handler handler;                           // Commands only
+    uint16_t address;                               // Settings only, address in EEPROM
+    uint8_t length;                                 // Settings only, length in EEPROM
+    uint8_t parser;                                 // Settings only, how values are parsed
+    const char *prompt;                             // Settings only, in program memory
+};
+
+enum {MENU_HELP, MENU_CLEAR, MENU_IPINFO, MENU_TARGETINFO, MENU_DHCP, MENU_PAYLOAD, MENU_SET, MENU_TESTNET,
+      MENU_TRIGSTAT, MENU_NETSTAT, MENU_IP_IP, MENU_IP_DHCP, MENU_IP_MAC, MENU_IP_ROUTER, MENU_IP_NETMASK, MENU_IP_DNS,
+      MENU_IP_NTP, MENU_IP_GMT, MENU_IP_HOSTNAME, MENU_IP_VLAN, MENU_IP_PCP, MENU_TARGET_IP, MENU_TARGET_PORT,
+      MENU_TARGET_REPLAY, MENU_TARGET_REPLAY_AGE, MENU_TARGET_DSCP, MENU_TARGET_PCP, MENU_TARGET_IP_2,
+      MENU_TARGET_IP_3, MENU_TARGET_IP_4, MENU_TARGET_1R, MENU_TARGET_1F, MENU_TARGET_2R, MENU_TARGET_2F, MENU_TARGET_BACKUP,
+      MENU_TARGET_PROBE, MENU_TARGET_MISSES, MENU_TARGET_FAILBACK, MENU_TARGET_RELIABLE,
+      MENU_TARGET_RETRIES, MENU_TARGET_BURST, MENU_TARGET_BURST_GAP, MENU_PAYLOAD_1R, MENU_PAYLOAD_1F,
+      MENU_PAYLOAD_2R, MENU_PAYLOAD_2F, MENU_OSC_1R, MENU_OSC_1F, MENU_OSC_2R, MENU_OSC_2F, MENU_CONSOLE_ALLOW_1, MENU_CONSOLE_ALLOW_2, MENU_CONSOLE_ALLOW_3,
+      MENU_CONSOLE_ALLOW_4};
+
+static const char menu_name_help[] PROGMEM =        "help";
+static const char menu_name_clear[] PROGMEM =       "clear";
+static const char menu_name_ipinfo[] PROGMEM =      "ipinfo";
+static const char menu_name_targetinfo[] PROGMEM =  "targetinfo";
+static const char menu_name_dhcp[] PROGMEM =        "dhcp";
+static const char menu_name_payload[] PROGMEM =     "payload";
+static const char menu_name_set[] PROGMEM =         "set";
+static const char menu_name_testnet[] PROGMEM =     "testnet";
+static const char menu_name_trigstat[] PROGMEM =    "trigstat";
+static const char menu_name_netstat[] PROGMEM =     "netstat";
+
+static const char menu_name_i_ip[] PROGMEM =        "ip.ip";
+static const char menu_name_i_dhcp[] PROGMEM =      "ip.dhcp";
+static const char menu_name_i_mac[] PROGMEM =       "ip.mac";
+static const char menu_name_i_router[] PROGMEM =    "ip.router";
+static const char menu_name_i_netmask[] PROGMEM =   "ip.netmask";
+static const char menu_name_i_dns[] PROGMEM =       "ip.dns";
+static const char menu_name_i_ntp[] PROGMEM =       "ip.ntp";
+static const char menu_name_i_gmt[] PROGMEM =       "ip.gmt";
+static const char menu_name_i_hostname[] PROGMEM =  "ip.hostname";
+static const char menu_name_i_vlan[] PROGMEM =      "ip.vlan";
+static const char menu_name_i_pcp[] PROGMEM =       "ip.pcp";
+static const char menu_name_t_ip[] PROGMEM =        "target.ip";
+static const char menu_name_t_port[] PROGMEM =      "target.port";
+static const char menu_name_t_replay[] PROGMEM =    "target.replay";
+static const char menu_name_t_replay_age[] PROGMEM = "target.replayage";
+static const char menu_name_t_dscp[] PROGMEM =      "target.dscp";
+static const char menu_name_t_pcp[] PROGMEM =       "target.pcp";
+static const char menu_name_t_ip_2[] PROGMEM =      "target.ip2";
+static const char menu_name_t_ip_3[] PROGMEM =      "target.ip3";
+static const char menu_name_t_ip_4[] PROGMEM =      "target.ip4";
+static const char menu_name_t_1r[] PROGMEM =        "target.onerise";
+static const char menu_name_t_1f[] PROGMEM =        "target.onefall";
+static const char menu_name_t_2r[] PROGMEM =        "target.tworise";
+static const char menu_name_t_2f[] PROGMEM =        "target.twofall";
+static const char menu_name_t_backup[] PROGMEM =    "target.backup";
+static const char menu_name_t_probe[] PROGMEM =     "target.probe";
+static const char menu_name_t_misses[] PROGMEM =    "target.misses";
+static const char menu_name_t_failback[] PROGMEM =  "target.failback";
+static const char menu_name_t_reliable[] PROGMEM =  "target.reliable";
+static const char menu_name_t_retries[] PROGMEM =   "target.retries";
+static const char menu_name_t_burst[] PROGMEM =     "target.burst";
+static const char menu_name_t_burst_gap[] PROGMEM = "target.burstgap";
+static const char menu_name_p_1r[] PROGMEM =        "payload.onerise";
+static const char menu_name_p_1f[] PROGMEM =        "payload.onefall";
+static const char menu_name_p_2r[] PROGMEM =        "payload.tworise";
+static const char menu_name_p_2f[] PROGMEM =        "payload.twofall";
+static const char menu_name_o_1r[] PROGMEM =        "osc.onerise";
+static const char menu_name_o_1f[] PROGMEM =        "osc.onefall";
+static const char menu_name_o_2r[] PROGMEM =        "osc.tworise";
+static const char menu_name_o_2f[] PROGMEM =        "osc.twofall";
+static const char menu_name_c_allow_1[] PROGMEM =   "console.allow1";
+static const char menu_name_c_allow_2[] PROGMEM =   "console.allow2";
+static const char menu_name_c_allow_3[] PROGMEM =   "console.allow3";
+static const char menu_name_c_allow_4[] PROGMEM =   "console.allow4";
+
+static const struct menu_entry menu_entries[] PROGMEM = {
+    [MENU_HELP] =       {menu_name_help, menu_cmd_help, 0, 0, PARSE_NONE, NULL},
+    [MENU_CLEAR] =      {menu_name_clear, menu_cmd_clear, 0, 0, PARSE_NONE, NULL},
+    [MENU_IPINFO] =     {menu_name_ipinfo, menu_cmd_ipinfo, 0, 0, PARSE_NONE, NULL},
+    [MENU_TARGETINFO] = {menu_name_targetinfo, menu_cmd_targetinfo, 0, 0, PARSE_NONE, NULL},
+    [MENU_DHCP] =       {menu_name_dhcp, menu_cmd_dhcp, 0, 0, PARSE_NONE, NULL},
+    [MENU_PAYLOAD] =    {menu_name_payload, menu_cmd_payload, 0, 0, PARSE_NONE, NULL},
+    [MENU_SET] =        {menu_name_set, menu_cmd_set, 0, 0, PARSE_NONE, NULL},
+    [MENU_TESTNET] =    {menu_name_testnet, menu_cmd_testnet, 0, 0, PARSE_NONE, NULL},
+    [MENU_TRIGSTAT] =   {menu_name_trigstat, menu_cmd_trigstat, 0, 0, PARSE_NONE, NULL},
+    [MENU_NETSTAT] =    {menu_name_netstat, menu_cmd_netstat, 0, 0, PARSE_NONE, NULL},
+    
+    [MENU_IP_IP] =          {menu_name_i_ip, NULL, SETTING_IP_ADDR, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_IP_DHCP] =        {menu_name_i_dhcp, NULL, SETTING_DCHP, 1, PARSE_BYTE, set_dhcp_prompt_string},
+    [MENU_IP_MAC] =         {menu_name_i_mac, NULL, SETTING_MAC_ADDR, 6, PARSE_MAC, set_mac_prompt_string},
+    [MENU_IP_ROUTER] =      {menu_name_i_router, NULL, SETTING_ROUTER_ADDR, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_IP_NETMASK] =     {menu_name_i_netmask, NULL, SETTING_NETMASK, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_IP_DNS] =         {menu_name_i_dns, NULL, SETTING_DNS_ADDR, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_IP_NTP] =         {menu_name_i_ntp, NULL, SETTING_NTP_ADDR, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_IP_GMT] =         {menu_name_i_gmt, NULL, SETTING_GMT_OFFSET, 1, PARSE_BYTE, set_gmt_prompt_string},
+    [MENU_IP_HOSTNAME] =    {menu_name_i_hostname, NULL, SETTING_HOSTNAME, 32, PARSE_STRING, set_hostname_prompt_string},
+    [MENU_IP_VLAN] =        {menu_name_i_vlan, NULL, SETTING_VLAN_ID, 2, PARSE_WORD, set_vlan_prompt_string},
+    [MENU_IP_PCP] =         {menu_name_i_pcp, NULL, SETTING_VLAN_PCP, 1, PARSE_BYTE, set_pcp_prompt_string},
+    [MENU_TARGET_IP] =      {menu_name_t_ip, NULL, SETTING_TARGET_IP, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_TARGET_PORT] =    {menu_name_t_port, NULL, SETTING_TARGET_PORT, 2, PARSE_WORD, set_port_prompt_string},
+    [MENU_TARGET_REPLAY] =  {menu_name_t_replay, NULL, SETTING_REPLAY_POLICY, 1, PARSE_BYTE, set_replay_prompt_string},
+    [MENU_TARGET_REPLAY_AGE] = {menu_name_t_replay_age, NULL, SETTING_REPLAY_MAX_AGE, 2, PARSE_WORD, set_age_prompt_string},
+    [MENU_TARGET_DSCP] =    {menu_name_t_dscp, NULL, SETTING_TARGET_DSCP, 1, PARSE_BYTE, set_dscp_prompt_string},
+    [MENU_TARGET_PCP] =     {menu_name_t_pcp, NULL, SETTING_TARGET_PCP, 1, PARSE_BYTE, set_pcp_prompt_string},
+    [MENU_TARGET_IP_2] =    {menu_name_t_ip_2, NULL, SETTING_TARGET_IPS, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_TARGET_IP_3] =    {menu_name_t_ip_3, NULL, SETTING_TARGET_IPS + 4, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_TARGET_IP_4] =    {menu_name_t_ip_4, NULL, SETTING_TARGET_IPS + 8, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_TARGET_1R] =      {menu_name_t_1r, NULL, SETTING_T_TARGETS + NETWORK_TRIGGER_ONE_RISE, 1, PARSE_BYTE,
+                             set_targets_prompt_string},
+    [MENU_TARGET_1F] =      {menu_name_t_1f, NULL, SETTING_T_TARGETS + NETWORK_TRIGGER_ONE_FALL, 1, PARSE_BYTE,
+                             set_targets_prompt_string},
+    [MENU_TARGET_2R] =      {menu_name_t_2r, NULL, SETTING_T_TARGETS + NETWORK_TRIGGER_TWO_RISE, 1, PARSE_BYTE,
+                             set_targets_prompt_string},
+    [MENU_TARGET_2F] =      {menu_name_t_2f, NULL, SETTING_T_TARGETS + NETWORK_TRIGGER_TWO_FALL, 1, PARSE_BYTE,
+                             set_targets_prompt_string},
+    [MENU_TARGET_BACKUP] =  {menu_name_t_backup, NULL, SETTING_BACKUP_IP, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_TARGET_PROBE] =   {menu_name_t_probe, NULL, SETTING_PROBE_INTERVAL, 2, PARSE_WORD, set_probe_prompt_string},
+    [MENU_TARGET_MISSES] =  {menu_name_t_misses, NULL, SETTING_PROBE_LIMIT, 1, PARSE_BYTE, set_misses_prompt_string},
+    [MENU_TARGET_FAILBACK] = {menu_name_t_failback, NULL, SETTING_FAILBACK, 1, PARSE_BYTE, set_failback_prompt_string},
+    [MENU_TARGET_RELIABLE] = {menu_name_t_reliable, NULL, SETTING_RELIABLE, 1, PARSE_BYTE, set_reliable_prompt_string},
+    [MENU_TARGET_RETRIES] = {menu_name_t_retries, NULL, SETTING_RELIABLE_RETRIES, 1, PARSE_BYTE,
+                             set_retries_prompt_string},
+    [MENU_TARGET_BURST] =   {menu_name_t_burst, NULL, SETTING_BURST_COUNT, 1, PARSE_BYTE, set_burst_prompt_string},
+    [MENU_TARGET_BURST_GAP] = {menu_name_t_burst_gap, NULL, SETTING_BURST_GAP, 2, PARSE_WORD, set_gap_prompt_string},
+    [MENU_PAYLOAD_1R] =     {menu_name_p_1r, NULL, SETTING_T_ONE_RISE, 200, PARSE_PAYLOAD, set_payload_prompt_string},
+    [MENU_PAYLOAD_1F] =     {menu_name_p_1f, NULL, SETTING_T_ONE_FALL, 200, PARSE_PAYLOAD, set_payload_prompt_string},
+    [MENU_PAYLOAD_2R] =     {menu_name_p_2r, NULL, SETTING_T_TWO_RISE, 200, PARSE_PAYLOAD, set_payload_prompt_string},
+    [MENU_PAYLOAD_2F] =     {menu_name_p_2f, NULL, SETTING_T_TWO_FALL, 200, PARSE_PAYLOAD, set_payload_prompt_string},
+    [MENU_OSC_1R] =         {menu_name_o_1r, NULL, SETTING_T_ONE_RISE, 200, PARSE_OSC, set_osc_prompt_string},
+    [MENU_OSC_1F] =         {menu_name_o_1f, NULL, SETTING_T_ONE_FALL, 200, PARSE_OSC, set_osc_prompt_string},
+    [MENU_OSC_2R] =         {menu_name_o_2r, NULL, SETTING_T_TWO_RISE, 200, PARSE_OSC, set_osc_prompt_string},
+    [MENU_OSC_2F] =         {menu_name_o_2f, NULL, SETTING_T_TWO_FALL, 200, PARSE_OSC, set_osc_prompt_string},
+    [MENU_CONSOLE_ALLOW_1] = {menu_name_c_allow_1, NULL, SETTING_CONSOLE_ALLOW, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_CONSOLE_ALLOW_2] = {menu_name_c_allow_2, NULL, SETTING_CONSOLE_ALLOW + 4, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_CONSOLE_ALLOW_3] = {menu_name_c_allow_3, NULL, SETTING_CONSOLE_ALLOW + 8, 4, PARSE_IP, set_ip_prompt_string},
+    [MENU_CONSOLE_ALLOW_4] = {menu_name_c_allow_4, NULL, SETTING_CONSOLE_ALLOW + 12, 4, PARSE_IP, set_ip_prompt_string}
+};
+
+static const uint8_t menu_slots[MENU_HASH_SLOTS] PROGMEM = {
+    [114] = MENU_HELP + 1,
+    [18] =  MENU_CLEAR + 1,
+    [188] = MENU_IPINFO + 1,
+    [252] = MENU_TARGETINFO + 1,
+    [64] =  MENU_DHCP + 1,
+    [49] =  MENU_PAYLOAD + 1,
+    [65] =  MENU_SET + 1,
+    [190] = MENU_TESTNET + 1,
+    [181] = MENU_TRIGSTAT + 1,
+    [118] = MENU_NETSTAT + 1,
+    [173] = MENU_IP_IP + 1,
+    [75] =  MENU_IP_DHCP + 1,
+    [179] = MENU_IP_MAC + 1,
+    [83] =  MENU_IP_ROUTER + 1,
+    [71] =  MENU_IP_NETMASK + 1,
+    [33] =  MENU_IP_DNS + 1,
+    [250] = MENU_IP_NTP + 1,
+    [194] = MENU_IP_GMT + 1,
+    [223] = MENU_IP_HOSTNAME + 1,
+    [73] =  MENU_IP_VLAN + 1,
+    [127] = MENU_IP_PCP + 1,
+    [237] = MENU_TARGET_IP + 1,
+    [169] = MENU_TARGET_PORT + 1,
+    [87] =  MENU_TARGET_REPLAY + 1,
+    [20] =  MENU_TARGET_REPLAY_AGE + 1,
+    [0] =   MENU_TARGET_DSCP + 1,
+    [63] =  MENU_TARGET_PCP + 1,
+    [147] = MENU_TARGET_IP_2 + 1,
+    [146] = MENU_TARGET_IP_3 + 1,
+    [149] = MENU_TARGET_IP_4 + 1,
+    [157] = MENU_TARGET_1R + 1,
+    [99] =  MENU_TARGET_1F + 1,
+    [25] =  MENU_TARGET_2R + 1,
+    [95] =  MENU_TARGET_2F + 1,
+    [214] = MENU_TARGET_BACKUP + 1,
+    [50] =  MENU_TARGET_PROBE + 1,
+    [70] =  MENU_TARGET_MISSES + 1,
+    [97] =  MENU_TARGET_FAILBACK + 1,
+    [84] =  MENU_TARGET_RELIABLE + 1,
+    [6] =   MENU_TARGET_RETRIES + 1,
+    [82] =  MENU_TARGET_BURST + 1,
+    [160] = MENU_TARGET_BURST_GAP + 1,
+    [58] =  MENU_PAYLOAD_1R + 1,
+    [116] = MENU_PAYLOAD_1F + 1,
+    [62] =  MENU_PAYLOAD_2R + 1,
+    [232] = MENU_PAYLOAD_2F + 1,
+    [79] =  MENU_OSC_1R + 1,
+    [113] = MENU_OSC_1F + 1,
+    [27] =  MENU_OSC_2R + 1,
+    [29] =  MENU_OSC_2F + 1,
+    [166] = MENU_CONSOLE_ALLOW_1 + 1,
+    [165] = MENU_CONSOLE_ALLOW_2 + 1,
+    [164] = MENU_CONSOLE_ALLOW_3 + 1,
+    [163] = MENU_CONSOLE_ALLOW_4 + 1
+};
+
+/**
+ *  Finds a command or setting
+ *  @param name The name, not nul terminated
+ *  @param length The length of the name
+ *  @param entry Filled in with the entry if it is found
+ *  @return 1 if the name was found, 0 otherwise
+ */
+static uint8_t menu_lookup(const char *name, uint8_t length, struct menu_entry *entry)
+{
+    uint8_t hash = MENU_HASH_SEED;
+    for (uint8_t i = 0; i < length; i++) {
+        hash = (hash * MENU_HASH_MULTIPLIER) ^ (name[i] | 0x20);
+    }
+    
+    uint8_t index = pgm_read_byte(&menu_slots[hash & (MENU_HASH_SLOTS - 1)]);
+    if (index == 0) {
+        return 0;
+    }
+    
+    memcpy_P(entry, &menu_entries[index - 1], sizeof(struct menu_entry));
+    
+    // Another name might hash to the same slot
+    return !strncasecmp_P(name, entry->name, length) && (pgm_read_byte(entry->name + length) == '\0');
+}
+
+/**
+ *  Gets the state of the inputs for the payload templates
+ *  @return Bit 0 set while input one is on, bit 1 while input two is on
+ */
+static uint8_t trigger_inputs (void)
+{
+    // A state of 0 means on, it is cleared on the rising edge
+    return (!trigger_flags.t_one_state) | ((!trigger_flags.t_two_state) << 1);
+}
 
 static void main_loop ()
 {
@@ -209,16 +513,12 @@ static void main_loop ()
         // Was off, now on - Rising edge
         stat_one_period = 100;
         trigger_flags.t_one_state = 0;
-        if (flags & (1<<FLAG_ONLINE)) {
-            network_send_from_eeprom(SETTING_T_ONE_RISE, eeprom_read_byte(SETTING_T_ONE_RISE_LEN));
-        }
+        network_trigger(NETWORK_TRIGGER_ONE_RISE, trigger_inputs());
     } else if ((trigger_flags.t_one_shift == 0xFFFFFFFF) && (trigger_flags.t_one_state == 0)) {
         // Was on, now off - Falling edge
         stat_one_period = 500;
         trigger_flags.t_one_state = 1;
-        if (flags & (1<<FLAG_ONLINE)) {
-            network_send_from_eeprom(SETTING_T_ONE_FALL, eeprom_read_byte(SETTING_T_ONE_FALL_LEN));
-        }
+        network_trigger(NETWORK_TRIGGER_ONE_FALL, trigger_inputs());
 
     }
         
@@ -230,79 +530,66 @@ static void main_loop ()
         // Was off, now on - Rising edge
         stat_one_period = 100;
         trigger_flags.t_two_state = 0;
-        if (flags & (1<<FLAG_ONLINE)) {
-            network_send_from_eeprom(SETTING_T_TWO_RISE, eeprom_read_byte(SETTING_T_TWO_RISE_LEN));
-        }
+        network_trigger(NETWORK_TRIGGER_TWO_RISE, trigger_inputs());
     } else if ((trigger_flags.t_two_shift == 0xFFFFFFFF) && (trigger_flags.t_two_state == 0)) {
         // Was on, now off - Falling edge
         stat_one_period = 500;
         trigger_flags.t_two_state = 1;
-        if (flags & (1<<FLAG_ONLINE)) {
-            network_send_from_eeprom(SETTING_T_TWO_FALL, eeprom_read_byte(SETTING_T_TWO_FALL_LEN));
-        }
+        network_trigger(NETWORK_TRIGGER_TWO_FALL, trigger_inputs());
         
     }
     
     serial_service();
+    control_service();
     
     // Menu
     switch (menu_status) {
         case NONE:
-            if (serial_has_line()) {
+            if (console_select()) {
                 menu_state = 0;
                 
-                serial_get_line(menu_buffer, 200);
+                char *line = console_get_line();
                 
-                if (!strncasecmp_P(menu_buffer, menu_cmd_help, 4)) {
-                    serial_put_string_P(help_string);
-                } else if (!strncasecmp_P(menu_buffer, menu_cmd_clear, 5)) {
-                    // Clear screen
-                    serial_put_byte(0x1B);
-                    serial_put_string("[2J");
-                    // Bring cursor home
-                    serial_put_byte(0x1B);
-                    serial_put_string("[H");
-                } else if (!strncasecmp_P(menu_buffer, menu_cmd_ipinfo, 6)) {
-                    print_ipinfo();
-                } else if (!strncasecmp_P(menu_buffer, menu_cmd_targetinfo, 10)) {
-                    print_targetinfo();
-                } else if (!strncasecmp_P(menu_buffer, menu_cmd_dhcp, 4)) {
-                    print_dhcp();
-                }else if (!strncasecmp_P(menu_buffer, menu_cmd_payoad, 7)) {
-                    menu_status = PAYLOAD;
-                    print_payloads();
-                } else if (!strncasecmp_P(menu_buffer, menu_cmd_set, 3)) {
-                    menu_status = SET;
-                    process_set(menu_buffer + 3);
-                } else if (!strncasecmp_P(menu_buffer, menu_cmd_testnet, 7)) {
-                    network_send_packet(menu_buffer + 8, strlen(menu_buffer) - 8);
-                } else if (!strncasecmp_P(menu_buffer, menu_cmd_trigstat, 8)) {
-                    handle_trigstat(strtol(menu_buffer + 9, NULL, 10));
-                } else if (menu_buffer[0] == '\0') {
+                // The command is the first word, everything after it is passed as arguments
+                char *args = strchr(line, ' ');
+                uint8_t length = (args != NULL) ? (args - line) : strlen(line);
+                args = (args != NULL) ? (args + 1) : (line + length);
+                
+                struct menu_entry entry;
+                if (menu_lookup(line, length, &entry) && (entry.handler != NULL)) {
+                    entry.handler(args);
+                } else if (line[0] == '\0') {
                     ;
                 } else {
-                    serial_put_string_P(menu_unkown_cmd_prt1);
-                    serial_put_byte('"');
-                    serial_put_string(menu_buffer);
-                    serial_put_byte('"');
-                    serial_put_byte('\n');
-                    serial_put_string_P(menu_unkown_cmd_prt2);
+                    console_put_string_P(menu_unkown_cmd_prt1);
+                    console_put_byte('"');
+                    console_put_string(line);
+                    console_put_byte('"');
+                    console_put_byte('\n');
+                    console_put_string_P(menu_unkown_cmd_prt2);
                 }
                 
                 if (menu_status == NONE) {
                     print_prompt();
+                } else {
+                    // Further input and output of this command stays on the same stream
+                    console_hold(1);
                 }
             }
             break;
-        case PAYLOAD:
-            if (!(flags & (1<<FLAG_SERIAL_TX_LOCK))) {
-                print_payloads();
+        case PAGED:
+            // The next page once the previous one has been sent
+            if (console_out_idle() && menu_active_pager(menu_state++)) {
+                menu_status = NONE;
+                console_hold(0);
+                print_prompt();
             }
             break;
         case SET:
-            process_set(NULL);
+            process_set_value();
             break;
     }
+    console_flush();
 
     // STAT_ONE
     if (flags & (1<<FLAG_STAT_ONE_ON)) {
@@ -318,29 +605,98 @@ static void main_loop ()
         STAT_ONE_PORT &= !(1<<STAT_ONE_NUM);
     }
     
-    if (flags & (1<<FLAG_ONLINE)) {
-        network_service();
+    network_service();
+}
+
+// MARK: Command handlers
+static void menu_cmd_help(char *args)
+{
+    console_put_string_P(help_string);
+}
+
+static void menu_cmd_clear(char *args)
+{
+    // Clear screen
+    console_put_byte(0x1B);
+    console_put_string("[2J");
+    // Bring cursor home
+    console_put_byte(0x1B);
+    console_put_string("[H");
+}
+
+static void menu_start_pager(menu_pager pager)
+{
+    menu_active_pager = pager;
+    menu_state = 0;
+    menu_status = PAGED;
+}
+
+static void menu_cmd_ipinfo(char *args)
+{
+    menu_start_pager(print_ipinfo);
+}
+
+static void menu_cmd_targetinfo(char *args)
+{
+    menu_start_pager(print_targetinfo);
+}
+
+static void menu_cmd_dhcp(char *args)
+{
+    print_dhcp();
+}
+
+static void menu_cmd_payload(char *args)
+{
+    menu_start_pager(print_payloads);
+}
+
+static void menu_cmd_set(char *args)
+{
+    process_set(args);
+}
+
+static void menu_cmd_testnet(char *args)
+{
+    network_send_packet(args, strlen(args));
+}
+
+static void menu_cmd_trigstat(char *args)
+{
+    handle_trigstat(strtol(args, NULL, 10));
+}
+
+static const char menu_netstat_reset_string[] PROGMEM = "reset";
+
+static void menu_cmd_netstat(char *args)
+{
+    if (!strcasecmp_P(args, menu_netstat_reset_string)) {
+        enc28j60_reset_statistics();
+        ethernet_reset_statistics();
+        network_reset_statistics();
+    } else {
+        menu_start_pager(print_netstat);
     }
 }
 
 static inline void print_prompt(void) {
     if (flags & (1<<FLAG_ONLINE)) {
-        serial_put_string_P(prompt_string);
+        console_put_string_P(prompt_string);
     } else {
-        serial_put_string_P(prompt_string_offline);
+        console_put_string_P(prompt_string_offline);
     }
 }
 
 static inline void print_addr(uint16_t addr, char delim, int len, int radix, char *temp)
 {
     utoa(eeprom_read_byte(addr), temp, radix);
-    serial_put_string(temp);
+    console_put_string(temp);
     for (int i = 1; i < len; i++) {
-        serial_put_byte(delim);
+        console_put_byte(delim);
         utoa(eeprom_read_byte(addr + i), temp, radix);
-        serial_put_string(temp);
+        console_put_string(temp);
     }
-    serial_put_byte('\n');
+    console_put_byte('\n');
 }
 
 static const char menu_ipinfo_dhcp_string[] PROGMEM =      "\tDHCP Enabled:\t";
@@ -354,92 +710,130 @@ static const char menu_ipinfo_dns_string[] PROGMEM =       "\tDNS Address:\t";
 static const char menu_ipinfo_ntp_string[] PROGMEM =       "\tNTP Address:\t";
 static const char menu_ipinfo_gmt_string[] PROGMEM =       "\tGMT Offset:\t";
 static const char menu_ipinfo_hostname_string[] PROGMEM =  "\tHostname:\t";
+static const char menu_ipinfo_console_string[] PROGMEM =   "\tConsole host:\t";
 
 
-static inline void print_ipinfo(void)
+static uint8_t print_ipinfo(uint8_t page)
 {
     char tmp[4];
-    serial_put_string_P(menu_ipinfo_dhcp_string);
-    serial_put_string_P(eeprom_read_byte(SETTING_DCHP) ? menu_ipinfo_dhcp_string_yes : menu_ipinfo_dhcp_string_no);
-    
-    serial_put_string_P(menu_ipinfo_ip_string);
-    print_addr(SETTING_IP_ADDR, '.', 4, 10, tmp);
-    
-    serial_put_string_P(menu_ipinfo_mac_string);
-    print_addr(SETTING_MAC_ADDR, ':', 6, 16, tmp);
-    
-    serial_put_string_P(menu_ipinfo_router_string);
-    print_addr(SETTING_ROUTER_ADDR, '.', 4, 10, tmp);
-    
-    serial_put_string_P(menu_ipinfo_netmask_string);
-    print_addr(SETTING_NETMASK, '.', 4, 10, tmp);
-    
-    serial_put_string_P(menu_ipinfo_dns_string);
-    print_addr(SETTING_DNS_ADDR, '.', 4, 10, tmp);
-    
-    serial_put_string_P(menu_ipinfo_ntp_string);
-    print_addr(SETTING_NTP_ADDR, '.', 4, 10, tmp);
-    
-    serial_put_string_P(menu_ipinfo_gmt_string);
-    if (eeprom_read_byte(SETTING_GMT_OFFSET) >= 0) {
-        serial_put_byte('+');
+    switch (page) {
+        case 0:
+            console_put_string_P(menu_ipinfo_dhcp_string);
+            console_put_string_P(eeprom_read_byte(SETTING_DCHP) ? menu_ipinfo_dhcp_string_yes : menu_ipinfo_dhcp_string_no);
+            
+            console_put_string_P(menu_ipinfo_ip_string);
+            print_addr(SETTING_IP_ADDR, '.', 4, 10, tmp);
+            
+            console_put_string_P(menu_ipinfo_mac_string);
+            print_addr(SETTING_MAC_ADDR, ':', 6, 16, tmp);
+            return 0;
+        case 1:
+            console_put_string_P(menu_ipinfo_router_string);
+            print_addr(SETTING_ROUTER_ADDR, '.', 4, 10, tmp);
+            
+            console_put_string_P(menu_ipinfo_netmask_string);
+            print_addr(SETTING_NETMASK, '.', 4, 10, tmp);
+            
+            console_put_string_P(menu_ipinfo_dns_string);
+            print_addr(SETTING_DNS_ADDR, '.', 4, 10, tmp);
+            return 0;
+        case 2:
+            console_put_string_P(menu_ipinfo_ntp_string);
+            print_addr(SETTING_NTP_ADDR, '.', 4, 10, tmp);
+            
+            console_put_string_P(menu_ipinfo_gmt_string);
+            if (eeprom_read_byte(SETTING_GMT_OFFSET) >= 0) {
+                console_put_byte('+');
+            }
+            itoa(eeprom_read_byte(SETTING_GMT_OFFSET), tmp, 10);
+            console_put_string(tmp);
+            console_put_byte('\n');
+            
+            console_put_string_P(menu_ipinfo_hostname_string);
+            console_put_from_eeprom(SETTING_HOSTNAME);
+            console_put_byte('\n');
+            return 0;
+        default:
+            // One allowed console host per page
+            console_put_string_P(menu_ipinfo_console_string);
+            print_addr(SETTING_CONSOLE_ALLOW + (4 * (page - 3)), '.', 4, 10, tmp);
+            return page == (3 + CONSOLE_ALLOW_COUNT - 1);
     }
-    itoa(eeprom_read_byte(SETTING_GMT_OFFSET), tmp, 10);
-    serial_put_string(tmp);
-    serial_put_byte('\n');
-    
-    serial_put_string_P(menu_ipinfo_hostname_string);
-    serial_put_from_eeprom(SETTING_HOSTNAME);
-    serial_put_byte('\n');
 }
 
 static const char menu_targetinfo_addr_string[] PROGMEM = "\tAddress:\t";
 static const char menu_targetinfo_port_string[] PROGMEM = "\tPort:\t\t";
+static const char menu_targetinfo_backup_string[] PROGMEM = "\tBackup:\t\t";
+static const char menu_targetinfo_active_string[] PROGMEM = "\t(Backup in use)\n";
 
-static inline void print_targetinfo(void)
+static uint8_t print_targetinfo(uint8_t page)
 {
     char tmp[6];
-    serial_put_string_P(menu_targetinfo_addr_string);
-    print_addr(SETTING_TARGET_IP, '.', 4, 10, tmp);
+    // One target per page, followed by the backup and the port
+    if (page < NETWORK_TARGET_COUNT) {
+        console_put_string_P(menu_targetinfo_addr_string);
+        print_addr((page == 0) ? SETTING_TARGET_IP : (SETTING_TARGET_IPS + (4 * (page - 1))), '.', 4, 10, tmp);
+        return 0;
+    }
     
-    serial_put_string_P(menu_targetinfo_port_string);
+    console_put_string_P(menu_targetinfo_backup_string);
+    print_addr(SETTING_BACKUP_IP, '.', 4, 10, tmp);
+    if (network_is_on_backup()) {
+        console_put_string_P(menu_targetinfo_active_string);
+    }
+    
+    console_put_string_P(menu_targetinfo_port_string);
     utoa(eeprom_read_word(SETTING_TARGET_PORT), tmp, 10);
-    serial_put_string(tmp);
-    serial_put_byte('\n');
+    console_put_string(tmp);
+    console_put_byte('\n');
+    return 1;
 }
 
 static const char trigstat_trigger_string[] PROGMEM = "Trigger: ";
 static const char trigstat_shift_string[] PROGMEM =   "\tShift: ";
 static const char trigstat_state_string[] PROGMEM =   "\tState: ";
+static const char trigstat_queued_string[] PROGMEM =  "Queued: ";
+static const char trigstat_dropped_string[] PROGMEM = "\tDropped: ";
 
 static inline void handle_trigstat(uint8_t num)
 {
     char tmp[33];
     
-    serial_put_string_P(trigstat_trigger_string);
+    console_put_string_P(trigstat_trigger_string);
     utoa(num, tmp, 10);
-    serial_put_string(tmp);
-    serial_put_byte('\n');
+    console_put_string(tmp);
+    console_put_byte('\n');
     
-    serial_put_string_P(trigstat_shift_string);
+    console_put_string_P(trigstat_shift_string);
     if (num == 1) {
         utoa(trigger_flags.t_one_shift, tmp, 2);
-        serial_put_string(tmp);
+        console_put_string(tmp);
     } else if (num == 2) {
         utoa(trigger_flags.t_two_shift, tmp, 2);
-        serial_put_string(tmp);
+        console_put_string(tmp);
     }
-    serial_put_byte('\n');
+    console_put_byte('\n');
     
-    serial_put_string_P(trigstat_state_string);
+    console_put_string_P(trigstat_state_string);
     if (num == 1) {
         utoa(trigger_flags.t_one_state, tmp, 2);
-        serial_put_string(tmp);
+        console_put_string(tmp);
     } else if (num == 2) {
         utoa(trigger_flags.t_two_state, tmp, 2);
-        serial_put_string(tmp);
+        console_put_string(tmp);
     }
-    serial_put_byte('\n');
+    console_put_byte('\n');
+    
+    // Triggers waiting to be sent once the network is back
+    console_put_string_P(trigstat_queued_string);
+    utoa(network_get_queued_triggers(), tmp, 10);
+    console_put_string(tmp);
+    console_put_byte('\n');
+    
+    console_put_string_P(trigstat_dropped_string);
+    utoa(network_get_trigger_overflows(), tmp, 10);
+    console_put_string(tmp);
+    console_put_byte('\n');
 }
 
 static const char menu_payload_t1r_string[] PROGMEM = "\tTrigger one, rising edge:\n\t\t";
@@ -447,151 +841,226 @@ static const char menu_payload_t1f_string[] PROGMEM = "\tTrigger one, falling ed
 static const char menu_payload_t2f_string[] PROGMEM = "\tTrigger two, rising edge:\n\t\t";
 static const char menu_payload_t2r_string[] PROGMEM = "\tTrigger two, falling edge:\n\t\t";
 
-static inline void print_payloads(void)
+static const char menu_payload_osc_string[] PROGMEM = " (OSC, ";
+static const char menu_payload_bytes_string[] PROGMEM = " bytes)";
+
+/**
+ *  Prints a payload, only the address of OSC messages is printed
+ *  @param address The address of the payload in EEPROM
+ *  @param length_address The address of its length in EEPROM
+ */
+static void print_payload(uint16_t address, uint16_t length_address)
 {
-    switch (menu_state) {
-        case 0:
-            serial_put_string_P(menu_payload_t1r_string);
-            serial_put_from_eeprom(SETTING_T_ONE_RISE);
-            serial_put_byte('\n');
-            menu_state++;
+    uint8_t length = eeprom_read_byte((uint8_t *)length_address);
+    console_put_from_eeprom(address);
+    
+    // Text payloads end at their length, OSC messages contain nul bytes
+    for (uint8_t i = 0; (i < length) && (i < 200); i++) {
+        if (eeprom_read_byte((uint8_t *)(address + i)) == '\0') {
+            char tmp[4];
+            console_put_string_P(menu_payload_osc_string);
+            utoa(length, tmp, 10);
+            console_put_string(tmp);
+            console_put_string_P(menu_payload_bytes_string);
             break;
+        }
+    }
+    console_put_byte('\n');
+}
+
+static uint8_t print_payloads(uint8_t page)
+{
+    // One trigger per page
+    if (page == 0) {
+        console_put_string_P(menu_payload_t1r_string);
+        print_payload(SETTING_T_ONE_RISE, SETTING_T_ONE_RISE_LEN);
+        console_put_string_P(menu_payload_t1f_string);
+        print_payload(SETTING_T_ONE_FALL, SETTING_T_ONE_FALL_LEN);
+        return 0;
+    }
+    console_put_string_P(menu_payload_t2f_string);
+    print_payload(SETTING_T_TWO_RISE, SETTING_T_TWO_RISE_LEN);
+    console_put_string_P(menu_payload_t2r_string);
+    print_payload(SETTING_T_TWO_FALL, SETTING_T_TWO_FALL_LEN);
+    return 1;
+}
+
+static const char menu_netstat_rx_string[] PROGMEM =           "Driver RX:\n";
+static const char menu_netstat_tx_string[] PROGMEM =           "Driver TX:\n";
+static const char menu_netstat_stack_string[] PROGMEM =        "Stack:\n";
+static const char menu_netstat_dispatch_string[] PROGMEM =     "Received packets:\n";
+static const char menu_netstat_link_string[] PROGMEM =         "Link:\n";
+static const char menu_netstat_delivery_string[] PROGMEM =     "Reliable delivery:\n";
+static const char menu_netstat_sent_string[] PROGMEM =         "\tSent:\t\t";
+static const char menu_netstat_acked_string[] PROGMEM =        "\tAcknowledged:\t";
+static const char menu_netstat_retransmissions_string[] PROGMEM = "\tRetransmits:\t";
+static const char menu_netstat_abandoned_string[] PROGMEM =    "\tAbandoned:\t";
+static const char menu_netstat_dup_acks_string[] PROGMEM =     "\tDup. acks:\t";
+static const char menu_netstat_srtt_string[] PROGMEM =         "\tSRTT ms:\t";
+static const char menu_netstat_rto_string[] PROGMEM =          "\tRTO ms:\t\t";
+static const char menu_netstat_bursts_string[] PROGMEM =       "Bursts:\n";
+static const char menu_netstat_burst_count_string[] PROGMEM =  "\tBursts:\t\t";
+static const char menu_netstat_copies_string[] PROGMEM =       "\tCopies:\t\t";
+static const char menu_netstat_cut_string[] PROGMEM =          "\tCut short:\t";
+static const char menu_netstat_repeated_string[] PROGMEM =     "\tRepeated:\t";
+static const char menu_netstat_losses_string[] PROGMEM =       "\tLosses:\t\t";
+static const char menu_netstat_recovery_string[] PROGMEM =     "\tRecovery ms:\t";
+static const char menu_netstat_max_recovery_string[] PROGMEM = "\tMax rec. ms:\t";
+static const char menu_netstat_failovers_string[] PROGMEM =    "\tFailovers:\t";
+static const char menu_netstat_failbacks_string[] PROGMEM =    "\tFailbacks:\t";
+static const char menu_netstat_failover_string[] PROGMEM =     "\tFailover ms:\t";
+static const char menu_netstat_max_failover_string[] PROGMEM = "\tMax fail. ms:\t";
+static const char menu_netstat_unresolved_string[] PROGMEM =   "\tUnresolved:\t";
+static const char menu_netstat_frames_string[] PROGMEM =       "\tFrames:\t\t";
+static const char menu_netstat_bytes_string[] PROGMEM =        "\tBytes:\t\t";
+static const char menu_netstat_errors_string[] PROGMEM =       "\tErrors:\t\t";
+static const char menu_netstat_oversized_string[] PROGMEM =    "\tOversized:\t";
+static const char menu_netstat_overflows_string[] PROGMEM =    "\tOverflows:\t";
+static const char menu_netstat_resets_string[] PROGMEM =       "\tResets:\t\t";
+static const char menu_netstat_pending_string[] PROGMEM =      "\tPending max:\t";
+static const char menu_netstat_vlan_string[] PROGMEM =         "\tOther VLAN:\t";
+static const char menu_netstat_late_coll_string[] PROGMEM =    "\tLate coll.:\t";
+static const char menu_netstat_aborts_string[] PROGMEM =       "\tAborts:\t\t";
+static const char menu_netstat_priority_string[] PROGMEM =     "\tPriority:\t";
+static const char menu_netstat_slot_waits_string[] PROGMEM =   "\tSlot waits:\t";
+static const char menu_netstat_arp_hits_string[] PROGMEM =     "\tARP hits:\t";
+static const char menu_netstat_arp_misses_string[] PROGMEM =   "\tARP misses:\t";
+static const char menu_netstat_echoes_string[] PROGMEM =       "\tICMP echoes:\t";
+static const char menu_netstat_budget_string[] PROGMEM =       "\tRX budget hit:\t";
+static const char menu_netstat_arp_string[] PROGMEM =          "\tARP:\t\t";
+static const char menu_netstat_icmp_string[] PROGMEM =         "\tICMP:\t\t";
+static const char menu_netstat_igmp_string[] PROGMEM =         "\tIGMP:\t\t";
+static const char menu_netstat_udp_string[] PROGMEM =          "\tUDP:\t\t";
+static const char menu_netstat_tcp_string[] PROGMEM =          "\tTCP:\t\t";
+static const char menu_netstat_other_string[] PROGMEM =        "\tOther:\t\t";
+static const char menu_netstat_filtered_string[] PROGMEM =     "\tFiltered:\t";
+
+static void print_counter(const char *label, uint32_t value)
+{
+    char tmp[11];
+    console_put_string_P(label);
+    ultoa(value, tmp, 10);
+    console_put_string(tmp);
+    console_put_byte('\n');
+}
+
+static uint8_t print_netstat(uint8_t page)
+{
+    const ENC28J60Statistics *driver = enc28j60_get_statistics();
+    const EthernetStatistics *stack = ethernet_get_statistics();
+    const struct network_link_statistics *link = network_get_link_statistics();
+    const struct network_delivery_statistics *delivery = network_get_delivery_statistics();
+    
+    // At most four counters per page, so that a page fits into the serial output buffer
+    switch (page) {
+        case 0:
+            console_put_string_P(menu_netstat_rx_string);
+            print_counter(menu_netstat_frames_string, driver->RxFrames);
+            print_counter(menu_netstat_bytes_string, driver->RxBytes);
+            print_counter(menu_netstat_errors_string, driver->RxFramesErrored);
+            print_counter(menu_netstat_oversized_string, driver->RxFramesOversized);
+            return 0;
         case 1:
-            serial_put_string_P(menu_payload_t1f_string);
-            serial_put_from_eeprom(SETTING_T_ONE_FALL);
-            serial_put_byte('\n');
-            menu_state++;
-            break;
+            print_counter(menu_netstat_overflows_string, driver->RxOverflows);
+            print_counter(menu_netstat_resets_string, driver->RxResets);
+            print_counter(menu_netstat_pending_string, driver->RxPendingHighWater);
+            print_counter(menu_netstat_vlan_string, driver->RxFramesForeignVlan);
+            return 0;
         case 2:
-            serial_put_string_P(menu_payload_t2f_string);
-            serial_put_from_eeprom(SETTING_T_TWO_RISE);
-            serial_put_byte('\n');
-            menu_state++;
-            break;
+            console_put_string_P(menu_netstat_tx_string);
+            print_counter(menu_netstat_frames_string, driver->TxFrames);
+            print_counter(menu_netstat_bytes_string, driver->TxBytes);
+            print_counter(menu_netstat_errors_string, driver->TxErrors);
+            print_counter(menu_netstat_late_coll_string, driver->TxLateCollisions);
+            return 0;
         case 3:
-            serial_put_string_P(menu_payload_t2r_string);
-            serial_put_from_eeprom(SETTING_T_TWO_FALL);
-            serial_put_byte('\n');
-            menu_state = 0;
-            menu_status = NONE;
-            print_prompt();
-            break;
+            print_counter(menu_netstat_aborts_string, driver->TxAborts);
+            print_counter(menu_netstat_priority_string, driver->TxPriorityFrames);
+            print_counter(menu_netstat_slot_waits_string, driver->TxSlotWaits);
+            print_counter(menu_netstat_repeated_string, driver->TxRepeatedFrames);
+            return 0;
+        case 4:
+            console_put_string_P(menu_netstat_stack_string);
+            print_counter(menu_netstat_arp_hits_string, stack->ARPHits);
+            print_counter(menu_netstat_arp_misses_string, stack->ARPMisses);
+            print_counter(menu_netstat_echoes_string, stack->ICMPEchoes);
+            print_counter(menu_netstat_budget_string, stack->RxBudgetExhausted);
+            return 0;
+        case 5:
+            console_put_string_P(menu_netstat_dispatch_string);
+            print_counter(menu_netstat_arp_string, stack->PacketsARP);
+            print_counter(menu_netstat_icmp_string, stack->PacketsICMP);
+            print_counter(menu_netstat_igmp_string, stack->PacketsIGMP);
+            print_counter(menu_netstat_udp_string, stack->PacketsUDP);
+            return 0;
+        case 6:
+            print_counter(menu_netstat_tcp_string, stack->PacketsTCP);
+            print_counter(menu_netstat_other_string, stack->PacketsOther);
+            print_counter(menu_netstat_filtered_string, stack->PacketsFiltered);
+            return 0;
+        case 7:
+            console_put_string_P(menu_netstat_link_string);
+            print_counter(menu_netstat_losses_string, link->losses);
+            print_counter(menu_netstat_recovery_string, link->last_recovery);
+            print_counter(menu_netstat_max_recovery_string, link->max_recovery);
+            print_counter(menu_netstat_failovers_string, link->failovers);
+            return 0;
+        case 8:
+            print_counter(menu_netstat_failbacks_string, link->failbacks);
+            print_counter(menu_netstat_failover_string, link->last_failover);
+            print_counter(menu_netstat_max_failover_string, link->max_failover);
+            print_counter(menu_netstat_unresolved_string, link->unresolved);
+            return 0;
+        case 9:
+            console_put_string_P(menu_netstat_delivery_string);
+            print_counter(menu_netstat_sent_string, delivery->sent);
+            print_counter(menu_netstat_acked_string, delivery->acknowledged);
+            print_counter(menu_netstat_retransmissions_string, delivery->retransmissions);
+            print_counter(menu_netstat_abandoned_string, delivery->abandoned);
+            return 0;
+        case 10:
+            print_counter(menu_netstat_dup_acks_string, delivery->duplicate_acks);
+            print_counter(menu_netstat_srtt_string, delivery->srtt);
+            print_counter(menu_netstat_rto_string, delivery->rto);
+            return 0;
+        case 11:
+            console_put_string_P(menu_netstat_bursts_string);
+            print_counter(menu_netstat_burst_count_string, delivery->bursts);
+            print_counter(menu_netstat_copies_string, delivery->burst_copies);
+            print_counter(menu_netstat_cut_string, delivery->bursts_cut);
+            return 1;
     }
+    return 1;
 }
 
 static inline void print_dhcp(void)
 {
     char tmp[4];
-    serial_put_string_P(menu_ipinfo_ip_string);
+    console_put_string_P(menu_ipinfo_ip_string);
     print_addr(network_get_ip_addr(), '.', 4, 10, tmp);
     
-    serial_put_string_P(menu_ipinfo_router_string);
+    console_put_string_P(menu_ipinfo_router_string);
     print_addr(network_get_router_addr(), '.', 4, 10, tmp);
     
-    serial_put_string_P(menu_ipinfo_netmask_string);
+    console_put_string_P(menu_ipinfo_netmask_string);
     print_addr(network_get_netmask(), '.', 4, 10, tmp);
 }
 
-static const char menu_set_key_i_ip[] PROGMEM =       " ip.ip";
-static const char menu_set_key_i_dhcp[] PROGMEM =     " ip.dhcp";
-static const char menu_set_key_i_mac[] PROGMEM =      " ip.mac";
-static const char menu_set_key_i_router[] PROGMEM =   " ip.router";
-static const char menu_set_key_i_netmask[] PROGMEM =  " ip.netmask";
-static const char menu_set_key_i_dns[] PROGMEM =      " ip.dns";
-static const char menu_set_key_i_ntp[] PROGMEM =      " ip.ntp";
-static const char menu_set_key_i_gmt[] PROGMEM =      " ip.gmt";
-static const char menu_set_key_i_hostname[] PROGMEM = " ip.hostname";
-
-static const char menu_set_key_t_ip[] PROGMEM =    " target.ip";
-static const char menu_set_key_t_port[] PROGMEM =  " target.port";
-
-static const char menu_set_key_p_1r[] PROGMEM = " payload.onerise";
-static const char menu_set_key_p_1f[] PROGMEM = " payload.onefall";
-static const char menu_set_key_p_2r[] PROGMEM = " payload.tworise";
-static const char menu_set_key_p_2f[] PROGMEM = " payload.twofall";
-
-static inline void interpret_key (char *key, uint16_t *address, uint8_t *length, const char **prompt)
-{
-    if (!strcasecmp_P(key, menu_set_key_i_ip)) {
-        *address = SETTING_IP_ADDR;
-        *length = 4;
-        *prompt = set_ip_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_dhcp)) {
-        *address = SETTING_DCHP;
-        *length = 1;
-        *prompt = set_dhcp_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_mac)) {
-        *address = SETTING_MAC_ADDR;
-        *length = 6;
-        *prompt = set_mac_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_router)) {
-        *address = SETTING_ROUTER_ADDR;
-        *length = 4;
-        *prompt = set_ip_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_netmask)) {
-        *address = SETTING_NETMASK;
-        *length = 4;
-        *prompt = set_ip_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_dns)) {
-        *address = SETTING_DNS_ADDR;
-        *length = 4;
-        *prompt = set_ip_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_ntp)) {
-        *address = SETTING_NTP_ADDR;
-        *length = 4;
-        *prompt = set_ip_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_gmt)) {
-        *address = SETTING_GMT_OFFSET;
-        *length = 1;
-        *prompt = set_gmt_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_i_hostname)) {
-        *address = SETTING_HOSTNAME;
-        *length = 32;
-        *prompt = set_ip_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_t_ip)) {
-        *address = SETTING_TARGET_IP;
-        *length = 4;
-        *prompt = set_ip_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_t_port)) {
-        *address = SETTING_TARGET_PORT;
-        *length = 2;
-        *prompt = set_port_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_p_1r)) {
-        *address = SETTING_T_ONE_RISE;
-        *length = 200;
-        *prompt = set_payload_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_p_1f)) {
-        *address = SETTING_T_ONE_FALL;
-        *length = 200;
-        *prompt = set_payload_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_p_2r)) {
-        *address = SETTING_T_TWO_RISE;
-        *length = 200;
-        *prompt = set_payload_prompt_string;
-    } else if (!strcasecmp_P(key, menu_set_key_p_2f)) {
-        *address = SETTING_T_TWO_FALL;
-        *length = 200;
-        *prompt = set_payload_prompt_string;
-    } else {
-        *address = 0;
-        *length = 0;
-        *prompt = NULL;
-    }
-}
-
-static inline void parse_value(char* str, uint16_t address, uint8_t length) {
+static inline void parse_value(char* str, const struct menu_entry *entry) {
     char *next;
+    uint16_t address = entry->address;
+    uint8_t length;
     
-    switch (length) {
-        case 1:
+    switch (entry->parser) {
+        case PARSE_BYTE:
             // gmt offset or dchp flag
             eeprom_write_byte(address, (uint8_t)atoi(str));
             break;
-        case 2:
+        case PARSE_WORD:
             // port
             eeprom_write_word(address, (uint16_t)atoi(str));
             break;
-        case 4:
+        case PARSE_IP:
             // ip addr
             next = str + strlen(str);
             eeprom_write_byte(address, strtol(str, &next, 10));
@@ -599,83 +1068,111 @@ static inline void parse_value(char* str, uint16_t address, uint8_t length) {
             eeprom_write_byte(address + 2, strtol(next + 1, &next, 10));
             eeprom_write_byte(address + 3, strtol(next + 1, &next, 10));
             break;
-        case 6:
+        case PARSE_MAC:
             // mac addr
             next = str + strlen(str);
-            eeprom_write_byte(address, strtol(str, &next, 10));
+            eeprom_write_byte(address, strtol(str, &next, 16));
             eeprom_write_byte(address + 1, strtol(next + 1, &next, 16));
             eeprom_write_byte(address + 2, strtol(next + 1, &next, 16));
             eeprom_write_byte(address + 3, strtol(next + 1, &next, 16));
             eeprom_write_byte(address + 4, strtol(next + 1, &next, 16));
             eeprom_write_byte(address + 5, strtol(next + 1, &next, 16));
             break;
-        default:
-            eeprom_update_block(str, address, strlen(str) + 1);
-            switch (address) {
-                case SETTING_T_ONE_RISE:
-                    eeprom_update_byte(SETTING_T_ONE_RISE_LEN, strlen(str));
-                    break;
-                case SETTING_T_ONE_FALL:
-                    eeprom_update_byte(SETTING_T_ONE_FALL_LEN, strlen(str));
-                    break;
-                case SETTING_T_TWO_RISE:
-                    eeprom_update_byte(SETTING_T_TWO_RISE_LEN, strlen(str));
+        case PARSE_STRING:
+        case PARSE_PAYLOAD:
+        case PARSE_OSC:
+            if (entry->parser == PARSE_OSC) {
+                // encoded into binary OSC straight away, so that nothing is left to parse when it is sent
+                length = osc_encode(str, address, entry->length);
+                if (length == 0) {
+                    console_put_string_P(set_osc_error_string);
                     break;
-                case SETTING_T_TWO_FALL:
-                    eeprom_update_byte(SETTING_T_TWO_FALL_LEN, strlen(str));
-                    break;
-                default:
+                }
+            } else {
+                // string, truncated so that it and its terminator fit the setting
+                length = strnlen(str, entry->length - 1);
+                str[length] = '\0';
+                if ((entry->parser == PARSE_PAYLOAD) &&
+                    (network_count_placeholders(str, length) > NETWORK_TEMPLATE_FIELDS)) {
+                    console_put_string_P(set_payload_error_string);
                     break;
+                }
+                eeprom_update_block(str, address, length + 1);
+            }
+            
+            if (entry->parser != PARSE_STRING) {
+                switch (address) {
+                    case SETTING_T_ONE_RISE:
+                        eeprom_update_byte(SETTING_T_ONE_RISE_LEN, length);
+                        break;
+                    case SETTING_T_ONE_FALL:
+                        eeprom_update_byte(SETTING_T_ONE_FALL_LEN, length);
+                        break;
+                    case SETTING_T_TWO_RISE:
+                        eeprom_update_byte(SETTING_T_TWO_RISE_LEN, length);
+                        break;
+                    case SETTING_T_TWO_FALL:
+                        eeprom_update_byte(SETTING_T_TWO_FALL_LEN, length);
+                        break;
+                    default:
+                        break;
+                }
+                network_compile_payloads();
             }
-            // string
+            break;
+        default:
             break;
     }
 }
 
-static const char menu_set_help_key[] PROGMEM =         " help";
-static const char menu_set_help_key_ip_2[] PROGMEM =    " help ip 2";
-static const char menu_set_help_key_ip[] PROGMEM =      " help ip";
-static const char menu_set_help_key_target[] PROGMEM =  " help target";
-static const char menu_set_help_key_payload[] PROGMEM = " help payload";
+static const char menu_set_help_key[] PROGMEM =         "help";
+static const char menu_set_help_key_ip_2[] PROGMEM =    "help ip 2";
+static const char menu_set_help_key_ip[] PROGMEM =      "help ip";
+static const char menu_set_help_key_target[] PROGMEM =  "help target";
+static const char menu_set_help_key_payload[] PROGMEM = "help payload";
+static const char menu_set_help_key_console[] PROGMEM = "help console";
+static const char menu_set_help_key_osc[] PROGMEM =     "help osc";
+
+static struct menu_entry menu_set_entry;           // The setting for which a value is being entered
 
 static inline void process_set(char* property)
 {
     if ((strlen(property) == 0) || !strcasecmp_P(property, menu_set_help_key)) {
-        // Empty string or " help"
-        serial_put_string_P(set_help_string);
-        menu_status = NONE;
-    } else if (!strncasecmp_P(property, menu_set_help_key_ip_2, 10)) {
-        serial_put_string_P(set_help_ip_2_string);
-        menu_status = NONE;
-    } else if (!strncasecmp_P(property, menu_set_help_key_ip, 8)) {
-        serial_put_string_P(set_help_ip_1_string);
-        menu_status = NONE;
-    } else if (!strncasecmp_P(property, menu_set_help_key_target, 12)) {
-        serial_put_string_P(set_help_target_string);
+        // Empty string or "help"
+        console_put_string_P(set_help_string);
+    } else if (!strncasecmp_P(property, menu_set_help_key_ip_2, 9)) {
+        console_put_string_P(set_help_ip_2_string);
+    } else if (!strncasecmp_P(property, menu_set_help_key_ip, 7)) {
+        console_put_string_P(set_help_ip_1_string);
+    } else if (!strncasecmp_P(property, menu_set_help_key_target, 11)) {
+        console_put_string_P(set_help_target_string);
+    } else if (!strncasecmp_P(property, menu_set_help_key_payload, 12)) {
+        console_put_string_P(set_help_payload_string);
+    } else if (!strncasecmp_P(property, menu_set_help_key_console, 12)) {
+        console_put_string_P(set_help_console_string);
+    } else if (!strncasecmp_P(property, menu_set_help_key_osc, 8)) {
+        console_put_string_P(set_help_osc_string);
+    } else if (menu_lookup(property, strlen(property), &menu_set_entry) && (menu_set_entry.parser != PARSE_NONE)) {
+        console_put_string_P(menu_set_entry.prompt);
+        menu_status = SET;
+    } else {
+        console_put_string_P(set_unkown_property_string);
+        console_put_string(property);
+        console_put_byte('\n');
+    }
+}
+
+static inline void process_set_value(void)
+{
+    if (console_has_line()) {
+        parse_value(console_get_line(), &menu_set_entry);
+        
+        print_prompt();
         menu_status = NONE;
-    } else if (!strncasecmp_P(property, menu_set_help_key_payload, 13)) {
-        serial_put_string_P(set_help_payload_string);
+        console_hold(0);
+    } else if (console_expired()) {
         menu_status = NONE;
-    } else if (property != NULL) {
-        const char *prompt;
-        interpret_key(property, (uint16_t*)&menu_state + 1, (uint8_t*)&menu_state, &prompt);
-        if (prompt != NULL) {
-            serial_put_string_P(prompt);
-        } else {
-            serial_put_string_P(set_unkown_property_string);
-            serial_put_string(property);
-            serial_put_byte('\n');
-            menu_status = NONE;
-        }
-    } else {
-        if (serial_has_line()) {
-            serial_get_line(menu_buffer, 200);
-    
-            parse_value(menu_buffer, *((uint16_t*)&menu_state + 1), *((uint8_t*)&menu_state));
-            
-            print_prompt();
-            menu_status = NONE;
-        }
+        console_hold(0);
     }
 }
 
@@ -13,50 +13,343 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "./libethernet/libethernet.h"
+#include "./libethernet/arp_table.h"
+
+// MARK: Constants
+#define NETWORK_DHCP_TIMEOUT 5000
+#define NETWORK_TARGET_TIMEOUT 1000
+#define NETWORK_ARP_REFRESH_INTERVAL 1000           // ms between the checks that keep the targets in the ARP table
+#define NETWORK_TRIGGER_QUEUE_LENGTH 8              // Must be a power of two
+#define NETWORK_LINK_POLL_INTERVAL 100              // ms, only used without HANDLE_LINK_STATUS_CHANGES
+#define NETWORK_PROBE_ID 0x4553                     // Tells replies to our probes apart from those to other pings
+#define NETWORK_BACKUP_BLINK_PERIOD 250             // ms, STAT_TWO blinks while payloads are sent to the backup
+#define NETWORK_PAYLOAD_LENGTH 200                  // The size of the payload settings
+#define NETWORK_PLACEHOLDER_LENGTH 8                // The longest text between the braces of a placeholder
+
+struct network_payload {
+    uint16_t address;
+    uint16_t length_address;
+};
+
+static const struct network_payload network_payloads[] PROGMEM = {
+    [NETWORK_TRIGGER_ONE_RISE] = {SETTING_T_ONE_RISE, SETTING_T_ONE_RISE_LEN},
+    [NETWORK_TRIGGER_ONE_FALL] = {SETTING_T_ONE_FALL, SETTING_T_ONE_FALL_LEN},
+    [NETWORK_TRIGGER_TWO_RISE] = {SETTING_T_TWO_RISE, SETTING_T_TWO_RISE_LEN},
+    [NETWORK_TRIGGER_TWO_FALL] = {SETTING_T_TWO_FALL, SETTING_T_TWO_FALL_LEN}
+};
+
+// Payload templates, see network.h
+enum {NETWORK_VAR_SEQ, NETWORK_VAR_MS, NETWORK_VAR_T1, NETWORK_VAR_T2, NETWORK_VAR_COUNT};
+
+static const char network_variable_names[NETWORK_VAR_COUNT][4] PROGMEM = {
+    [NETWORK_VAR_SEQ] = "seq",
+    [NETWORK_VAR_MS] = "ms",
+    [NETWORK_VAR_T1] = "t1",
+    [NETWORK_VAR_T2] = "t2"
+};
+
+enum {NETWORK_PLACEHOLDER_TEXT, NETWORK_PLACEHOLDER_FIELD, NETWORK_PLACEHOLDER_INVALID};
+
+// The payloads are read from EEPROM, but checked in RAM before they are stored
+#define NETWORK_PAYLOAD_BYTE(payload, address, i) \
+    (((payload) != NULL) ? (payload)[i] : (char)eeprom_read_byte((const uint8_t *)((address) + (i))))
+
+struct network_template_field {
+    uint8_t offset;                                 // Of the placeholder in the payload, the value is written over it
+    uint8_t variable;
+    uint8_t width;                                  // Decimal digits, the length of the placeholder, or 0 for {#N}
+};
+
+struct network_template {
+    uint8_t length;                                 // Length of the payload setting
+    uint8_t fields;
+    struct network_template_field field[NETWORK_TEMPLATE_FIELDS];
+};
+
+static struct network_template network_templates[4];
+
+// A trigger event together with what its payload may refer to
+struct network_edge {
+    uint8_t event;
+    uint8_t inputs;                                 // Bit 0 for input one, bit 1 for input two, set while on
+    uint32_t time;                                  // When the edge happened
+};
 
 // MARK: Variables
 static UDPSocket eos_connection;
 
+static Protothread network_thread;
+static ARPResolve network_target_resolve;
+static uint32_t network_targets[NETWORK_TARGET_COUNT];
+static uint8_t network_target_index;                // Used by network_connect_thread
+static uint32_t network_arp_time;                   // When the ARP entries of the targets were last checked
+static uint32_t network_target_seen;                // When the active target was last in the ARP table
+
+// Failover between the primary target (network_targets[0]) and the backup, see network.h
+static uint32_t network_backup_ip;
+static bool network_on_backup;
+static uint32_t network_blink_time;
+#ifdef IMPLEMENT_ICMP
+struct network_probe_state {
+    uint8_t misses;                                 // Rounds of probes in a row without an answer
+    uint8_t answers;                                // Rounds of probes in a row with an answer
+    bool answered;                                  // Set by network_probe_reply during the current round
+    uint32_t seen;                                  // When the target last answered
+};
+
+static Protothread network_probe_thread;
+static struct network_probe_state network_probes[2];    // The primary and the backup target
+static uint8_t network_probe_index;                 // Used by network_probe
+static uint16_t network_probe_seq;
+static uint32_t network_probe_time;                 // When the current round of probes was started
+static uint16_t network_probe_interval;
+static uint8_t network_probe_limit;
+#endif // IMPLEMENT_ICMP
+
+// Reliable delivery, see network.h. Payloads awaiting acknowledgment are kept in the slot of their sequence number.
+struct network_unacked_trigger {
+    uint16_t seq;
+    struct network_edge edge;
+    uint8_t sends;                                  // The number of times it has been sent, 0 if the slot is free
+    uint32_t time;                                  // When it was last sent
+    uint16_t timeout;                               // ms after which it is sent again
+};
+
+static bool network_reliable;
+static bool network_sequenced;                      // Payloads are preceded by a sequence header
+static uint8_t network_reliable_retries;
+static uint16_t network_seq;                        // The sequence number of the last trigger
+static struct network_unacked_trigger network_unacked[NETWORK_RELIABLE_WINDOW];
+static bool network_rtt_measured;
+static uint16_t network_srtt8;                      // Smoothed round trip time, times 8
+static uint16_t network_rttvar4;                    // Round trip time variation, times 4
+static struct network_delivery_statistics network_delivery_stats;
+
+// Bursts, see network.h. The copies are sent from the frame kept by udp_send_repeatable.
+static uint8_t network_burst_count;
+static uint16_t network_burst_gap;
+#ifdef IMPLEMENT_REPEAT
+static uint32_t network_burst_ips[NETWORK_TARGET_COUNT];
+static uint8_t network_burst_targets;
+static uint8_t network_burst_remaining;             // Copies still to be sent of the current burst
+static uint32_t network_burst_time;                 // When the last copy was sent
+#endif // IMPLEMENT_REPEAT
+#ifdef IMPLEMENT_DHCP
+static DHCPRequest network_dhcp_request;
+#endif // IMPLEMENT_DHCP
+
+// DHCP keeps a pointer to the hostname for renewals, so it must outlive init_network
+static char network_hostname[32];
+
+// Kept up to date by the link status change callback, or by polling the PHY every NETWORK_LINK_POLL_INTERVAL
+static bool network_link_up;
+#ifndef HANDLE_LINK_STATUS_CHANGES
+static uint32_t network_link_poll_time;
+#endif // HANDLE_LINK_STATUS_CHANGES
+
+static uint32_t network_link_up_time;               // When the link came up, to measure how long recovery takes
+static struct network_link_statistics network_link_stats;
+
+// Triggers which happened while offline, or while older ones are still waiting to be replayed
+static struct network_edge network_trigger_queue[NETWORK_TRIGGER_QUEUE_LENGTH];
+static uint8_t network_trigger_insert_p;
+static uint8_t network_trigger_withdraw_p;
+static uint16_t network_trigger_overflows;
+
 // MARK: Functions
 
-int init_network (void)
+/**
+ *  Checks if a target is configured
+ *  @param index The number of the target, 0 is SETTING_TARGET_IP
+ *  @return true if the target has an address
+ */
+static bool network_target_valid (uint8_t index)
 {
-    spi_initialise(&PORTB, &DDRB, PB5, PB4, PB3, PB2);
-    uint8_t mac[6];
-    eeprom_read_block(SETTING_MAC_ADDR, mac, 6);
-    enc28j60_initialise(mac, true);
+    return (network_targets[index] != 0) && (network_targets[index] != 0xFFFFFFFF);
+}
+
+/**
+ *  Checks if a backup target is configured
+ *  @return true if failover is enabled
+ */
+static bool network_backup_valid (void)
+{
+    return (network_backup_ip != 0) && (network_backup_ip != 0xFFFFFFFF);
+}
+
+/**
+ *  Gets the address of the primary or the backup target
+ *  @param backup true for the backup target
+ *  @return The address
+ */
+static uint32_t network_failover_ip (bool backup)
+{
+    return backup ? network_backup_ip : network_targets[0];
+}
+
+/**
+ *  Updates the retransmission timeout with a round trip time measurement, as in RFC 6298
+ *  @param rtt The round trip time in ms
+ */
+static void network_update_rto (uint32_t rtt)
+{
+    if (rtt > NETWORK_RTO_MAX) {
+        rtt = NETWORK_RTO_MAX;
+    }
     
-    char hostname[32];
-    eeprom_read_block(hostname, SETTING_HOSTNAME, 32);
+    if (!network_rtt_measured) {
+        network_rtt_measured = true;
+        network_srtt8 = rtt << 3;
+        network_rttvar4 = rtt << 1;
+    } else {
+        int16_t delta = (int16_t)rtt - (network_srtt8 >> 3);
+        network_srtt8 += delta;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        network_rttvar4 += delta - (network_rttvar4 >> 2);
+    }
     
-    // Initialise all enabled modules of the ethernet stack
-#ifdef IMPLEMENT_DHCP
-    if (eeprom_read_byte(SETTING_DCHP)) {
-        ethernet_initialise_dhcp(hostname, 1000);
-        if (ethernet_get_router_ip() == 0) {
-            return -1;
+    // RTO = SRTT + max(G, 4 * RTTVAR), with a clock granularity G of 1 ms
+    uint16_t rto = (network_srtt8 >> 3) + ((network_rttvar4 != 0) ? network_rttvar4 : 1);
+    if (rto < NETWORK_RTO_MIN) {
+        rto = NETWORK_RTO_MIN;
+    } else if (rto > NETWORK_RTO_MAX) {
+        rto = NETWORK_RTO_MAX;
+    }
+    network_delivery_stats.srtt = network_srtt8 >> 3;
+    network_delivery_stats.rto = rto;
+}
+
+/**
+ *  Drops all payloads that are awaiting acknowledgment
+ */
+static void network_abandon_unacked (void)
+{
+    for (uint8_t i = 0; i < NETWORK_RELIABLE_WINDOW; i++) {
+        if (network_unacked[i].sends != 0) {
+            network_unacked[i].sends = 0;
+            network_delivery_stats.abandoned++;
         }
+    }
+}
+
+/**
+ *  Called by the ethernet stack when a packet for the connection to the target has been recieved
+ *  @param socket The connection on which the packet was recieved
+ *  @param buffer The data of the packet
+ *  @param length The length of the data
+ */
+static void network_reliable_packet (UDPSocket socket, const uint8_t *buffer, size_t length)
+{
+    if (socket != eos_connection) {
+        // Acknowledgments from further targets are not tracked, do not let them fill up the UDP table
+        udp_disconnect(socket);
+        return;
+    }
+    
+    if ((length < NETWORK_RELIABLE_HEADER_LENGTH) || (buffer[0] != NETWORK_RELIABLE_MAGIC) ||
+        (buffer[1] != NETWORK_RELIABLE_ACK)) {
+        return;
+    }
+    
+    uint16_t seq = ((uint16_t)buffer[2] << 8) | buffer[3];
+    struct network_unacked_trigger *unacked = &network_unacked[seq & (NETWORK_RELIABLE_WINDOW - 1)];
+    if ((unacked->sends == 0) || (unacked->seq != seq)) {
+        network_delivery_stats.duplicate_acks++;
+        return;
+    }
+    
+    // Karn's algorithm: the acknowledgment of a retransmitted payload could belong to any of its copies
+    if (unacked->sends == 1) {
+        network_update_rto(millis - unacked->time);
+    }
+    unacked->sends = 0;
+    network_delivery_stats.acknowledged++;
+}
+
+/**
+ *  Opens the connection to the primary or the backup target, whichever is active
+ *  @note The target must have been resolved already, udp_connect blocks on ARP otherwise
+ *  @return true if the connection has been opened
+ */
+static bool network_open_connection (void)
+{
+    // Acknowledgments are only recieved in reliable mode, the connection does not need a local port otherwise
+    eos_connection = udp_connect(network_failover_ip(network_on_backup), eeprom_read_word(SETTING_TARGET_PORT),
+                                 NETWORK_TARGET_TIMEOUT, network_reliable ? network_reliable_packet : NULL);
+    if (eos_connection == INVALID_UDP_SOCKET) {
+        return false;
+    }
+    
+    // The round trip time to another target has to be measured again
+    network_rtt_measured = false;
+    network_delivery_stats.rto = NETWORK_RTO_INITIAL;
+    
+    uint8_t dscp = eeprom_read_byte(SETTING_TARGET_DSCP);
+    udp_set_qos(eos_connection, (dscp > 63) ? NETWORK_DEFAULT_DSCP : dscp, true);
+    return true;
+}
+
+/**
+ *  Sets FLAG_ONLINE and the network status LED
+ *  @param online The new state
+ */
+static void network_set_online (bool online)
+{
+    if (online) {
+        flags |= (1<<FLAG_ONLINE);
+        STAT_TWO_PORT |= (1<<STAT_TWO_NUM);
     } else {
-        ethernet_initialise(eeprom_read_dword(SETTING_IP_ADDR), eeprom_read_dword(SETTING_NETMASK), eeprom_read_dword(SETTING_ROUTER_ADDR));
-        if (!ethernet_wait_for_link_status(1000)) {
-            return -1;
-        }
+        flags &= ~(1<<FLAG_ONLINE);
+        STAT_TWO_PORT &= ~(1<<STAT_TWO_NUM);
     }
-#else
-    ethernet_initialise(eeprom_read_dword(SETTING_IP_ADDR), eeprom_read_dword(SETTING_NETMASK), eeprom_read_dword(SETTING_ROUTER_ADDR));
-    ethernet_wait_for_link_status(0);
-#endif // IMPLEMENT_DHCP
+}
+
+/**
+ *  Drops the connection to the target and lets network_connect_thread bring it up again
+ */
+static void network_restart (void)
+{
+    network_set_online(false);
+    network_abandon_unacked();
+#ifdef IMPLEMENT_REPEAT
+    network_burst_remaining = 0;
+#endif // IMPLEMENT_REPEAT
+    if (eos_connection != INVALID_UDP_SOCKET) {
+        udp_disconnect(eos_connection);
+        eos_connection = INVALID_UDP_SOCKET;
+    }
+    PT_INIT(&network_thread);
+}
 
+/**
+ *  Brings the network up without blocking the main loop: waits for link, gets a DHCP lease if enabled, resolves the
+ *  target and opens the connection to it. Sets FLAG_ONLINE once it has finished.
+ *  @param pt The protothread state
+ */
+static PT_THREAD(network_connect_thread (Protothread *pt))
+{
+    PT_BEGIN(pt);
     
-    // Timer 1 (network clock)
-    TCCR1B |= (1<<WGM11);                           // Set the Timer Mode to CTC
-    TIMSK1 |= (1<<OCIE1A);                          // Set the ISR COMPA vector (enables COMP interupt)
-    OCR1A = 31250;                                  // 1 Hz
-    TCCR1B |= (1<<CS12);                            // set prescaler to 256 and start timer 1
+    PT_WAIT_UNTIL(pt, network_link_up);
     
+#ifdef IMPLEMENT_DHCP
+    if (eeprom_read_byte(SETTING_DCHP)) {
+        dhcp_request_start(&network_dhcp_request, network_hostname, NETWORK_DHCP_TIMEOUT);
+        PT_WAIT_THREAD(pt, dhcp_request_thread(&network_dhcp_request));
+        if (!dhcp_has_valid_configuration()) {
+            // Try again (starting with the link check)
+            PT_RESTART(pt);
+        }
+        _ethernet_set_ip_netmask_router(dhcp_get_ip(), dhcp_get_netmask(), dhcp_get_router_ip());
+    }
+#endif // IMPLEMENT_DHCP
     
     // Initialise the DNS resolver module
 #ifdef IMPLEMENT_DNS
@@ -80,16 +373,278 @@ int init_network (void)
 #	endif //IMPLEMENT_DHCP
 #endif //IMPLEMENT_DNS
     
-    eos_connection = udp_connect(eeprom_read_dword(SETTING_TARGET_IP), eeprom_read_dword(SETTING_TARGET_PORT), 5, NULL);
+    network_targets[0] = eeprom_read_dword(SETTING_TARGET_IP);
+    eeprom_read_block(&network_targets[1], SETTING_TARGET_IPS, 4 * (NETWORK_TARGET_COUNT - 1));
+    network_backup_ip = eeprom_read_dword(SETTING_BACKUP_IP);
+    network_reliable = (eeprom_read_byte(SETTING_RELIABLE) == 1);
+    network_reliable_retries = eeprom_read_byte(SETTING_RELIABLE_RETRIES);
+    if (network_reliable_retries == 0xFF) {
+        network_reliable_retries = NETWORK_DEFAULT_RETRIES;
+    }
+    network_burst_count = eeprom_read_byte(SETTING_BURST_COUNT);
+    if ((network_burst_count == 0) || (network_burst_count == 0xFF)) {
+        network_burst_count = 1;
+    }
+    network_burst_gap = eeprom_read_word(SETTING_BURST_GAP);
+    if (network_burst_gap == 0xFFFF) {
+        network_burst_gap = NETWORK_DEFAULT_BURST_GAP;
+    }
+    network_sequenced = network_reliable || (network_burst_count > 1);
+    
+    // Resolve the target before connecting so that udp_connect does not block on ARP, the backup target is tried in
+    // turn with the primary
+    network_on_backup = false;
+    for (;;) {
+        ethernet_arp_resolve_start(&network_target_resolve, network_failover_ip(network_on_backup),
+                                   NETWORK_TARGET_TIMEOUT);
+        PT_WAIT_THREAD(pt, ethernet_arp_resolve_thread(&network_target_resolve));
+        if (network_target_resolve.Resolved) {
+            break;
+        }
+        network_on_backup = !network_on_backup && network_backup_valid();
+    }
+    
+    if (!network_open_connection()) {
+        PT_RESTART(pt);
+    }
+    
+    // The other targets are only tried once, one that does not answer must not keep the others from being served.
+    // network_refresh_arp keeps asking for them.
+    for (network_target_index = 1; network_target_index < NETWORK_TARGET_COUNT; network_target_index++) {
+        if (network_target_valid(network_target_index)) {
+            ethernet_arp_resolve_start(&network_target_resolve, network_targets[network_target_index],
+                                       NETWORK_TARGET_TIMEOUT);
+            PT_WAIT_THREAD(pt, ethernet_arp_resolve_thread(&network_target_resolve));
+        }
+    }
+    
+#ifdef IMPLEMENT_ICMP
+    network_probe_interval = eeprom_read_word(SETTING_PROBE_INTERVAL);
+    if ((network_probe_interval == 0) || (network_probe_interval == 0xFFFF)) {
+        network_probe_interval = NETWORK_DEFAULT_PROBE_INTERVAL;
+    }
+    network_probe_limit = eeprom_read_byte(SETTING_PROBE_LIMIT);
+    if ((network_probe_limit == 0) || (network_probe_limit == 0xFF)) {
+        network_probe_limit = NETWORK_DEFAULT_PROBE_LIMIT;
+    }
+    
+    // Both targets count as answering until the probes say otherwise
+    memset(network_probes, 0, sizeof(network_probes));
+    network_probes[0].seen = millis;
+    network_probes[1].seen = millis;
+    PT_INIT(&network_probe_thread);
+#endif // IMPLEMENT_ICMP
+    
+    network_link_stats.last_recovery = millis - network_link_up_time;
+    if (network_link_stats.last_recovery > network_link_stats.max_recovery) {
+        network_link_stats.max_recovery = network_link_stats.last_recovery;
+    }
+    network_target_seen = millis;
+    network_set_online(true);
+    
+    PT_END(pt);
+}
+
+#ifdef IMPLEMENT_ICMP
+/**
+ *  Moves the payloads for the primary target to the primary or the backup target
+ *  @param backup true to send them to the backup target
+ */
+static void network_switch_target (bool backup)
+{
+    udp_disconnect(eos_connection);
+    network_on_backup = backup;
+    network_target_seen = millis;
+    
+    // Both targets have just answered a probe and are resolved. Should the connection fail anyway, eos_connection is
+    // left invalid and network_service starts over.
+    if (network_open_connection() && !backup) {
+        STAT_TWO_PORT |= (1<<STAT_TWO_NUM);
+    }
+}
+
+/**
+ *  Counts the answers to the last round of probes and fails over or back if needed
+ */
+static void network_probe_evaluate (void)
+{
+    for (uint8_t i = 0; i < 2; i++) {
+        struct network_probe_state *probe = &network_probes[i];
+        if (probe->answered) {
+            probe->misses = 0;
+            if (probe->answers != 0xFF) {
+                probe->answers++;
+            }
+        } else {
+            probe->answers = 0;
+            if (probe->misses != 0xFF) {
+                probe->misses++;
+            }
+        }
+    }
+    
+    const struct network_probe_state *active = &network_probes[network_on_backup];
+    const struct network_probe_state *other = &network_probes[!network_on_backup];
+    
+    if ((active->misses >= network_probe_limit) && other->answered) {
+        // Measured from the last answer, the target may have died at any time after it
+        uint32_t time = millis - active->seen;
+        network_link_stats.last_failover = time;
+        if (time > network_link_stats.max_failover) {
+            network_link_stats.max_failover = time;
+        }
+        network_link_stats.failovers++;
+        network_switch_target(!network_on_backup);
+    } else if (network_on_backup && (other->answers >= network_probe_limit) &&
+               (eeprom_read_byte(SETTING_FAILBACK) == 1)) {
+        network_link_stats.failbacks++;
+        network_switch_target(false);
+    }
+}
+
+/**
+ *  Called by the ethernet stack when an echo reply has been recieved
+ *  @param ip The address of the host that answered
+ *  @param id The ID of the reply
+ *  @param seq The sequence number of the reply
+ */
+static void network_probe_reply (uint32_t ip, uint16_t id, uint16_t seq)
+{
+    if ((id != NETWORK_PROBE_ID) || (seq != network_probe_seq)) {
+        return;
+    }
     
-    return 0;
+    for (uint8_t i = 0; i < 2; i++) {
+        if (ip == network_failover_ip(i)) {
+            network_probes[i].answered = true;
+            network_probes[i].seen = millis;
+        }
+    }
+}
+
+/**
+ *  Pings the primary and the backup target every network_probe_interval ms while online
+ *  @param pt The protothread state
+ */
+static PT_THREAD(network_probe (Protothread *pt))
+{
+    PT_BEGIN(pt);
+    
+    for (;;) {
+        network_probe_time = millis;
+        network_probe_seq++;
+        
+        for (network_probe_index = 0; network_probe_index < 2; network_probe_index++) {
+            network_probes[network_probe_index].answered = false;
+            
+            // Both resolutions together never take longer than a round, a target that does not answer ARP counts as
+            // a missed probe
+            ethernet_arp_resolve_start(&network_target_resolve, network_failover_ip(network_probe_index),
+                                       (network_probe_interval / 2) + 1);
+            PT_WAIT_THREAD(pt, ethernet_arp_resolve_thread(&network_target_resolve));
+            if (network_target_resolve.Resolved) {
+                icmp_send_echo_request(network_failover_ip(network_probe_index), NETWORK_PROBE_ID, network_probe_seq);
+            }
+        }
+        
+        PT_WAIT_UNTIL(pt, (millis - network_probe_time) >= network_probe_interval);
+        network_probe_evaluate();
+    }
+    
+    PT_END(pt);
+}
+#endif // IMPLEMENT_ICMP
+
+/**
+ *  Called by the ethernet stack (or the poll in network_service) when the link goes up or down
+ *  @param link_up The new link status
+ */
+static void network_link_status_changed (bool link_up)
+{
+    network_link_up = link_up;
+    
+    if (link_up) {
+        // Whatever was learned before may have moved while the cable was out, the target (or the router in front of
+        // it) is resolved again by network_connect_thread. A DHCP lease that is still held is only revalidated.
+        network_link_up_time = millis;
+        arp_table_initialise();
+#ifdef IMPLEMENT_IGMP
+        // The switch may have forgotten our groups, or we may be connected to another one
+        igmp_report_groups();
+#endif // IMPLEMENT_IGMP
+    } else {
+        network_link_stats.losses++;
+    }
+    
+    // Go offline and let network_connect_thread start over once the link is back
+    network_restart();
+}
+
+void init_network (void)
+{
+    spi_initialise(&PORTB, &DDRB, PB5, PB4, PB3, PB2);
+    uint8_t mac[6];
+    eeprom_read_block(mac, SETTING_MAC_ADDR, 6);
+    enc28j60_initialise(mac, true);
+#ifdef IMPLEMENT_VLAN
+    uint8_t pcp = eeprom_read_byte(SETTING_VLAN_PCP);
+    uint8_t target_pcp = eeprom_read_byte(SETTING_TARGET_PCP);
+    enc28j60_set_vlan(eeprom_read_word(SETTING_VLAN_ID), (pcp > 7) ? NETWORK_DEFAULT_PCP : pcp,
+                      (target_pcp > 7) ? NETWORK_DEFAULT_TARGET_PCP : target_pcp);
+#endif // IMPLEMENT_VLAN
+    
+    eeprom_read_block(network_hostname, SETTING_HOSTNAME, 32);
+    network_hostname[31] = '\0';
+    
+    network_compile_payloads();
+    
+    // Initialise all enabled modules of the ethernet stack, the address is filled in by network_connect_thread if DHCP is used
+    ethernet_initialise(eeprom_read_dword(SETTING_IP_ADDR), eeprom_read_dword(SETTING_NETMASK), eeprom_read_dword(SETTING_ROUTER_ADDR));
+#ifdef IMPLEMENT_DHCP
+    if (eeprom_read_byte(SETTING_DCHP)) {
+        _ethernet_set_ip_netmask_router(0, 0, 0);
+    }
+#endif // IMPLEMENT_DHCP
+    
+    // Timer 1 (network clock)
+    TCCR1B |= (1<<WGM12);                           // Set the Timer Mode to CTC
+    TIMSK1 |= (1<<OCIE1A);                          // Set the ISR COMPA vector (enables COMP interupt)
+    OCR1A = 31249;                                  // 1 Hz at 8 MHz, the counter runs from 0 to OCR1A
+    TCCR1B |= (1<<CS12);                            // set prescaler to 256 and start timer 1
+    
+    eos_connection = INVALID_UDP_SOCKET;
+    network_restart();
+    
+    network_link_up = ethernet_get_link_status();
+    network_link_up_time = millis;
+#ifdef HANDLE_LINK_STATUS_CHANGES
+    ethernet_set_link_status_change_callback(network_link_status_changed);
+#endif // HANDLE_LINK_STATUS_CHANGES
+#ifdef IMPLEMENT_ICMP
+    icmp_set_echo_reply_callback(network_probe_reply);
+#endif // IMPLEMENT_ICMP
+    
+#ifdef USE_INTERRUPTS
+    // ENC28J60 interrupt pin (active low, pin change interrupt)
+    ENC_INT_DDR &= ~(1<<ENC_INT_NUM);
+    ENC_INT_PORT |= (1<<ENC_INT_NUM);
+    ENC_INT_PCMSK |= (1<<ENC_INT_PCINT);
+    PCICR |= (1<<ENC_INT_PCIE);
+    
+    // The controller may already have asserted its interrupt before the pin change interrupt was enabled
+    if (!(ENC_INT_PIN & (1<<ENC_INT_NUM))) {
+        ethernet_data_interrupt();
+    }
+#endif // USE_INTERRUPTS
 }
 
 int network_send_packet (char *source, int length)
 {
     uint8_t* buffer;
     size_t buffer_size;
-    udp_start_packet(eos_connection, &buffer, &buffer_size);
+    if (!udp_start_packet(eos_connection, &buffer, &buffer_size)) {
+        return 0;
+    }
     length = (length < buffer_size) ? length : buffer_size;
     
     memcpy(buffer, source, length);
@@ -103,7 +658,9 @@ int network_send_from_eeprom (uint16_t address, int length)
 {
     uint8_t* buffer;
     size_t buffer_size;
-    udp_start_packet(eos_connection, &buffer, &buffer_size);
+    if (!udp_start_packet(eos_connection, &buffer, &buffer_size)) {
+        return 0;
+    }
     length = (length < buffer_size) ? length : buffer_size;
     
     eeprom_read_block(buffer, address, length);
@@ -113,6 +670,365 @@ int network_send_from_eeprom (uint16_t address, int length)
     return length;
 }
 
+/**
+ *  Finds the variable a placeholder refers to
+ *  @param name The name of the variable, not nul terminated
+ *  @param length The length of the name
+ *  @return The variable, NETWORK_VAR_COUNT if there is none of that name
+ */
+static uint8_t network_placeholder_variable (const char *name, uint8_t length)
+{
+    for (uint8_t i = 0; i < NETWORK_VAR_COUNT; i++) {
+        if ((length < sizeof(network_variable_names[i])) && !strncmp_P(name, network_variable_names[i], length) &&
+            (pgm_read_byte(&network_variable_names[i][length]) == '\0')) {
+            return i;
+        }
+    }
+    return NETWORK_VAR_COUNT;
+}
+
+/**
+ *  Parses the text between the braces of a placeholder
+ *  @param name The text, not nul terminated
+ *  @param length The length of the text
+ *  @param field Filled in with the variable and the format
+ *  @return NETWORK_PLACEHOLDER_FIELD if the placeholder is filled in, NETWORK_PLACEHOLDER_TEXT if it is sent as it is
+ *          and NETWORK_PLACEHOLDER_INVALID if it names a variable but can not be filled in
+ */
+static uint8_t network_parse_placeholder (const char *name, uint8_t length, struct network_template_field *field)
+{
+    // {#N}, which takes up exactly the four bytes of the integer (see network_int_placeholder)
+    if (name[0] == '#') {
+        field->variable = (length == 2) ? (uint8_t)(name[1] - '0') : NETWORK_VAR_COUNT;
+        field->width = 0;
+        return (field->variable < NETWORK_VAR_COUNT) ? NETWORK_PLACEHOLDER_FIELD : NETWORK_PLACEHOLDER_INVALID;
+    }
+    
+    // {name}, padded with underscores for more digits
+    uint8_t n = 0;
+    while ((n < length) && (name[n] != '_') && (name[n] != ':')) {
+        n++;
+    }
+    field->variable = network_placeholder_variable(name, n);
+    if (field->variable == NETWORK_VAR_COUNT) {
+        return NETWORK_PLACEHOLDER_TEXT;
+    }
+    while (n < length) {
+        if (name[n++] != '_') {
+            return NETWORK_PLACEHOLDER_INVALID;
+        }
+    }
+    field->width = length + 2;
+    return NETWORK_PLACEHOLDER_FIELD;
+}
+
+/**
+ *  Finds the placeholders of a payload
+ *  @param payload The payload in RAM, NULL if it is read from EEPROM
+ *  @param address The address of the payload in EEPROM
+ *  @param length The length of the payload
+ *  @param template Filled in with the placeholders, as many as fit
+ *  @return false if there are more than NETWORK_TEMPLATE_FIELDS placeholders or one can not be filled in
+ */
+static bool network_find_placeholders (const char *payload, uint16_t address, uint8_t length,
+                                       struct network_template *template)
+{
+    bool valid = true;
+    template->length = length;
+    template->fields = 0;
+    
+    for (uint8_t i = 0; i < length; i++) {
+        if (NETWORK_PAYLOAD_BYTE(payload, address, i) != '{') {
+            continue;
+        }
+        
+        char name[NETWORK_PLACEHOLDER_LENGTH];
+        uint8_t end = i + 1;
+        uint8_t n = 0;
+        char c = '\0';
+        while ((end < length) && (n <= NETWORK_PLACEHOLDER_LENGTH)) {
+            c = NETWORK_PAYLOAD_BYTE(payload, address, end);
+            if (c == '}') {
+                break;
+            }
+            if (n < NETWORK_PLACEHOLDER_LENGTH) {
+                name[n] = c;
+            }
+            n++;
+            end++;
+        }
+        if ((c != '}') || (n == 0) || (n > NETWORK_PLACEHOLDER_LENGTH)) {
+            continue;
+        }
+        
+        struct network_template_field field;
+        uint8_t result = network_parse_placeholder(name, n, &field);
+        if ((result == NETWORK_PLACEHOLDER_INVALID) ||
+            ((result == NETWORK_PLACEHOLDER_FIELD) && (template->fields == NETWORK_TEMPLATE_FIELDS))) {
+            valid = false;
+        } else if (result == NETWORK_PLACEHOLDER_FIELD) {
+            field.offset = i;
+            template->field[template->fields++] = field;
+            i = end;
+        }
+    }
+    return valid;
+}
+
+uint8_t network_count_placeholders (const char *payload, uint8_t length)
+{
+    struct network_template template;
+    if (!network_find_placeholders(payload, 0, length, &template)) {
+        return NETWORK_TEMPLATE_FIELDS + 1;
+    }
+    return template.fields;
+}
+
+uint32_t network_int_placeholder (const char *name, uint8_t length)
+{
+    uint8_t variable = network_placeholder_variable(name, length);
+    if (variable == NETWORK_VAR_COUNT) {
+        return 0;
+    }
+    return ((uint32_t)'{' << 24) | ((uint32_t)'#' << 16) | ((uint16_t)('0' + variable) << 8) | '}';
+}
+
+bool network_compile_payloads (void)
+{
+    bool valid = true;
+    for (uint8_t event = 0; event < 4; event++) {
+        uint16_t address = pgm_read_word(&network_payloads[event].address);
+        uint8_t length = eeprom_read_byte((const uint8_t *)pgm_read_word(&network_payloads[event].length_address));
+        if (length > NETWORK_PAYLOAD_LENGTH) {
+            length = NETWORK_PAYLOAD_LENGTH;
+        }
+        valid &= network_find_placeholders(NULL, address, length, &network_templates[event]);
+    }
+    return valid;
+}
+
+/**
+ *  Starts a packet to the target and copies the payload of a trigger event into it
+ *  @param edge The trigger event
+ *  @param seq The sequence number
+ *  @param length Filled in with the length of the packet
+ *  @return false if the packet could not be started
+ */
+static bool network_build_trigger (const struct network_edge *edge, uint16_t seq, size_t *length)
+{
+    uint8_t* buffer;
+    size_t buffer_size;
+    if (!udp_start_packet(eos_connection, &buffer, &buffer_size)) {
+        return false;
+    }
+    
+    size_t header_length = 0;
+    if (network_sequenced) {
+        buffer[0] = NETWORK_RELIABLE_MAGIC;
+        buffer[1] = NETWORK_RELIABLE_DATA;
+        buffer[2] = seq >> 8;
+        buffer[3] = seq;
+        header_length = NETWORK_RELIABLE_HEADER_LENGTH;
+        buffer += header_length;
+    }
+    
+    // Each value takes up exactly the bytes of its placeholder, so the payload is copied as a whole and only the values
+    // are written over it at the offsets found by network_compile_payloads
+    const struct network_template *template = &network_templates[edge->event];
+    eeprom_read_block(buffer, (const void *)pgm_read_word(&network_payloads[edge->event].address), template->length);
+    
+    for (uint8_t i = 0; i < template->fields; i++) {
+        const struct network_template_field *field = &template->field[i];
+        uint8_t *p = buffer + field->offset;
+        
+        uint32_t value;
+        switch (field->variable) {
+            case NETWORK_VAR_SEQ:
+                value = seq;
+                break;
+            case NETWORK_VAR_MS:
+                value = edge->time;
+                break;
+            default:
+                value = (edge->inputs >> (field->variable - NETWORK_VAR_T1)) & 1;
+                break;
+        }
+        
+        if (field->width == 0) {
+            p[0] = value >> 24;
+            p[1] = value >> 16;
+            p[2] = value >> 8;
+            p[3] = value;
+            continue;
+        }
+        for (uint8_t j = field->width; j != 0; j--) {
+            p[j - 1] = '0' + (value % 10);
+            value /= 10;
+        }
+    }
+    
+    *length = header_length + template->length;
+    return true;
+}
+
+/**
+ *  Sends the payload of a trigger event
+ *  @param edge The trigger event
+ *  @return false if the MAC address of the primary target is not known yet and the trigger has to wait
+ */
+static bool network_send_trigger (const struct network_edge *edge)
+{
+    // The packet is built on the connection to the primary target, its MAC address has to be known
+    if (!ethernet_arp_lookup(network_failover_ip(network_on_backup))) {
+        return false;
+    }
+    
+    uint32_t ips[NETWORK_TARGET_COUNT];
+    uint8_t count = 0;
+    uint8_t mask = eeprom_read_byte((const uint8_t *)(SETTING_T_TARGETS + edge->event));
+    for (uint8_t i = 0; i < NETWORK_TARGET_COUNT; i++) {
+        if ((mask & (1<<i)) && network_target_valid(i)) {
+            if (i == 0) {
+                ips[count++] = network_failover_ip(network_on_backup);
+            } else if (ethernet_arp_lookup(network_targets[i])) {
+                ips[count++] = network_targets[i];
+            } else {
+                // Without its MAC address the copy would be broadcast, it is left out until the reply has arrived
+                network_link_stats.unresolved++;
+            }
+        }
+    }
+    if (count == 0) {
+        return true;
+    }
+    
+    uint16_t seq = ++network_seq;
+    size_t length;
+    if (!network_build_trigger(edge, seq, &length)) {
+        return true;
+    }
+#ifdef IMPLEMENT_REPEAT
+    if (network_burst_count > 1) {
+        if (network_burst_remaining != 0) {
+            network_delivery_stats.bursts_cut++;
+        }
+        udp_send_repeatable(length, ips, count);
+        memcpy(network_burst_ips, ips, sizeof(ips[0]) * count);
+        network_burst_targets = count;
+        network_burst_remaining = network_burst_count - 1;
+        network_burst_time = millis;
+        network_delivery_stats.bursts++;
+    } else {
+        udp_send_multiple(length, ips, count);
+    }
+#else
+    udp_send_multiple(length, ips, count);
+#endif // IMPLEMENT_REPEAT
+    
+    // Only the first target is tracked, see network.h
+    if (network_reliable && (mask & 1) && network_target_valid(0)) {
+        struct network_unacked_trigger *unacked = &network_unacked[seq & (NETWORK_RELIABLE_WINDOW - 1)];
+        if (unacked->sends != 0) {
+            // The window is full, the oldest payload is given up
+            network_delivery_stats.abandoned++;
+        }
+        unacked->seq = seq;
+        unacked->edge = *edge;
+        unacked->sends = 1;
+        unacked->time = millis;
+        unacked->timeout = network_delivery_stats.rto;
+        network_delivery_stats.sent++;
+    }
+    return true;
+}
+
+/**
+ *  Sends a payload again whose acknowledgment is overdue, or gives it up after the last retry
+ */
+static void network_retransmit (void)
+{
+    for (uint8_t i = 0; i < NETWORK_RELIABLE_WINDOW; i++) {
+        struct network_unacked_trigger *unacked = &network_unacked[i];
+        if ((unacked->sends == 0) || ((millis - unacked->time) < unacked->timeout)) {
+            continue;
+        }
+        
+        if (unacked->sends > network_reliable_retries) {
+            unacked->sends = 0;
+            network_delivery_stats.abandoned++;
+            continue;
+        }
+        
+        size_t length;
+        if (network_build_trigger(&unacked->edge, unacked->seq, &length)) {
+            udp_send(length);
+        }
+        unacked->sends++;
+        unacked->time = millis;
+        unacked->timeout = (unacked->timeout < (NETWORK_RTO_MAX / 2)) ? (unacked->timeout * 2) : NETWORK_RTO_MAX;
+        network_delivery_stats.retransmissions++;
+        
+        // One per iteration, so that the main loop is not held up
+        return;
+    }
+}
+
+/**
+ *  Checks if a queued trigger is to be replayed according to the replay policy
+ *  @param index The position of the trigger in the queue
+ *  @return true if the trigger should be sent
+ */
+static bool network_should_replay (uint8_t index)
+{
+    const struct network_edge *trigger = &network_trigger_queue[index & (NETWORK_TRIGGER_QUEUE_LENGTH - 1)];
+    
+    switch (eeprom_read_byte(SETTING_REPLAY_POLICY)) {
+        case NETWORK_REPLAY_LATEST:
+            // Skip the edge if the same input changed again later, only its final state matters
+            for (uint8_t i = index + 1; i != network_trigger_insert_p; i++) {
+                uint8_t later = network_trigger_queue[i & (NETWORK_TRIGGER_QUEUE_LENGTH - 1)].event;
+                if ((later >> 1) == (trigger->event >> 1)) {
+                    return false;
+                }
+            }
+            return true;
+        case NETWORK_REPLAY_MAX_AGE:
+            return (millis - trigger->time) <= eeprom_read_word(SETTING_REPLAY_MAX_AGE);
+        default:
+            return true;
+    }
+}
+
+void network_trigger (uint8_t event, uint8_t inputs)
+{
+    struct network_edge edge = {.event = event, .inputs = inputs, .time = millis};
+    
+    // Sent straight away unless earlier triggers are still waiting, so that the order is kept
+    if ((flags & (1<<FLAG_ONLINE)) && (network_trigger_insert_p == network_trigger_withdraw_p) &&
+        network_send_trigger(&edge)) {
+        return;
+    }
+    
+    if ((uint8_t)(network_trigger_insert_p - network_trigger_withdraw_p) == NETWORK_TRIGGER_QUEUE_LENGTH) {
+        // Full, the oldest trigger is the least likely to still matter
+        network_trigger_withdraw_p++;
+        network_trigger_overflows++;
+    }
+    
+    network_trigger_queue[network_trigger_insert_p & (NETWORK_TRIGGER_QUEUE_LENGTH - 1)] = edge;
+    network_trigger_insert_p++;
+}
+
+uint8_t network_get_queued_triggers (void)
+{
+    return network_trigger_insert_p - network_trigger_withdraw_p;
+}
+
+uint16_t network_get_trigger_overflows (void)
+{
+    return network_trigger_overflows;
+}
+
 uint32_t network_get_ip_addr()
 {
     return ethernet_get_ip();
@@ -128,8 +1044,119 @@ uint32_t network_get_netmask()
     return ethernet_get_netmask();
 }
 
+void reinit_network (void)
+{
+    arp_table_initialise();
+    network_link_up_time = millis;
+    network_restart();
+}
+
+const struct network_link_statistics *network_get_link_statistics (void)
+{
+    return &network_link_stats;
+}
+
+const struct network_delivery_statistics *network_get_delivery_statistics (void)
+{
+    return &network_delivery_stats;
+}
+
+void network_reset_statistics (void)
+{
+    // srtt and rto are the current estimates rather than counters, rto is also used to time retransmissions
+    uint16_t srtt = network_delivery_stats.srtt;
+    uint16_t rto = network_delivery_stats.rto;
+    
+    memset(&network_link_stats, 0, sizeof(network_link_stats));
+    memset(&network_delivery_stats, 0, sizeof(network_delivery_stats));
+    network_delivery_stats.srtt = srtt;
+    network_delivery_stats.rto = rto;
+}
+
+uint8_t network_is_on_backup (void)
+{
+    return network_on_backup;
+}
+
+/**
+ *  Asks for the MAC addresses of the targets before their ARP entries expire, so that payloads never wait for ARP,
+ *  and starts over if the active target has stopped answering
+ */
+static void network_refresh_arp (void)
+{
+    for (uint8_t i = 1; i < NETWORK_TARGET_COUNT; i++) {
+        if (network_target_valid(i)) {
+            ethernet_arp_lookup(network_targets[i]);
+        }
+    }
+    
+    if (ethernet_arp_lookup(network_failover_ip(network_on_backup))) {
+        network_target_seen = millis;
+    } else if ((millis - network_target_seen) > NETWORK_TARGET_TIMEOUT) {
+        network_link_up_time = millis;
+        network_restart();
+    }
+}
+
 void network_service (void)
 {
+#ifndef HANDLE_LINK_STATUS_CHANGES
+    if ((millis - network_link_poll_time) >= NETWORK_LINK_POLL_INTERVAL) {
+        network_link_poll_time = millis;
+        if (ethernet_get_link_status() != network_link_up) {
+            network_link_status_changed(!network_link_up);
+        }
+    }
+#endif // HANDLE_LINK_STATUS_CHANGES
+    
+    if ((flags & (1<<FLAG_ONLINE)) && !udp_table_is_valid_socket(eos_connection)) {
+        // Switching between the primary and the backup target can fail to open the connection, resolve it again
+        network_link_up_time = millis;
+        network_restart();
+    }
+    
+    if ((flags & (1<<FLAG_ONLINE)) && ((millis - network_arp_time) >= NETWORK_ARP_REFRESH_INTERVAL)) {
+        network_arp_time = millis;
+        network_refresh_arp();
+    }
+    
+    if (!(flags & (1<<FLAG_ONLINE))) {
+        network_connect_thread(&network_thread);
+    } else {
+#ifdef IMPLEMENT_ICMP
+        if (network_backup_valid()) {
+            network_probe(&network_probe_thread);
+        }
+#endif // IMPLEMENT_ICMP
+        
+        if (network_on_backup && ((millis - network_blink_time) >= NETWORK_BACKUP_BLINK_PERIOD)) {
+            network_blink_time = millis;
+            STAT_TWO_PORT ^= (1<<STAT_TWO_NUM);
+        }
+        
+        if (network_reliable) {
+            network_retransmit();
+        }
+        
+#ifdef IMPLEMENT_REPEAT
+        if ((network_burst_remaining != 0) && ((millis - network_burst_time) >= network_burst_gap)) {
+            network_burst_time = millis;
+            network_burst_remaining--;
+            udp_repeat(network_burst_ips, network_burst_targets);
+            network_delivery_stats.burst_copies++;
+        }
+#endif // IMPLEMENT_REPEAT
+        
+        if (network_trigger_insert_p != network_trigger_withdraw_p) {
+            // Replay one queued trigger per iteration, so that new triggers are not held up by a long queue
+            // A trigger stays queued while the MAC address of the target is being looked up again
+            uint8_t index = network_trigger_withdraw_p;
+            if (!network_should_replay(index) ||
+                network_send_trigger(&network_trigger_queue[index & (NETWORK_TRIGGER_QUEUE_LENGTH - 1)])) {
+                network_trigger_withdraw_p++;
+            }
+        }
+    }
     ethernet_update();
 }
 
@@ -138,3 +1165,13 @@ ISR(TIMER1_COMPA_vect)
 {
     ethernet_second_tick();
 }
+
+#ifdef USE_INTERRUPTS
+ISR(ENC_INT_vect)
+{
+    // Only the falling edge matters, INT stays low until ethernet_update has serviced the controller
+    if (!(ENC_INT_PIN & (1<<ENC_INT_NUM))) {
+        ethernet_data_interrupt();
+    }
+}
+#endif // USE_INTERRUPTS
@@ -13,19 +13,199 @@
 
 #endif /* network_h */
 
+// MARK: Trigger events
+// The payload of each event is stored in EEPROM, see SETTING_T_*. Bit 1 identifies the trigger input.
+#define NETWORK_TRIGGER_ONE_RISE    0
+#define NETWORK_TRIGGER_ONE_FALL    1
+#define NETWORK_TRIGGER_TWO_RISE    2
+#define NETWORK_TRIGGER_TWO_FALL    3
+
+// MARK: Targets
+// Payloads can be sent to up to NETWORK_TARGET_COUNT targets on SETTING_TARGET_PORT: SETTING_TARGET_IP and the ones in
+// SETTING_TARGET_IPS. Bit n of the mask of each trigger event in SETTING_T_TARGETS selects target n + 1, by default
+// (0xFF) events are sent to all targets. The payload is built once and only readdressed for each further target.
+// Further targets are kept in the ARP table in the background, a copy for one that has not answered ARP is left out
+// and counted in network_link_statistics.unresolved rather than broadcast.
+#define NETWORK_TARGET_COUNT        4
+
+// MARK: Failover
+// If a backup target is configured (SETTING_BACKUP_IP), the primary target (SETTING_TARGET_IP) and the backup are
+// pinged every SETTING_PROBE_INTERVAL ms while online. Once the primary has missed SETTING_PROBE_LIMIT probes in a row
+// and the backup is answering, payloads for the primary are sent to the backup instead, so failover happens at most
+// (SETTING_PROBE_LIMIT + 1) * SETTING_PROBE_INTERVAL ms after the primary last answered. If SETTING_FAILBACK is 1,
+// payloads go back to the primary once it has answered SETTING_PROBE_LIMIT probes in a row. Should the backup stop
+// answering while the primary answers, payloads go back to the primary in the same way as on a failover.
+// STAT_TWO is off while offline, on while sending to the primary and blinks while sending to the backup.
+#define NETWORK_DEFAULT_PROBE_INTERVAL  250
+#define NETWORK_DEFAULT_PROBE_LIMIT     3
+
+// MARK: Reliable delivery
+// If SETTING_RELIABLE is 1 or payloads are sent in bursts, every payload is preceded by a header with a sequence number.
+// In reliable mode the receiver acknowledges it by sending the header back with NETWORK_RELIABLE_ACK to the port the
+// payload came from:
+//      payload:        [NETWORK_RELIABLE_MAGIC] [NETWORK_RELIABLE_DATA] [sequence high] [sequence low] [payload ...]
+//      acknowledgment: [NETWORK_RELIABLE_MAGIC] [NETWORK_RELIABLE_ACK] [sequence high] [sequence low]
+// Payloads which are not acknowledged are sent again after a retransmission timeout that follows the round trip time as
+// in RFC 6298 (but with the bounds in NETWORK_RTO_*, as targets are on the local network) and doubles with every retry,
+// up to SETTING_RELIABLE_RETRIES times. The receiver has to acknowledge every copy, but pass on only the first one: it
+// should keep the sequence numbers of at least the last NETWORK_RELIABLE_WINDOW payloads to drop retransmissions.
+// Only the primary target (or the backup after a failover) is tracked. Further targets get the same header, but no
+// retransmissions.
+#define NETWORK_RELIABLE_MAGIC      0xE5
+#define NETWORK_RELIABLE_DATA       'D'
+#define NETWORK_RELIABLE_ACK        'A'
+#define NETWORK_RELIABLE_HEADER_LENGTH 4
+#define NETWORK_RELIABLE_WINDOW     4       // Payloads awaiting acknowledgment, must be a power of two
+#define NETWORK_DEFAULT_RETRIES     4
+#define NETWORK_RTO_INITIAL         200     // ms, until the first round trip time has been measured
+#define NETWORK_RTO_MIN             10
+#define NETWORK_RTO_MAX             2000
+
+// MARK: Bursts
+// Where acknowledgments are not possible, each payload can be sent SETTING_BURST_COUNT times, SETTING_BURST_GAP ms apart.
+// All copies carry the same sequence number (see above), the receiver passes on only the first one it gets. The copies
+// are sent by network_service from the frame that is kept in the ethernet controller, the payload is not built again.
+// A trigger during a burst cuts it short, as only the latest frame is kept.
+#define NETWORK_DEFAULT_BURST_GAP   5
+
+// MARK: Payload templates
+// Payloads may contain placeholders which are filled in when they are sent:
+//      {seq}   The sequence number of the trigger (as in the header for reliable delivery)
+//      {ms}    When the edge happened, in ms since startup
+//      {t1}    The state of input one at the time of the edge, 1 for on
+//      {t2}    The state of input two
+// A value takes up exactly the bytes of its placeholder, so payloads keep their length and layout. Values are written
+// as zero padded decimal numbers with as many digits as the placeholder has characters, higher digits are dropped:
+// {seq} gives 5 digits and {t1} 4, underscores after the name add digits, as in {ms______} for 10. {#N} is replaced by
+// the 32 bit big endian integer of variable N (0 seq, 1 ms, 2 t1, 3 t2), as for an OSC int32 argument. Payloads are
+// compiled by network_compile_payloads into the offset and format of each placeholder, so sending one only takes
+// copying it and writing the values over the placeholders. Placeholders with unknown names are sent as they are. A
+// payload with more than NETWORK_TEMPLATE_FIELDS placeholders is rejected when it is set.
+#define NETWORK_TEMPLATE_FIELDS     4
+
+// MARK: Replay policies
+// How triggers that were queued while offline are replayed once the network is back (SETTING_REPLAY_POLICY)
+#define NETWORK_REPLAY_ALL          0       // Every trigger, in order
+#define NETWORK_REPLAY_LATEST       1       // Only the last edge of each trigger input
+#define NETWORK_REPLAY_MAX_AGE      2       // Only triggers younger than SETTING_REPLAY_MAX_AGE milliseconds
+
+// MARK: Quality of service
+// Payloads are marked with SETTING_TARGET_DSCP and sent ahead of any other queued frames (DHCP, ARP, console, ...)
+// If frames are tagged for a VLAN (SETTING_VLAN_ID), payloads carry the priority SETTING_TARGET_PCP and all other
+// frames SETTING_VLAN_PCP.
+#define NETWORK_DEFAULT_DSCP        46      // Expedited forwarding
+#define NETWORK_DEFAULT_PCP         0       // Best effort
+#define NETWORK_DEFAULT_TARGET_PCP  5       // Voice, the class usually mapped to expedited forwarding
+
 /**
  *  Initilize the network interface
- *  @return 0 If init was sucessfull, -1 otherwise
+ *  Link, DHCP and the connection to the target are brought up in the background by network_service, FLAG_ONLINE is
+ *  set once they are done.
  */
-extern int init_network (void);
+extern void init_network (void);
+
+struct network_link_statistics {
+    uint16_t losses;                                // The number of times the link went down
+    uint32_t last_recovery;                         // ms from the link coming up until the target was reachable
+    uint32_t max_recovery;
+    uint16_t failovers;                             // The number of times payloads were moved to the backup target
+    uint16_t failbacks;
+    uint32_t last_failover;                         // ms from the last answer of the primary until the failover
+    uint32_t max_failover;
+    uint16_t unresolved;                            // Copies for other targets left out as their MAC address was unknown
+};
 
 /**
  *  Reinitialize the network
+ *  The ARP table is flushed and the connection to the target is brought up again, a DHCP lease is revalidated.
  */
 extern void reinit_network (void);
 
+/**
+ *  Gets the link statistics
+ *  @return The statistics
+ */
+extern const struct network_link_statistics *network_get_link_statistics (void);
+
+struct network_delivery_statistics {
+    uint32_t sent;                                  // Payloads sent with reliable delivery
+    uint32_t acknowledged;
+    uint32_t retransmissions;
+    uint32_t abandoned;                             // Given up after all retries, or while the network was down
+    uint32_t duplicate_acks;                        // Acknowledgments for payloads which are no longer outstanding
+    uint16_t srtt;                                  // Smoothed round trip time in ms
+    uint16_t rto;                                   // Current retransmission timeout in ms
+    uint32_t bursts;
+    uint32_t burst_copies;                          // Copies sent after the first one
+    uint16_t bursts_cut;                            // Bursts cut short by the next trigger
+};
+
+/**
+ *  Gets the reliable delivery statistics
+ *  @return The statistics
+ */
+extern const struct network_delivery_statistics *network_get_delivery_statistics (void);
+
+/**
+ *  Clears the link and delivery counters, the round trip time estimates are kept
+ */
+extern void network_reset_statistics (void);
+
+/**
+ *  Determin if payloads for the primary target are currently sent to the backup target
+ *  @return 1 after a failover, 0 otherwise
+ */
+extern uint8_t network_is_on_backup (void);
+
 extern int network_send_packet (char *source, int length);
 
+/**
+ *  Sends the payload of a trigger event to its targets
+ *  @note If the network is not online, or older triggers are still waiting, the event is queued with a timestamp and
+ *        replayed in order by network_service according to the replay policy. If the queue is full, the oldest event
+ *        is dropped.
+ *  @param event The trigger event, one of NETWORK_TRIGGER_*
+ *  @param inputs The state of the inputs after the edge, bit 0 for input one and bit 1 for input two, set while on
+ */
+extern void network_trigger (uint8_t event, uint8_t inputs);
+
+/**
+ *  Counts the placeholders of a payload, or of a part of it, to check them before it is stored
+ *  @param payload The payload
+ *  @param length The length of the payload
+ *  @return The number of placeholders, more than NETWORK_TEMPLATE_FIELDS if there are too many or one of them names a
+ *          variable in a wrong format
+ */
+extern uint8_t network_count_placeholders (const char *payload, uint8_t length);
+
+/**
+ *  Gets the placeholder of the 32 bit integer of a variable
+ *  @param name The name of the variable, not nul terminated
+ *  @param length The length of the name
+ *  @return The four bytes of the placeholder, as a big endian word, 0 if there is no variable of that name
+ */
+extern uint32_t network_int_placeholder (const char *name, uint8_t length);
+
+/**
+ *  Compiles the placeholders of all payloads, to be called whenever a payload has been changed
+ *  @note Of a payload with too many or wrong placeholders (see network_count_placeholders), those which can be filled
+ *        in are, up to NETWORK_TEMPLATE_FIELDS, the rest is sent as it is
+ *  @return false if one of the payloads has too many or wrong placeholders
+ */
+extern bool network_compile_payloads (void);
+
+/**
+ *  Gets the number of trigger events waiting to be sent
+ *  @return The number of queued events
+ */
+extern uint8_t network_get_queued_triggers (void);
+
+/**
+ *  Gets the number of trigger events which were dropped because the queue was full
+ *  @return The number of dropped events
+ */
+extern uint16_t network_get_trigger_overflows (void);
+
 /**
  *  Sends a packet to the console
  *  @param address The address of the data in EEPROM
@@ -53,6 +233,6 @@ extern uint32_t network_get_router_addr(void);
 extern uint32_t network_get_netmask(void);
 
 /**
- *  Network actions to be performed in each main loop
+ *  Network actions to be performed in each main loop, never blocks
  */
 extern void network_service (void);
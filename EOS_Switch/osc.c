@@ -0,0 +1,391 @@
+//
+//  osc.c
+//  EOS_Switch
+//
+//  Copyright © 2017 Samuel Dewan. All rights reserved.
+//
+
+#include "osc.h"
+
+#include "network.h"
+
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <errno.h>
+#include <stdlib.h>
+
+// MARK: Constants
+static const char osc_bundle_string[] PROGMEM = "#bundle";
+
+// MARK: Types
+struct osc_token {
+    const char *start;                              // NULL at the end of a message
+    const char *end;
+    uint8_t quoted;
+};
+
+union osc_value {
+    int32_t i;
+    uint32_t word;                                  // float32 arguments are built bit by bit, see osc_parse_float
+};
+
+// MARK: Variables
+// The text is encoded twice, first only to find the length and check it, then to write it to EEPROM
+static uint16_t osc_address;
+static uint8_t osc_size;
+static uint16_t osc_length;                         // The length so far, may pass osc_size while measuring
+static uint8_t osc_writing;
+static uint8_t osc_placeholders;                    // The number of placeholders so far
+
+// MARK: Output
+static void osc_put (uint8_t byte)
+{
+    if (osc_writing && (osc_length < osc_size)) {
+        eeprom_update_byte((uint8_t *)(osc_address + osc_length), byte);
+    }
+    osc_length++;
+}
+
+static void osc_put_word (uint32_t word)
+{
+    osc_put(word >> 24);
+    osc_put(word >> 16);
+    osc_put(word >> 8);
+    osc_put(word);
+}
+
+/**
+ *  Writes the nul terminator of a string and pads it to a multiple of four bytes
+ */
+static void osc_put_terminator (void)
+{
+    do {
+        osc_put('\0');
+    } while (osc_length & 3);
+}
+
+static void osc_put_string (const char *start, const char *end)
+{
+    uint8_t placeholders = network_count_placeholders(start, end - start);
+    osc_placeholders += (placeholders > NETWORK_TEMPLATE_FIELDS) ? (NETWORK_TEMPLATE_FIELDS + 1) : placeholders;
+    
+    while (start != end) {
+        osc_put(*start++);
+    }
+    osc_put_terminator();
+}
+
+// MARK: Parsing
+/**
+ *  Converts a fraction to the bits of the nearest float32 by long division, so that the floating point library is not
+ *  needed
+ *  @param numerator Not 0, below 2^30
+ *  @param denominator Not 0, below 2^30
+ */
+static uint32_t osc_float_bits (uint32_t numerator, uint32_t denominator)
+{
+    int8_t exponent = 0;
+    uint32_t mantissa = 0;
+
+    // Scale until the quotient is in [1, 2)
+    while (numerator < denominator) {
+        numerator <<= 1;
+        exponent--;
+    }
+    while (numerator >= (denominator << 1)) {
+        denominator <<= 1;
+        exponent++;
+    }
+
+    // 24 bits of mantissa and one to round with, the remainder decides ties
+    for (uint8_t i = 0; i < 25; i++) {
+        mantissa <<= 1;
+        if (numerator >= denominator) {
+            numerator -= denominator;
+            mantissa |= 1;
+        }
+        numerator <<= 1;
+    }
+    uint8_t round = mantissa & 1;
+    mantissa >>= 1;
+    if (round && ((numerator != 0) || (mantissa & 1))) {
+        mantissa++;
+        if (mantissa == (1UL << 24)) {
+            mantissa >>= 1;
+            exponent++;
+        }
+    }
+    return ((uint32_t)(exponent + 127) << 23) | (mantissa & 0x7FFFFF);
+}
+
+/**
+ *  Parses a decimal fraction such as -12.75
+ *  @param value Filled in with the float32 bits
+ *  @return 1 if the token is a number of at most 9 digits without an exponent, 0 otherwise
+ */
+static uint8_t osc_parse_float (const struct osc_token *token, union osc_value *value)
+{
+    const char *p = token->start;
+    uint32_t sign = 0;
+    uint32_t numerator = 0;
+    uint32_t denominator = 1;
+    uint8_t digits = 0;
+    uint8_t point = 0;
+
+    if ((*p == '-') || (*p == '+')) {
+        sign = (*p == '-') ? 0x80000000UL : 0;
+        p++;
+    }
+    for (; p != token->end; p++) {
+        if ((*p == '.') && !point) {
+            point = 1;
+        } else if ((*p >= '0') && (*p <= '9') && (digits < 9)) {
+            numerator = (numerator * 10) + (*p - '0');
+            if (point) {
+                denominator *= 10;
+            }
+            digits++;
+        } else {
+            return 0;
+        }
+    }
+    if (digits == 0) {
+        return 0;
+    }
+
+    value->word = sign | ((numerator != 0) ? osc_float_bits(numerator, denominator) : 0);
+    return 1;
+}
+
+/**
+ *  Checks whether a token is written as a number (digits with an optional sign, point and exponent), such tokens are
+ *  never sent as strings
+ */
+static uint8_t osc_is_number (const struct osc_token *token)
+{
+    const char *p = token->start;
+    uint8_t digits = 0;
+    uint8_t points = 0;
+
+    if ((*p == '-') || (*p == '+')) {
+        p++;
+    }
+    for (; (p != token->end) && (((*p >= '0') && (*p <= '9')) || (*p == '.')); p++) {
+        if (*p == '.') {
+            points++;
+        } else {
+            digits++;
+        }
+    }
+    if (points > 1) {
+        return 0;
+    }
+    if ((digits == 0) || (p == token->end)) {
+        return digits != 0;
+    }
+    if ((*p != 'e') && (*p != 'E')) {
+        return 0;
+    }
+    p++;
+    if ((p != token->end) && ((*p == '-') || (*p == '+'))) {
+        p++;
+    }
+    if (p == token->end) {
+        return 0;
+    }
+    for (; p != token->end; p++) {
+        if ((*p < '0') || (*p > '9')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ *  Finds the next token of a message
+ *  @param p Where to start looking
+ *  @param token Filled in with the token, start is NULL if the message has ended
+ *  @return Where to continue
+ */
+static const char *osc_next_token (const char *p, struct osc_token *token)
+{
+    while (*p == ' ') {
+        p++;
+    }
+    if ((*p == '\0') || (*p == ';')) {
+        token->start = NULL;
+        return p;
+    }
+
+    token->quoted = (*p == '"');
+    if (token->quoted) {
+        // A missing closing quote ends the string at the end of the line
+        token->start = ++p;
+        while ((*p != '"') && (*p != '\0')) {
+            p++;
+        }
+        token->end = p;
+        return (*p == '"') ? p + 1 : p;
+    }
+
+    token->start = p;
+    while ((*p != ' ') && (*p != ';') && (*p != '\0')) {
+        p++;
+    }
+    token->end = p;
+    return p;
+}
+
+/**
+ *  Determins the type of an argument
+ *  @param token The argument
+ *  @param value Filled in with the value of numbers
+ *  @return The OSC type tag, 0 for numbers which can't be encoded (out of range, exponent or more than 9 digits)
+ */
+static char osc_argument_type (const struct osc_token *token, union osc_value *value)
+{
+    char *end;
+
+    if (token->quoted) {
+        return 's';
+    }
+
+    // {name:i}, the integer placeholder is counted when it is written
+    uint8_t length = token->end - token->start;
+    if ((length > 4) && (token->start[0] == '{') && !strncmp_P(token->end - 3, PSTR(":i}"), 3)) {
+        value->word = network_int_placeholder(token->start + 1, length - 4);
+        if (value->word != 0) {
+            return 'i';
+        }
+    }
+
+    errno = 0;
+    long number = strtol(token->start, &end, 10);
+    if ((end == token->end) && (errno == 0) && (number >= INT32_MIN) && (number <= INT32_MAX)) {
+        value->i = number;
+        return 'i';
+    }
+    if (osc_parse_float(token, value)) {
+        return 'f';
+    }
+    // Sending these as strings would give the receiver the wrong type
+    return osc_is_number(token) ? 0 : 's';
+}
+
+/**
+ *  Encodes one message
+ *  @param p The text of the message
+ *  @return The end of the message, NULL if it is not valid
+ */
+static const char *osc_encode_message (const char *p)
+{
+    struct osc_token token;
+    union osc_value value;
+
+    p = osc_next_token(p, &token);
+    if ((token.start == NULL) || token.quoted || (*token.start != '/')) {
+        return NULL;
+    }
+    osc_put_string(token.start, token.end);
+
+    // The type tags come first, so the arguments are gone through twice
+    osc_put(',');
+    const char *arguments = p;
+    for (p = osc_next_token(p, &token); token.start != NULL; p = osc_next_token(p, &token)) {
+        char type = osc_argument_type(&token, &value);
+        if (type == 0) {
+            return NULL;
+        }
+        osc_put(type);
+    }
+    osc_put_terminator();
+
+    for (p = osc_next_token(arguments, &token); token.start != NULL; p = osc_next_token(p, &token)) {
+        if (osc_argument_type(&token, &value) == 's') {
+            osc_put_string(token.start, token.end);
+        } else {
+            osc_placeholders += (token.start[0] == '{');
+            osc_put_word(value.word);
+        }
+    }
+    return p;
+}
+
+/**
+ *  Encodes all messages
+ *  @param text The text of the messages
+ *  @param bundle 1 to put the messages into a bundle
+ *  @return The number of messages, 0 if one of them is not valid
+ */
+static uint8_t osc_encode_messages (const char *text, uint8_t bundle)
+{
+    uint8_t count = 0;
+
+    osc_length = 0;
+    osc_placeholders = 0;
+    if (bundle) {
+        for (const char *c = osc_bundle_string; pgm_read_byte(c) != '\0'; c++) {
+            osc_put(pgm_read_byte(c));
+        }
+        osc_put_terminator();
+        osc_put_word(0);                            // Time tag 1, which means immediately
+        osc_put_word(1);
+    }
+
+    while (1) {
+        uint16_t start = osc_length;
+        if (bundle) {
+            osc_put_word(0);                        // The size of the element, filled in once it is known
+        }
+
+        text = osc_encode_message(text);
+        if (text == NULL) {
+            return 0;
+        }
+        count++;
+
+        if (bundle) {
+            uint16_t end = osc_length;
+            osc_length = start;
+            osc_put_word(end - start - 4);
+            osc_length = end;
+        }
+
+        // A trailing semicolon does not start another message
+        if (*text == ';') {
+            text++;
+        }
+        while (*text == ' ') {
+            text++;
+        }
+        if (*text == '\0') {
+            return count;
+        }
+    }
+}
+
+// MARK: Functions
+uint8_t osc_encode (const char *text, uint16_t address, uint8_t size)
+{
+    osc_address = address;
+    osc_size = size;
+    osc_writing = 0;
+
+    uint8_t count = osc_encode_messages(text, 0);
+    if (count == 0) {
+        return 0;
+    }
+
+    uint8_t bundle = (count > 1);
+    if (bundle) {
+        osc_encode_messages(text, 1);
+    }
+    if ((osc_length > size) || (osc_placeholders > NETWORK_TEMPLATE_FIELDS)) {
+        return 0;
+    }
+
+    osc_writing = 1;
+    osc_encode_messages(text, bundle);
+    osc_writing = 0;
+    return osc_length;
+}
@@ -0,0 +1,43 @@
+//
+//  osc.h
+//  EOS_Switch
+//
+//  Copyright © 2017 Samuel Dewan. All rights reserved.
+//
+
+#ifndef osc_h
+#define osc_h
+
+#include "global.h"
+
+// Encoder for Open Sound Control messages, so that payloads for Eos can be entered as text and are stored in EEPROM
+// ready to be sent.
+//
+// A message is written as its address followed by its arguments, separated by spaces:
+//      /eos/cue/1/5/fire
+//      /eos/chan/101 50
+//      /eos/cmd "Chan 1 At Full#"
+// Arguments are int32 if they are whole numbers, float32 if they are decimal fractions (at most 9 digits, no exponent,
+// such as -12.75) and strings otherwise. Other numbers (exponents, more digits or out of the int32 range) are rejected
+// rather than sent as strings. Strings which contain spaces or semicolons, or which would be taken for numbers, are
+// quoted.
+//
+// Placeholders (see network.h) in the address and in strings are kept as they are, they don't change the length of the
+// string. An argument {name:i} is an int32 placeholder for the variable, which is stored as {#N} in its four bytes:
+//      /eos/key {seq:i}
+//
+// Several messages separated by ';' are put into one bundle with the time tag "immediately", so actions which fire
+// together are sent in a single datagram and executed together by the console.
+
+/**
+ *  Encodes OSC messages into EEPROM
+ *  @note Nothing is written if the text can not be encoded
+ *  @param text The nul terminated messages
+ *  @param address Where the encoded messages are written to in EEPROM
+ *  @param size The space avaliable at address
+ *  @return The length of the encoded messages, 0 if the text is no valid message, the messages do not fit or have
+ *          more than NETWORK_TEMPLATE_FIELDS placeholders
+ */
+extern uint8_t osc_encode (const char *text, uint16_t address, uint8_t size);
+
+#endif /* osc_h */
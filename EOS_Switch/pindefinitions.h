@@ -27,6 +27,22 @@
 #define STAT_TWO_PORT       PORTC
 #define STAT_TWO_NUM        PINC2
 
+// MARK: ENC28J60
+#define ENC_INT_DDR         DDRD
+#define ENC_INT_PORT        PORTD
+#define ENC_INT_PIN         PIND
+#define ENC_INT_NUM         PIND4
+#define ENC_INT_PCMSK       PCMSK2
+#define ENC_INT_PCINT       PCINT20
+#define ENC_INT_PCIE        PCIE2
+#define ENC_INT_vect        PCINT2_vect
+
+// MARK: Control protocol
+// Optional clear to send output for the control protocol, low while a request can be accepted
+//#define CONTROL_CTS_DDR     DDRC
+//#define CONTROL_CTS_PORT    PORTC
+//#define CONTROL_CTS_NUM     PINC1
+
 // MARK: OSCCAL
 #define OSCCAL_OUT_DDR      DDRB
 #define OSCCAL_OUT_PORT     PORTB
@@ -59,7 +75,6 @@
 // MARK: Flags
 #define FLAG_OSCAL_MODE         7
 #define FLAG_SERIAL_LOOPBACK    6
-#define FLAG_SERIAL_TX_LOCK     5
 #define FLAG_STAT_ONE_ON        1
 #define FLAG_ONLINE             0
 
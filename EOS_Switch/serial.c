@@ -10,236 +10,422 @@
 
 
 #include "pindefinitions.h"
+#include "control.h"
 
 #include <avr/io.h>
 #include <util/atomic.h>
 #include <avr/eeprom.h>
 #include <ctype.h>
+#include <string.h>
 
-#define serial_in_buffer_length     256
-#define serial_out_buffer_length    256
+// The baud rate is computed at compile time, setbaud selects double speed mode (U2X) if the rate needs it. From the
+// calibrated internal 8 MHz oscillator, 250000 baud is exact without it (UBRR 1).
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 250000UL
+#endif
+#define BAUD SERIAL_BAUD
+#include <util/setbaud.h>
 
-static char serial_in_buffer[serial_in_buffer_length];
-static char serial_out_buffer[serial_out_buffer_length];
+#define serial_in_buffer_length     128             // Must be a power of two, at most 128
+#define serial_out_buffer_length    64              // Must be a power of two
+#define serial_out_queue_length     16              // Must be a power of two
+#define serial_echo_buffer_length   16              // Must be a power of two
+#define serial_line_queue_length    8               // Must be a power of two
+
+// All buffers are single-producer/single-consumer rings. Each index is only ever written by one side and, being a
+// single byte, is read and written atomically, so neither side has to disable interrupts for copies.
+// The in indices run freely over 0-255 and are masked when the buffer is accessed, so that the bytes in the buffer are
+// always their difference.
+//  in:    Produced by the RX ISR, consumed by the main loop
+//  queue: Produced by the main loop, consumed by the UDRE ISR
+//  out:   Produced by the main loop, consumed by the UDRE ISR through the RAM descriptors in the queue
+//  echo:  Produced by the RX ISR (loop back), consumed by the UDRE ISR
+// A ring is full when advancing the insertion point would make it equal to the withdrawal point. Output that does
+// not fit is dropped (the newest data is lost, never data that is already queued) and counted.
+
+// Output is queued as descriptors which the UDRE ISR walks in order. Strings in program memory and EEPROM are
+// fetched by the ISR one byte at a time, so they cost no RAM and may be longer than the out buffer. Only strings
+// from RAM, which may not outlive the call, are copied into the out buffer.
+enum serial_source {SERIAL_SOURCE_RAM, SERIAL_SOURCE_RAW, SERIAL_SOURCE_PROGMEM, SERIAL_SOURCE_EEPROM};
+
+struct serial_descriptor {
+    uint8_t source;
+    union {
+        uint16_t addr;                              // Address of the next byte (PROGMEM and EEPROM, nul terminated)
+        uint8_t length;                             // Number of bytes left in the out buffer (RAM and RAW)
+    };
+};
+
+static volatile char serial_in_buffer[serial_in_buffer_length];
+static volatile char serial_out_buffer[serial_out_buffer_length];
+static volatile struct serial_descriptor serial_out_queue[serial_out_queue_length];
+static volatile char serial_echo_buffer[serial_echo_buffer_length];
 
 static volatile uint8_t in_buffer_insert_p;
 static volatile uint8_t in_buffer_withdraw_p;
 static volatile uint8_t out_buffer_insert_p;
 static volatile uint8_t out_buffer_withdraw_p;
+static volatile uint8_t out_queue_insert_p;
+static volatile uint8_t out_queue_withdraw_p;
+static volatile uint8_t echo_buffer_insert_p;
+static volatile uint8_t echo_buffer_withdraw_p;
 
-void init_serial (void)
+// Completed input lines. The RX ISR records the offset of each terminator, so that finding and copying a line
+// never requires a scan of the input buffer. A line is pending while received != consumed.
+static volatile uint8_t in_line_ends[serial_line_queue_length];
+static volatile uint8_t in_lines_received;          // Only written by the RX ISR
+static volatile uint8_t in_lines_consumed;          // Only written by the main loop
+
+static volatile uint8_t out_pending_cr;             // Set when a carriage return has to follow the last byte sent
+
+static volatile uint16_t in_overflows;
+static uint16_t out_overflows;
+
+// MARK: Output
+static inline void serial_start_tx (void)
 {
-    serial_in_buffer[in_buffer_insert_p] = '\0';
-    serial_out_buffer[out_buffer_insert_p] = '\0';
+    UCSR0B |= (1<<UDRIE0);                          // The UDRE ISR disables itself once there is nothing left to send
+}
+
+static inline uint8_t serial_out_queue_full (void)
+{
+    return ((out_queue_insert_p + 1) & (serial_out_queue_length - 1)) == out_queue_withdraw_p;
+}
+
+/**
+ *  Queues a descriptor for a nul terminated string in program memory or EEPROM
+ */
+static void serial_out_queue_string (uint8_t source, uint16_t addr)
+{
+    if (serial_out_queue_full()) {
+        out_overflows++;
+        return;
+    }
     
-    UBRR0H = 0;                                     // Set baud rate (38.4Kbaud at 8mhz clock)
-    UBRR0L = 12;
-    //UBRR0L = 3;
-    UCSR0B |= (1<<TXEN0)|(1<<TXCIE0)|(1<<RXEN0)|(1<<RXCIE0); // Enable transmitter and reciver, TX and RX interupts enabled
-    UCSR0C = (1<<UCSZ00)|(1<<UCSZ01);               // Set frame format: 8 data, 1 stop bit(s)
+    serial_out_queue[out_queue_insert_p].source = source;
+    serial_out_queue[out_queue_insert_p].addr = addr;
+    out_queue_insert_p = (out_queue_insert_p + 1) & (serial_out_queue_length - 1);     // Publish to the ISR
+    serial_start_tx();
 }
 
-void serial_put_string (char *str)
+/**
+ *  Copies bytes from RAM into the out buffer and queues them
+ *  @param source SERIAL_SOURCE_RAM or SERIAL_SOURCE_RAW (sent without inserting carriage returns)
+ */
+static void serial_out_queue_ram (uint8_t source, const char *str, size_t length)
 {
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        for (int i = 0; str[i] != '\0'; i++) {
-            serial_out_buffer[out_buffer_insert_p] = str[i];
-            out_buffer_insert_p++;
-            if (out_buffer_insert_p == out_buffer_withdraw_p) {
-                out_buffer_withdraw_p++;
-            }
-            
-            if (str[i] == '\n') {                   // Insert a carriage return after new lines
-                serial_out_buffer[out_buffer_insert_p] = '\r';
-                out_buffer_insert_p++;
-                if (out_buffer_insert_p == out_buffer_withdraw_p) {
-                    out_buffer_withdraw_p++;
-                }
-            }
+    uint8_t free = serial_out_free();
+    if (length > free) {
+        out_overflows += length - free;
+        length = free;
+    }
+    if (length == 0) {
+        return;
+    }
+    
+    // The bytes past the insertion point are not visible to the ISR until they are accounted for in a descriptor
+    uint8_t insert = out_buffer_insert_p;
+    for (uint8_t i = 0; i < length; i++) {
+        serial_out_buffer[insert] = str[i];
+        insert = (insert + 1) & (serial_out_buffer_length - 1);
+    }
+    
+    // Extend the last descriptor if it is of the same type, so that consecutive small writes share one. The ISR
+    // removes RAM descriptors as soon as they are used up, so this short check-and-extend has to be atomic.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t last = (out_queue_insert_p - 1) & (serial_out_queue_length - 1);
+        if ((out_queue_withdraw_p != out_queue_insert_p) && (serial_out_queue[last].source == source)) {
+            serial_out_queue[last].length += length;
+            out_buffer_insert_p = insert;
+        } else if (!serial_out_queue_full()) {
+            serial_out_queue[out_queue_insert_p].source = source;
+            serial_out_queue[out_queue_insert_p].length = length;
+            out_queue_insert_p = (out_queue_insert_p + 1) & (serial_out_queue_length - 1);
+            out_buffer_insert_p = insert;
+        } else {
+            out_overflows += length;
         }
-        serial_out_buffer[out_buffer_insert_p] = '\0';
     }
+    serial_start_tx();
 }
 
-void serial_put_string_P (const char *str)
+/**
+ *  Reads a byte from EEPROM from within an ISR
+ *  @note The address and data registers are restored as the main loop might be in the middle of an EEPROM access
+ */
+static inline char serial_isr_eeprom_read (uint16_t addr)
 {
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        char next = pgm_read_byte(&str[0]);
-        for (int i = 0; next != '\0'; i++, next = pgm_read_byte(&str[i])) {
-            serial_out_buffer[out_buffer_insert_p] = next;
-            out_buffer_insert_p++;
-            if (out_buffer_insert_p == out_buffer_withdraw_p) {
-                out_buffer_withdraw_p++;
-            }
-            
-            if (next == '\n') {                     // Insert a carriage return after new lines
-                serial_out_buffer[out_buffer_insert_p] = '\r';
-                out_buffer_insert_p++;
-                if (out_buffer_insert_p == out_buffer_withdraw_p) {
-                    out_buffer_withdraw_p++;
-                }
-            }
-        }
-        serial_out_buffer[out_buffer_insert_p] = '\0';
+    uint16_t saved_addr = EEAR;
+    uint8_t saved_data = EEDR;
+    
+    EEAR = addr;
+    EECR |= (1<<EERE);
+    char c = EEDR;
+    
+    EEAR = saved_addr;
+    EEDR = saved_data;
+    return c;
+}
+
+static void serial_echo_append (char c)
+{
+    uint8_t next = (echo_buffer_insert_p + 1) & (serial_echo_buffer_length - 1);
+    if (next != echo_buffer_withdraw_p) {
+        serial_echo_buffer[echo_buffer_insert_p] = c;
+        echo_buffer_insert_p = next;
     }
 }
 
-void serial_put_from_eeprom (uint16_t addr)
+static void serial_echo_string (char *str)
 {
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        char next = eeprom_read_byte(addr);
-        for (int i = 0; next != '\0'; i++, next = eeprom_read_byte((addr + i))) {
-            serial_out_buffer[out_buffer_insert_p] = next;
-            out_buffer_insert_p++;
-            if (out_buffer_insert_p == out_buffer_withdraw_p) {
-                out_buffer_withdraw_p++;
-            }
-            
-            if (next == '\n') {                       // Insert a carriage return after new lines
-                serial_out_buffer[out_buffer_insert_p] = '\r';
-                out_buffer_insert_p++;
-                if (out_buffer_insert_p == out_buffer_withdraw_p) {
-                    out_buffer_withdraw_p++;
-                }
-            }
-        }
-        serial_out_buffer[out_buffer_insert_p] = '\0';
+    for (int i = 0; str[i] != '\0'; i++) {
+        serial_echo_append(str[i]);
     }
 }
 
+void init_serial (void)
+{
+    UBRR0H = UBRRH_VALUE;                           // Set baud rate (SERIAL_BAUD)
+    UBRR0L = UBRRL_VALUE;
+#if USE_2X
+    UCSR0A |= (1<<U2X0);
+#else
+    UCSR0A &= ~(1<<U2X0);
+#endif
+    UCSR0B |= (1<<TXEN0)|(1<<RXEN0)|(1<<RXCIE0);    // Enable transmitter and reciver, RX interupt enabled (UDRE interupt is enabled when there is data to send)
+    UCSR0C = (1<<UCSZ00)|(1<<UCSZ01);               // Set frame format: 8 data, 1 stop bit(s)
+}
+
+void serial_put_string (char *str)
+{
+    serial_out_queue_ram(SERIAL_SOURCE_RAM, str, strlen(str));
+}
+
+void serial_put_string_P (const char *str)
+{
+    serial_out_queue_string(SERIAL_SOURCE_PROGMEM, (uint16_t)str);
+}
+
+void serial_put_from_eeprom (uint16_t addr)
+{
+    serial_out_queue_string(SERIAL_SOURCE_EEPROM, addr);
+}
+
 void serial_put_byte (char c)
 {
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {             // Must use restorestate as this function may be called from ISR
-        serial_out_buffer[out_buffer_insert_p] = c;
-        out_buffer_insert_p++;
-        serial_out_buffer[out_buffer_insert_p] = '\0';
-        if (out_buffer_insert_p == out_buffer_withdraw_p) {
-            out_buffer_withdraw_p++;
-        }
-    }
-    
-    if (c == '\n') {                                // Insert a carriage return after new lines
-        serial_put_byte('\r');
+    serial_out_queue_ram(SERIAL_SOURCE_RAM, &c, 1);
+}
+
+void serial_put_raw (const uint8_t *data, uint8_t length)
+{
+    serial_out_queue_ram(SERIAL_SOURCE_RAW, (const char *)data, length);
+}
+
+uint8_t serial_out_free (void)
+{
+    return (out_buffer_withdraw_p - out_buffer_insert_p - 1) & (serial_out_buffer_length - 1);
+}
+
+uint8_t serial_out_idle (void)
+{
+    return out_queue_withdraw_p == out_queue_insert_p;
+}
+
+uint16_t serial_get_out_overflows (void)
+{
+    return out_overflows;
+}
+
+// MARK: Input
+static inline uint8_t serial_in_full (void)
+{
+    return (uint8_t)(in_buffer_insert_p - in_buffer_withdraw_p) == serial_in_buffer_length;
+}
+
+/**
+ *  Must be called before consuming a byte from the input buffer to keep track of the completed lines
+ */
+static inline void serial_in_consume (void)
+{
+    if ((in_lines_received != in_lines_consumed) &&
+        (in_buffer_withdraw_p == in_line_ends[in_lines_consumed & (serial_line_queue_length - 1)])) {
+        in_lines_consumed++;
     }
+    in_buffer_withdraw_p++;
 }
 
 int serial_has_line (void)
 {
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        for (int i = in_buffer_withdraw_p; i != in_buffer_insert_p; i++) {
-            if (serial_in_buffer[i] == '\n') {
-                return 1;
-            }
-        }
-    }
-    return 0;
+    // A full buffer without a new line would never be read, so it is treated as a line
+    return (in_lines_received != in_lines_consumed) || serial_in_full();
 }
 
 void serial_get_string (char *str, int len)
 {
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        for (int i = 0; i < (len - 1); i++) {
-            if (in_buffer_withdraw_p != in_buffer_insert_p) {
-                str[i] = serial_in_buffer[in_buffer_withdraw_p];
-                in_buffer_withdraw_p++;
-            } else {
-                str[i] = '\0';
-                return;
-            }
-        }
+    int i = 0;
+    
+    for (; (i < (len - 1)) && (in_buffer_withdraw_p != in_buffer_insert_p); i++) {
+        str[i] = serial_in_buffer[in_buffer_withdraw_p & (serial_in_buffer_length - 1)];
+        serial_in_consume();
     }
+    str[i] = '\0';
 }
 
 extern void serial_get_line (char *str, int len) {
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        for (int i = 0; i < (len - 1); i++) {
-            if (in_buffer_withdraw_p != in_buffer_insert_p) {
-                if (serial_in_buffer[in_buffer_withdraw_p] == '\n') {
-                    str[i] = '\0';
-                    in_buffer_withdraw_p++;
-                    return;
-                    
-                } else {
-                    str[i] = serial_in_buffer[in_buffer_withdraw_p];
-                    in_buffer_withdraw_p++;
-                }
-            } else {
-                str[i] = '\0';
-                return;
-            }
-        }
+    uint8_t has_terminator = (in_lines_received != in_lines_consumed);
+    uint8_t end = has_terminator ? in_line_ends[in_lines_consumed & (serial_line_queue_length - 1)] : in_buffer_insert_p;
+    uint8_t length = end - in_buffer_withdraw_p;
+    int i = 0;
+    
+    for (; (i < length) && (i < (len - 1)); i++) {
+        str[i] = serial_in_buffer[(in_buffer_withdraw_p + i) & (serial_in_buffer_length - 1)];
+    }
+    str[i] = '\0';
+    
+    // The whole line is consumed, even if it did not fit into str
+    if (has_terminator) {
+        in_buffer_withdraw_p = end + 1;
+        in_lines_consumed++;
+    } else {
+        in_buffer_withdraw_p = end;
     }
 }
 
 char serial_get_byte (void)
 {
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        in_buffer_withdraw_p = (in_buffer_withdraw_p == in_buffer_insert_p) ? in_buffer_withdraw_p : in_buffer_withdraw_p + 1;
+    if (in_buffer_withdraw_p == in_buffer_insert_p) {
+        return '\0';
     }
-    return serial_in_buffer[in_buffer_withdraw_p];
+    char c = serial_in_buffer[in_buffer_withdraw_p & (serial_in_buffer_length - 1)];
+    serial_in_consume();
+    return c;
 }
 
 char serial_peak_byte (void)
 {
-    int index;
-    ATOMIC_BLOCK(ATOMIC_FORCEON) {
-        index = (in_buffer_withdraw_p == in_buffer_insert_p) ? in_buffer_withdraw_p : in_buffer_withdraw_p + 1;
+    if (in_buffer_withdraw_p == in_buffer_insert_p) {
+        return '\0';
+    }
+    return serial_in_buffer[in_buffer_withdraw_p & (serial_in_buffer_length - 1)];
+}
+
+uint16_t serial_get_in_overflows (void)
+{
+    uint16_t count;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {                  // Two byte counter written by the RX ISR
+        count = in_overflows;
     }
-    return serial_in_buffer[index];
+    return count;
 }
 
 void serial_service (void)
 {
-    // If serial transmition is not locked (IE. a transmition is not already in progress concurently via the TX ISR) and there
-    // are avaliable bytes, write a byte to the serial port and lock transmition. This will start transmition of all avaliable
-    // byte concurently via the ISR.
-    if ((!(flags & (1<<FLAG_SERIAL_TX_LOCK))) && (out_buffer_withdraw_p != out_buffer_insert_p)) {
-        flags |= (1<<FLAG_SERIAL_TX_LOCK);
-        UDR0 = serial_out_buffer[out_buffer_withdraw_p];
-        out_buffer_withdraw_p++;
+    // Make sure transmition is running if there is anything to send (the ISR pauses while the EEPROM is busy)
+    if ((out_queue_withdraw_p != out_queue_insert_p) || (echo_buffer_withdraw_p != echo_buffer_insert_p)) {
+        serial_start_tx();
     }
 }
 
 // MARK: Interupt service routines
-ISR (USART_TX_vect)                                 // Transmit finished on USART0
+ISR (USART_UDRE_vect)                               // Data register empty on USART0
 {
-    if (out_buffer_withdraw_p != out_buffer_insert_p) {
-        UDR0 = serial_out_buffer[out_buffer_withdraw_p];
-        out_buffer_withdraw_p++;
-    } else {
-        flags &= ~(1<<FLAG_SERIAL_TX_LOCK);         // Clear serial transmition lock
+    if (out_pending_cr) {                           // Insert a carriage return after new lines
+        UDR0 = '\r';
+        out_pending_cr = 0;
+        return;
+    }
+    
+    // Echoed input goes first so that typing stays responsive even while long output is queued
+    if (echo_buffer_withdraw_p != echo_buffer_insert_p) {
+        UDR0 = serial_echo_buffer[echo_buffer_withdraw_p];
+        echo_buffer_withdraw_p = (echo_buffer_withdraw_p + 1) & (serial_echo_buffer_length - 1);
+        return;
     }
+    
+    while (out_queue_withdraw_p != out_queue_insert_p) {
+        volatile struct serial_descriptor *desc = &serial_out_queue[out_queue_withdraw_p];
+        char c;
+        
+        if ((desc->source == SERIAL_SOURCE_RAM) || (desc->source == SERIAL_SOURCE_RAW)) {
+            c = serial_out_buffer[out_buffer_withdraw_p];
+            out_buffer_withdraw_p = (out_buffer_withdraw_p + 1) & (serial_out_buffer_length - 1);
+            if (--desc->length == 0) {
+                out_queue_withdraw_p = (out_queue_withdraw_p + 1) & (serial_out_queue_length - 1);
+            }
+        } else {
+            if (desc->source == SERIAL_SOURCE_PROGMEM) {
+                c = pgm_read_byte((const char *)desc->addr);
+            } else if (EECR & (1<<EEPE)) {
+                // An EEPROM write is in progress, try again from serial_service
+                UCSR0B &= ~(1<<UDRIE0);
+                return;
+            } else {
+                c = serial_isr_eeprom_read(desc->addr);
+            }
+            
+            if (c == '\0') {
+                out_queue_withdraw_p = (out_queue_withdraw_p + 1) & (serial_out_queue_length - 1);
+                continue;
+            }
+            desc->addr++;
+        }
+        
+        UDR0 = c;
+        out_pending_cr = (c == '\n') && (desc->source != SERIAL_SOURCE_RAW);
+        return;
+    }
+    
+    UCSR0B &= ~(1<<UDRIE0);                         // Nothing left to send
 }
 
 ISR (USART_RX_vect)                                 // Recieved byte on USART0
 {
-//    uint8_t usart_state = UCSR0A;                 //get state before data!
+    uint8_t usart_state = UCSR0A;                   //get state before data!
     uint8_t usart_byte = UDR0;                      //get data
-    //TODO: Check state to make sure nothing exploded
+    
+    // A break or a glitch while a host connects arrives as a 0x00 with a framing error, which would otherwise start a
+    // control frame
+    if (usart_state & (1<<FE0)) {
+        return;
+    }
+    
+    if (control_receive_byte(usart_byte)) {         // Bytes of binary control frames never reach the line buffer
+        return;
+    }
     
     usart_byte = (usart_byte == '\r') ? '\n' : usart_byte;
     
     if (!iscntrl(usart_byte) || (usart_byte == '\n')) {
-        serial_in_buffer[in_buffer_insert_p] = usart_byte;
-        in_buffer_insert_p++;
-        serial_in_buffer[in_buffer_insert_p] = '\0';
-        if (in_buffer_insert_p == in_buffer_withdraw_p) {
-            in_buffer_withdraw_p++;
+        if (serial_in_full() || ((usart_byte == '\n') &&
+                                 ((uint8_t)(in_lines_received - in_lines_consumed) >= serial_line_queue_length))) {
+            in_overflows++;
+            return;                                 // Dropped, so don't echo it either
         }
+        if (usart_byte == '\n') {
+            in_line_ends[in_lines_received & (serial_line_queue_length - 1)] = in_buffer_insert_p;
+            in_lines_received++;
+        }
+        serial_in_buffer[in_buffer_insert_p & (serial_in_buffer_length - 1)] = usart_byte;
+        in_buffer_insert_p++;
     }
     
-    // If loop back is enabled, append the recieved byte to the output buffer
+    // If loop back is enabled, append the recieved byte to the echo buffer
     if (flags & (1<<FLAG_SERIAL_LOOPBACK) && isprint(usart_byte)) {
-        serial_put_byte(usart_byte);
+        serial_echo_append(usart_byte);
     } else if (flags & (1<<FLAG_SERIAL_LOOPBACK) && (usart_byte == '\n')) {
-        serial_put_byte(usart_byte);
-    } else if (flags & (1<<FLAG_SERIAL_LOOPBACK) && (usart_byte == 127) && (in_buffer_withdraw_p != in_buffer_insert_p)) {
-        in_buffer_insert_p --;
-        serial_put_byte(0x1B);
-        serial_put_string("[1D");
-        serial_put_byte(0x1B);
-        serial_put_string("[K");
+        serial_echo_append('\n');
+        serial_echo_append('\r');
+    } else if (flags & (1<<FLAG_SERIAL_LOOPBACK) && (usart_byte == 127) && (in_buffer_withdraw_p != in_buffer_insert_p) &&
+               (serial_in_buffer[(in_buffer_insert_p - 1) & (serial_in_buffer_length - 1)] != '\n')) {
+        in_buffer_insert_p --;                      // Only ever takes back bytes of the line that is still being typed
+        serial_echo_append(0x1B);
+        serial_echo_string("[1D");
+        serial_echo_append(0x1B);
+        serial_echo_string("[K");
+    } else {
+        return;
     }
+    UCSR0B |= (1<<UDRIE0);
 }
 
 // ^ = insertion point
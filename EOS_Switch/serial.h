@@ -25,14 +25,15 @@ extern void serial_put_string (char *str);
 
 /**
  *  Writes a string to the serial output from program memory
+ *  @note The string is read while it is being sent, it is not copied
  *  @param str A pointer to a programs space pointer to where the string is stored
  */
 extern void serial_put_string_P (const char *str);
 
 /**
  *  Writes a string to the serial output from EEPROM
+ *  @note The string is read while it is being sent, it is not copied
  *  @param addr The addres of the string in EEPROM
- *  @param length The length of the string
  */
 extern void serial_put_from_eeprom (uint16_t addr);
 
@@ -42,6 +43,38 @@ extern void serial_put_from_eeprom (uint16_t addr);
  */
 extern void serial_put_byte (char c);
 
+/**
+ *  Writes binary data to the serial output, no carriage returns are inserted
+ *  @param data The data to be written
+ *  @param length The number of bytes to be written
+ */
+extern void serial_put_raw (const uint8_t *data, uint8_t length);
+
+/**
+ *  Get the number of bytes from RAM that can currently be written to the serial output without being dropped
+ *  @note Strings from program memory and EEPROM are not copied and only take up a slot in the output queue
+ *  @return The number of free bytes in the output buffer
+ */
+extern uint8_t serial_out_free (void);
+
+/**
+ *  Determin if all queued output has been handed to the UART
+ *  @return 1 if the output queue is empty, 0 otherwise
+ */
+extern uint8_t serial_out_idle (void);
+
+/**
+ *  Get the amount of output that was dropped because the output buffer or queue was full
+ *  @return The number of dropped output bytes and strings
+ */
+extern uint16_t serial_get_out_overflows (void);
+
+/**
+ *  Get the number of recieved bytes that were dropped because the input buffer was full
+ *  @return The number of dropped input bytes
+ */
+extern uint16_t serial_get_in_overflows (void);
+
 /**
  *  Read a bytes from the serial input as a string
  *  @param str The string in which the data should be stored
@@ -51,12 +84,14 @@ extern void serial_get_string (char *str, int len);
 
 /**
  *  Determin if there is a full line avaliable to be read from the serial input
+ *  @note Does not scan the input, the lines are counted as they are recieved
  *  @return 0 if there is no line avaliable, 1 if a line is avaliable
  */
 extern int serial_has_line (void);
 
 /**
  *  Read a bytes from the serial input as a string up to the next newline character
+ *  @note The whole line is consumed, characters that do not fit into str are discarded
  *  @param str The string in which the data should be stored
  *  @param len The maximum number of chars to be read from the serial input
  */
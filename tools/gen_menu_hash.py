@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#
+#  gen_menu_hash.py
+#  EOS_Switch
+#
+#  Regenerates the perfect hash of the command and setting table in main.c (menu_slots, MENU_HASH_SEED,
+#  MENU_HASH_MULTIPLIER and MENU_HASH_SLOTS) from the names of the entries in menu_entries. The current seed and
+#  multiplier are kept while all names still map to different slots, otherwise the smallest table for which a seed
+#  and multiplier can be found is used. Entries which are only compiled with some feature (#ifdef) keep their guard
+#  and their slot in every configuration.
+#
+#  Usage: gen_menu_hash.py [--check] [path to main.c]
+#      --check     Only verify that main.c is up to date, exit with status 1 if it isn't
+#
+
+import os
+import re
+import sys
+
+MAIN_C = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'EOS_Switch', 'main.c')
+
+
+def menu_hash(name, seed, multiplier):
+    # Same as menu_hash in main.c
+    value = seed
+    for c in name:
+        value = ((value * multiplier) ^ (ord(c) | 0x20)) & 0xFF
+    return value
+
+
+def find_slots(names, seed, multiplier, slots):
+    result = [menu_hash(name, seed, multiplier) & (slots - 1) for name in names]
+    return result if len(set(result)) == len(result) else None
+
+
+def read_entries(source):
+    # The entries of menu_entries in order, with the preprocessor condition they are compiled under
+    names = dict(re.findall(r'static const char (menu_name_\w+)\[\] PROGMEM =\s*"([^"]+)"', source))
+    table = re.search(r'static const struct menu_entry menu_entries\[\] PROGMEM = \{\n(.*?)\n\};', source, re.S)
+    entries = []
+    guards = []
+    for line in table.group(1).split('\n'):
+        line = line.strip()
+        if line.startswith('#if'):
+            guards.append(line)
+        elif line.startswith('#endif'):
+            guards.pop()
+        else:
+            match = re.match(r'\[(MENU_\w+)\]\s*=\s*\{(menu_name_\w+)', line)
+            if match:
+                entries.append((match.group(1), names[match.group(2)], tuple(guards)))
+    return entries
+
+
+def format_slots(entries, slots, slot_count):
+    width = len('[%d] = ' % (slot_count - 1))
+    lines = []
+    guards = ()
+    for (entry, _, entry_guards), slot in zip(entries, slots):
+        if entry_guards != guards:
+            for guard in reversed(guards):
+                lines.append('#endif // ' + guard.split()[-1])
+            lines.extend(entry_guards)
+            guards = entry_guards
+        lines.append('    ' + ('[%d] = ' % slot).ljust(width) + entry + ' + 1,')
+    for guard in reversed(guards):
+        lines.append('#endif // ' + guard.split()[-1])
+    # No comma after the last entry
+    last = max(i for i, line in enumerate(lines) if not line.startswith('#'))
+    lines[last] = lines[last][:-1]
+    return '\n'.join(lines)
+
+
+def main(args):
+    check = '--check' in args
+    paths = [arg for arg in args if arg != '--check']
+    path = paths[0] if paths else MAIN_C
+
+    with open(path) as f:
+        source = f.read()
+
+    entries = read_entries(source)
+    names = [name for _, name, _ in entries]
+    seed = int(re.search(r'#define MENU_HASH_SEED\s+(\d+)', source).group(1))
+    multiplier = int(re.search(r'#define MENU_HASH_MULTIPLIER\s+(\d+)', source).group(1))
+    slot_count = int(re.search(r'#define MENU_HASH_SLOTS\s+(\d+)', source).group(1))
+
+    slots = find_slots(names, seed, multiplier, slot_count)
+    if not slots:
+        # Only odd multipliers keep all bits of the hash
+        slot_count = 1
+        while not slots:
+            slot_count *= 2
+            if slot_count > 256:
+                sys.exit('No perfect hash found for %d names' % len(names))
+            for multiplier in range(3, 256, 2):
+                for seed in range(256):
+                    slots = find_slots(names, seed, multiplier, slot_count)
+                    if slots:
+                        break
+                if slots:
+                    break
+
+    generated = re.sub(r'(static const uint8_t menu_slots\[MENU_HASH_SLOTS\] PROGMEM = \{\n).*?(\n\};)',
+                       lambda m: m.group(1) + format_slots(entries, slots, slot_count) + m.group(2), source,
+                       flags=re.S)
+    generated = re.sub(r'(#define MENU_HASH_SEED\s+)\d+', lambda m: m.group(1) + str(seed), generated)
+    generated = re.sub(r'(#define MENU_HASH_MULTIPLIER\s+)\d+', lambda m: m.group(1) + str(multiplier), generated)
+    generated = re.sub(r'(#define MENU_HASH_SLOTS\s+)\d+', lambda m: m.group(1) + str(slot_count), generated)
+
+    if check:
+        if generated != source:
+            sys.exit('%s: menu_slots is out of date, run %s' % (path, os.path.basename(__file__)))
+        return
+
+    if generated != source:
+        with open(path, 'w') as f:
+            f.write(generated)
+    print('%d entries, seed %d, multiplier %d, %d slots' % (len(entries), seed, multiplier, slot_count))
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])